@@ -0,0 +1,119 @@
+#pragma once
+#include <cstddef>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace android {
+
+    // A move-only void() callable for ALooper::post() and AHandler::post().
+    // Functors up to kInlineSize bytes (a lambda capturing a few pointers or
+    // a shared_ptr) are stored inline; larger ones are moved to the heap.
+    struct ACallable {
+        enum {
+            kInlineSize = 48,
+        };
+
+        ACallable() : mOps(nullptr) {}
+
+        template <typename F,
+            typename = typename std::enable_if<
+                !std::is_same<typename std::decay<F>::type, ACallable>::value>::type>
+        ACallable(F&& f) : mOps(nullptr) {
+            typedef typename std::decay<F>::type Functor;
+            if constexpr (sizeof(Functor) <= kInlineSize
+                    && alignof(Functor) <= alignof(std::max_align_t)
+                    && std::is_nothrow_move_constructible<Functor>::value) {
+                new (mStorage) Functor(std::forward<F>(f));
+                mOps = &InlineOps<Functor>::kOps;
+            }
+            else {
+                *reinterpret_cast<Functor**>(mStorage) = new Functor(std::forward<F>(f));
+                mOps = &HeapOps<Functor>::kOps;
+            }
+        }
+
+        ACallable(ACallable&& other) noexcept : mOps(other.mOps) {
+            if (mOps != nullptr) {
+                mOps->move(mStorage, other.mStorage);
+                other.mOps = nullptr;
+            }
+        }
+
+        ACallable& operator=(ACallable&& other) noexcept {
+            if (this != &other) {
+                reset();
+                mOps = other.mOps;
+                if (mOps != nullptr) {
+                    mOps->move(mStorage, other.mStorage);
+                    other.mOps = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        ~ACallable() {
+            reset();
+        }
+
+        explicit operator bool() const {
+            return mOps != nullptr;
+        }
+
+        void operator()() {
+            mOps->invoke(mStorage);
+        }
+
+        void reset() {
+            if (mOps != nullptr) {
+                mOps->destroy(mStorage);
+                mOps = nullptr;
+            }
+        }
+
+    private:
+        struct Ops {
+            void (*invoke)(void* storage);
+            // move-constructs into |to| and destroys |from|
+            void (*move)(void* to, void* from);
+            void (*destroy)(void* storage);
+        };
+
+        template <typename Functor>
+        struct InlineOps {
+            static void invoke(void* storage) {
+                (*static_cast<Functor*>(storage))();
+            }
+            static void move(void* to, void* from) {
+                new (to) Functor(std::move(*static_cast<Functor*>(from)));
+                static_cast<Functor*>(from)->~Functor();
+            }
+            static void destroy(void* storage) {
+                static_cast<Functor*>(storage)->~Functor();
+            }
+            static constexpr Ops kOps = { invoke, move, destroy };
+        };
+
+        template <typename Functor>
+        struct HeapOps {
+            static void invoke(void* storage) {
+                (**static_cast<Functor**>(storage))();
+            }
+            static void move(void* to, void* from) {
+                *static_cast<Functor**>(to) = *static_cast<Functor**>(from);
+            }
+            static void destroy(void* storage) {
+                delete *static_cast<Functor**>(storage);
+            }
+            static constexpr Ops kOps = { invoke, move, destroy };
+        };
+
+        alignas(std::max_align_t) unsigned char mStorage[kInlineSize];
+        const Ops* mOps;
+
+        ACallable(const ACallable&) = delete;
+        ACallable& operator=(const ACallable&) = delete;
+    };
+
+}  // namespace android
@@ -0,0 +1,323 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <new>
+#include <thread>
+#include <utility>
+
+#include "ALooper.h"
+#include "AHandler.h"
+#include "AMessage.h"
+#include "Logger.h"
+
+#ifndef __cpp_impl_coroutine
+#error "ACoroutine.h requires C++20 coroutines"
+#endif
+#include <coroutine>
+
+// Coroutine support for multi-step handler workflows. The library itself is
+// built as C++17; only code that includes this header needs C++20.
+//
+//     ATask SampleHandler::onStart(std::shared_ptr<AMessage> query) {
+//         std::shared_ptr<AMessage> response;
+//         if (co_await query->request(&response) != OK) {
+//             co_return;
+//         }
+//         co_await delay(10000);
+//         co_await mWorkLooper->schedule();
+//         ...    // now running on mWorkLooper
+//     }
+//
+// A coroutine resumes where it was running when it suspended: on the handler
+// whose message or callable started it, serialized with that handler's
+// messages, or on the looper it last hopped to with schedule(). If that
+// handler or looper is gone by then, the coroutine frame is destroyed
+// without resuming, which runs the destructors of its locals.
+//
+// schedule() onto an ALooperPool resumes on the pool's shared strand, the
+// one all callables posted to the pool itself run on: coroutines scheduled
+// there run one at a time, not in parallel on the pool's workers.
+
+namespace android {
+
+    // Recycles coroutine frames per thread in 64 byte size classes, so that
+    // starting a coroutine on a looper normally does not hit the allocator.
+    // A frame freed on another thread than it was allocated on is cached
+    // there. Frames above kMaxPooledSize use operator new.
+    struct AFramePool {
+        enum {
+            kGranularity = 64,
+            kNumClasses = 16,
+            kMaxPooledSize = kGranularity * kNumClasses,
+            // per thread and size class; the rest is freed
+            kMaxCachedFrames = 64,
+        };
+
+        static void* allocate(size_t size) {
+            size_t sizeClass = classOf(size);
+            if (sizeClass >= kNumClasses) {
+                return ::operator new(size);
+            }
+            Cache& cache = sCache;
+            FreeFrame* frame = cache.mFree[sizeClass];
+            if (frame == nullptr) {
+                return ::operator new((sizeClass + 1) * kGranularity);
+            }
+            cache.mFree[sizeClass] = frame->mNext;
+            cache.mCount[sizeClass]--;
+            return frame;
+        }
+
+        static void release(void* ptr, size_t size) {
+            size_t sizeClass = classOf(size);
+            if (sizeClass >= kNumClasses) {
+                ::operator delete(ptr);
+                return;
+            }
+            Cache& cache = sCache;
+            if (cache.mCount[sizeClass] >= kMaxCachedFrames) {
+                ::operator delete(ptr);
+                return;
+            }
+            FreeFrame* frame = static_cast<FreeFrame*>(ptr);
+            frame->mNext = cache.mFree[sizeClass];
+            cache.mFree[sizeClass] = frame;
+            cache.mCount[sizeClass]++;
+        }
+
+    private:
+        struct FreeFrame {
+            FreeFrame* mNext;
+        };
+
+        struct Cache {
+            FreeFrame* mFree[kNumClasses] = {};
+            uint32_t mCount[kNumClasses] = {};
+
+            ~Cache() {
+                for (FreeFrame* frame : mFree) {
+                    while (frame != nullptr) {
+                        FreeFrame* next = frame->mNext;
+                        ::operator delete(frame);
+                        frame = next;
+                    }
+                }
+            }
+        };
+
+        static size_t classOf(size_t size) {
+            return size == 0 ? 0 : (size - 1) / kGranularity;
+        }
+
+        static thread_local Cache sCache;
+    };
+
+    // static
+    inline thread_local AFramePool::Cache AFramePool::sCache;
+
+    // Return type of a fire-and-forget coroutine. It starts running on the
+    // calling thread and frees itself when it finishes. An exception escaping
+    // it aborts.
+    struct ATask {
+        struct promise_type {
+            ATask get_return_object() noexcept {
+                return ATask();
+            }
+
+            std::suspend_never initial_suspend() noexcept {
+                return {};
+            }
+
+            std::suspend_never final_suspend() noexcept {
+                return {};
+            }
+
+            void return_void() noexcept {}
+
+            void unhandled_exception() noexcept {
+                LOGE("unhandled exception in coroutine");
+                abort();
+            }
+
+            static void* operator new(size_t size) {
+                return AFramePool::allocate(size);
+            }
+
+            static void operator delete(void* frame, size_t size) {
+                AFramePool::release(frame, size);
+            }
+        };
+    };
+
+    // A callable that resumes a suspended coroutine. If it is dropped without
+    // running, e.g. because the handler it was posted to is gone, it destroys
+    // the coroutine instead so that the frame does not leak.
+    struct ACoroutineResumer {
+        explicit ACoroutineResumer(std::coroutine_handle<> handle) : mHandle(handle) {}
+
+        ACoroutineResumer(ACoroutineResumer&& other) noexcept
+            : mHandle(std::exchange(other.mHandle, nullptr)) {}
+
+        ~ACoroutineResumer() {
+            if (mHandle) {
+                if (mHandle.address() == sRejecting) {
+                    // dropped by the post in post() below, which resumes it
+                    sRejecting = nullptr;
+                    return;
+                }
+                mHandle.destroy();
+            }
+        }
+
+        void operator()() {
+            std::exchange(mHandle, nullptr).resume();
+        }
+
+        // Hands a resumer for |handle| to |postFn|. Returns true if it was
+        // posted; otherwise false with the error in *status, and the
+        // coroutine is left for the caller to resume instead of destroyed.
+        // Posts drop a rejected callable before they return, on this thread.
+        template <typename PostFn>
+        static bool post(std::coroutine_handle<> handle, status_t* status, PostFn&& postFn) {
+            *status = OK;
+            // a callable dropped meanwhile may post a coroutine of its own
+            void* outer = sRejecting;
+            sRejecting = handle.address();
+            status_t err = postFn(ACoroutineResumer(handle));
+            bool rejected = sRejecting != handle.address();
+            sRejecting = outer;
+            if (!rejected) {
+                // may already be running elsewhere; don't touch |status|
+                return true;
+            }
+            // a post that dropped it yet returned OK is an error here
+            *status = err != OK ? err : UNKNOWN_ERROR;
+            return false;
+        }
+
+    private:
+        std::coroutine_handle<> mHandle;
+
+        // the coroutine post() is posting on this thread
+        static thread_local void* sRejecting;
+
+        ACoroutineResumer(const ACoroutineResumer&) = delete;
+        ACoroutineResumer& operator=(const ACoroutineResumer&) = delete;
+    };
+
+    // static
+    inline thread_local void* ACoroutineResumer::sRejecting = nullptr;
+
+    // Evaluates to OK, or to the error of a post the looper rejected, in
+    // which case the coroutine continues where it was.
+    struct ALooper::ScheduleAwaiter {
+        ALooper* mLooper;
+        int64_t mDelayUs;
+        status_t mStatus;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            ALooper* looper = mLooper;
+            int64_t delayUs = mDelayUs;
+            return ACoroutineResumer::post(handle, &mStatus, [looper, delayUs](ACoroutineResumer&& resumer) {
+                return looper->post(std::move(resumer), delayUs);
+            });
+        }
+
+        status_t await_resume() const noexcept {
+            return mStatus;
+        }
+    };
+
+    inline ALooper::ScheduleAwaiter ALooper::schedule(int64_t delayUs) {
+        return ScheduleAwaiter{ this, delayUs, OK };
+    }
+
+    // Evaluates to OK with the reply in *mResponse, TIMED_OUT if the message
+    // expired, or an error if it could not be posted or was dropped, or the
+    // reply token was released without a reply.
+    struct AMessage::RequestAwaiter {
+        AMessage* mMessage;
+        std::shared_ptr<AMessage>* mResponse;
+        status_t mStatus;
+        ALooper::DispatchContext mContext;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            mContext = ALooper::currentContext();
+            status_t err = mMessage->postRequest(
+                [this, handle](status_t err, const std::shared_ptr<AMessage>& reply) {
+                    if (err == OK) {
+                        *mResponse = reply;
+                    }
+                    mStatus = err;
+                    if (mContext.mValid) {
+                        mContext.post(ACoroutineResumer(handle));
+                    }
+                    else {
+                        // not started on a looper: continue on the replying thread
+                        handle.resume();
+                    }
+                });
+            if (err != OK) {
+                mStatus = err;
+                return false;
+            }
+            // the coroutine may already be resuming elsewhere; don't touch |this|
+            return true;
+        }
+
+        status_t await_resume() const noexcept {
+            return mStatus;
+        }
+    };
+
+    inline AMessage::RequestAwaiter AMessage::request(std::shared_ptr<AMessage>* response) {
+        return RequestAwaiter{ this, response, OK, ALooper::DispatchContext() };
+    }
+
+    struct ADelayAwaiter {
+        int64_t mDelayUs;
+        status_t mStatus;
+
+        bool await_ready() const noexcept {
+            return mDelayUs <= 0;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            ALooper::DispatchContext context = ALooper::currentContext();
+            if (!context.mValid) {
+                // no looper to set a timer on
+                std::this_thread::sleep_for(std::chrono::microseconds(mDelayUs));
+                return false;
+            }
+            int64_t delayUs = mDelayUs;
+            return ACoroutineResumer::post(handle, &mStatus, [&context, delayUs](ACoroutineResumer&& resumer) {
+                return context.post(std::move(resumer), delayUs);
+            });
+        }
+
+        status_t await_resume() const noexcept {
+            return mStatus;
+        }
+    };
+
+    // co_await delay(delayUs) resumes the coroutine |delayUs| from now, through
+    // the timer queue of the looper it is running on, and evaluates to OK. If
+    // the timer cannot be posted, e.g. to a full queue, it evaluates to the
+    // error right away. Off a looper thread it blocks the calling thread
+    // instead.
+    inline ADelayAwaiter delay(int64_t delayUs) {
+        return ADelayAwaiter{ delayUs, OK };
+    }
+
+}  // namespace android
@@ -1,26 +1,74 @@
-#include "AHandler.h"
-#include "AMessage.h"
-namespace android {
-    std::shared_ptr<AMessage> AHandler::obtainMessage()
-    {
-        return std::make_shared<AMessage>(shared_from_this());
-    }
-    void AHandler::deliverMessage(const std::shared_ptr<AMessage>& msg) {
-        onMessageReceived(msg);
-        mMessageCounter++;
-
-        if (mVerboseStats) {
-            uint32_t what = msg->what();
-            auto it = mMessages.find(what);
-            if (it == mMessages.end())
-            {
-                mMessages.emplace(what, 1);
-            }
-            else
-            {
-                it->second += 1;
-            }
-        }
-    }
-
+#include "AHandler.h"
+#include "ALooperRoster.h"
+#include "AMessage.h"
+namespace android {
+    std::shared_ptr<AMessage> AHandler::obtainMessage()
+    {
+        return std::make_shared<AMessage>(shared_from_this());
+    }
+
+    std::shared_ptr<ALooper> AHandler::looper() {
+        ALooperRoster::PinnedLooper looper(mLooperID);
+        if (looper.get() == nullptr) {
+            return nullptr;
+        }
+        // empty if the looper is already being destroyed
+        return looper.get()->weak_from_this().lock();
+    }
+
+    std::weak_ptr<ALooper> AHandler::getLooper() const {
+        ALooperRoster::PinnedLooper looper(mLooperID);
+        if (looper.get() == nullptr) {
+            return std::weak_ptr<ALooper>();
+        }
+        return looper.get()->weak_from_this();
+    }
+
+    status_t AHandler::post(ACallable callable, int64_t delayUs, ALooper::event_id* id) {
+        ALooper::handler_id handlerID = this->id();
+        std::shared_ptr<ALooper> strong;
+        {
+            ALooperRoster::PinnedLooper looper(mLooperID);
+            if (handlerID == 0 || looper.get() == nullptr) {
+                LOGW("failed to post callable as looper for handler {} is gone.", handlerID);
+                return -ENOENT;
+            }
+            if (!looper.get()->mayBlock()) {
+                return looper.get()->postCallable(std::move(callable), delayUs, handlerID, weak_from_this(), id);
+            }
+            // waiting for room must not hold up the reclamation of other loopers
+            strong = looper.get()->weak_from_this().lock();
+        }
+        if (strong == nullptr) {
+            LOGW("failed to post callable as looper for handler {} is gone.", handlerID);
+            return -ENOENT;
+        }
+        return strong->postCallable(std::move(callable), delayUs, handlerID, weak_from_this(), id);
+    }
+
+    status_t AHandler::cancel(ALooper::event_id id) {
+        ALooperRoster::PinnedLooper looper(mLooperID);
+        if (looper.get() == nullptr) {
+            return -ENOENT;
+        }
+        return looper.get()->cancel(id);
+    }
+    void AHandler::deliverMessage(const std::shared_ptr<AMessage>& msg) {
+        onMessageReceived(msg);
+        mMessageCounter++;
+
+        if (mVerboseStats) {
+            uint32_t what = msg->what();
+            auto it = mMessages.find(what);
+            if (it == mMessages.end())
+            {
+                mMessages.emplace(what, 1);
+            }
+            else
+            {
+                it->second += 1;
+            }
+        }
+    }
+
 }  // namespace android
\ No newline at end of file
@@ -1,69 +1,93 @@
-#pragma once
-#include "Base.h"
-#include "ALooper.h"
-#include "Logger.h"
-namespace android {
-
-    struct AMessage;
-
-    struct AHandler : public std::enable_shared_from_this<AHandler> {
-        AHandler()
-            : mID(0),
-            mVerboseStats(false),
-            mMessageCounter(0) {
-            LOGV("constructed {}",fmt::ptr(this));
-        }
-
-        ~AHandler() {
-            LOGV("destructed {}",fmt::ptr(this));
-        }
-
-        ALooper::handler_id id() const {
-            return mID;
-        }
-
-        std::shared_ptr<ALooper> looper() {
-            return mLooper.lock();
-        }
-
-        std::weak_ptr<ALooper> getLooper() const {
-            return mLooper;
-        }
-
-        std::weak_ptr<AHandler> getHandler() {
-            // allow getting a weak reference to a const handler
-            return shared_from_this();
-        }
-
-        std::shared_ptr<AMessage> obtainMessage();
-
-    protected:
-        virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) = 0;
-
-    private:
-        friend struct AMessage;      // deliverMessage()
-        friend struct ALooperRoster; // setID()
-
-        ALooper::handler_id mID;
-        std::weak_ptr<ALooper> mLooper;
-
-        inline void setID(ALooper::handler_id id, const std::weak_ptr<ALooper>& looper) {
-            mID = id;
-            mLooper = looper;
-        }
-
-        inline void clear() {
-            mID = 0;
-            mLooper.reset();
-        }
-
-        bool mVerboseStats;
-        uint64_t mMessageCounter;
-        KeyedI32Vector mMessages;
-
-        void deliverMessage(const std::shared_ptr<AMessage>& msg);
-
-        DISALLOW_EVIL_CONSTRUCTORS(AHandler);
-    };
-
+#pragma once
+#include "Base.h"
+#include "ALooper.h"
+#include "Logger.h"
+namespace android {
+
+    struct AMessage;
+
+    struct AHandler : public std::enable_shared_from_this<AHandler> {
+        AHandler()
+            : mID(0),
+            mLooperID(0),
+            mCpuTimeNs(0),
+            mVerboseStats(false),
+            mMessageCounter(0) {
+            LOGV("constructed {}",fmt::ptr(this));
+        }
+
+        ~AHandler() {
+            LOGV("destructed {}",fmt::ptr(this));
+        }
+
+        ALooper::handler_id id() const {
+            return mID.load(std::memory_order_relaxed);
+        }
+
+        // the looper the handler is registered on; it changes when the
+        // handler is migrated, see ALooper::migrateHandler()
+        std::shared_ptr<ALooper> looper();
+
+        std::weak_ptr<ALooper> getLooper() const;
+
+        std::weak_ptr<AHandler> getHandler() {
+            // allow getting a weak reference to a const handler
+            return shared_from_this();
+        }
+
+        std::shared_ptr<AMessage> obtainMessage();
+
+        // Runs |callable| on this handler's looper |delayUs| from now, in order
+        // with the messages posted to this handler. It is dropped if the handler
+        // is gone by then. Returns -ENOENT if the handler is not registered or
+        // its looper is gone.
+        status_t post(ACallable callable, int64_t delayUs = 0, ALooper::event_id* id = nullptr);
+
+        // removes a callable posted with post() before it runs
+        status_t cancel(ALooper::event_id id);
+
+        // thread CPU time spent in this handler's messages and callables on
+        // loopers with ALooper::setCpuAccounting() on
+        int64_t cpuTimeNs() const {
+            return mCpuTimeNs.load(std::memory_order_relaxed);
+        }
+
+    protected:
+        virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) = 0;
+
+    private:
+        friend struct ALooper;       // mLooperID, mCpuTimeNs
+        friend struct AMessage;      // deliverMessage()
+        friend struct ALooperRoster; // claimID(), setLooper()
+
+        std::atomic<ALooper::handler_id> mID;
+        // the looper is only ever resolved through its id, which migration
+        // swaps atomically; AMessage::setTarget() copies it
+        std::atomic<ALooper::looper_id> mLooperID;
+        std::atomic<int64_t> mCpuTimeNs;
+
+        // takes |id| if the handler is not registered yet
+        inline bool claimID(ALooper::handler_id id) {
+            ALooper::handler_id unregistered = 0;
+            return mID.compare_exchange_strong(unregistered, id);
+        }
+
+        inline void setLooper(ALooper::looper_id looperID) {
+            mLooperID = looperID;
+        }
+
+        inline void clear() {
+            mID = 0;
+            mLooperID = 0;
+        }
+
+        bool mVerboseStats;
+        uint64_t mMessageCounter;
+        KeyedI32Vector mMessages;
+
+        void deliverMessage(const std::shared_ptr<AMessage>& msg);
+
+        DISALLOW_EVIL_CONSTRUCTORS(AHandler);
+    };
+
 }  // namespace android
\ No newline at end of file
@@ -1,254 +1,1636 @@
-#include "ALooper.h"
-#include "ALooperRoster.h"
-#include "AMessage.h"
-#include "Logger.h"
-#include "Thread.h"
-
-
-namespace android {
-
-ALooperRoster gLooperRoster;
-
-struct ALooper::LooperThread : public Thread {
-    LooperThread(ALooper* looper, bool canCallJava)
-        : Thread(canCallJava),
-        mLooper(looper),
-        mThreadId(getThreadId()) {
-    }
-
-    virtual status_t readyToRun() {
-        mThreadId = getThreadId();
-
-        return Thread::readyToRun();
-    }
-
-    virtual bool threadLoop() {
-        bool ret= mLooper->loop();
-        return ret;
-    }
-
-    bool isCurrentThread() const {
-        return mThreadId == getThreadId();
-    }
-
-    virtual ~LooperThread() {}
-
-private:
-    ALooper* mLooper;
-    thread_id_t mThreadId;
-
-    DISALLOW_EVIL_CONSTRUCTORS(LooperThread);
-};
-
-// static
-int64_t ALooper::GetNowUs() {
-    auto now = std::chrono::high_resolution_clock::now();
-    auto duration = now.time_since_epoch();
-    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
-}
-
-ALooper::ALooper()
-    : mRunningLocally(false) {
-    LOGV("constructed {}", fmt::ptr(this));
-    // clean up stale AHandlers. Doing it here instead of in the destructor avoids
-    // the side effect of objects being deleted from the unregister function recursively.
-    gLooperRoster.unregisterStaleHandlers();
-}
-
-ALooper::~ALooper() {
-    LOGV("destructed {}", fmt::ptr(this));
-    
-    stop();
-    if (mEventQueue.size() > 0) {
-        LOGV("destructed with droped {} message", mEventQueue.size());
-    }
-    // stale AHandlers are now cleaned up in the constructor of the next ALooper to come along
-}
-
-void ALooper::setName(const char* name) {
-    mName = name;
-}
-
-ALooper::handler_id ALooper::registerHandler(const std::shared_ptr<AHandler>& handler) {
-    return gLooperRoster.registerHandler(shared_from_this(), handler);
-}
-
-void ALooper::unregisterHandler(handler_id handlerID) {
-    gLooperRoster.unregisterHandler(handlerID);
-}
-
-status_t ALooper::start(
-    bool runOnCallingThread, bool canCallJava, int32_t priority) {
-    if (runOnCallingThread) {
-        {
-            MutexAutoLock autoLock(mLock);
-
-            if (mThread != NULL || mRunningLocally) {
-                return INVALID_OPERATION;
-            }
-
-            mRunningLocally = true;
-        }
-
-        do {
-        } while (loop());
-
-        return OK;
-    }
-
-    MutexAutoLock autoLock(mLock);
-
-    if (mThread != NULL || mRunningLocally) {
-        return INVALID_OPERATION;
-    }
-
-    mThread = std::make_shared<LooperThread>(this, canCallJava);
-
-    status_t err = mThread->run(
-        mName.empty() ? "ALooper" : mName.c_str(), priority);
-    if (err != OK) {
-        mThread.reset();
-    }
-
-    return err;
-}
-
-status_t ALooper::stop() {
-    std::shared_ptr<LooperThread> thread;
-    bool runningLocally;
-
-    {
-        MutexAutoLock autoLock(mLock);
-
-        thread = mThread;
-        runningLocally = mRunningLocally;
-        mThread.reset();
-        mRunningLocally = false;
-    }
-
-    if (thread == NULL && !runningLocally) {
-        return INVALID_OPERATION;
-    }
-
-    if (thread != NULL) {
-        thread->requestExit();
-    }
-
-    mQueueChangedCondition.notify_one();
-    {
-        MutexAutoLock autoLock(mRepliesLock);
-        mRepliesCondition.notify_all();
-    }
-
-    if (!runningLocally && !thread->isCurrentThread()) {
-        // If not running locally and this thread _is_ the looper thread,
-        // the loop() function will return and never be called again.
-        thread->requestExitAndWait();
-    }
-
-    return OK;
-}
-
-void ALooper::post(const std::shared_ptr<AMessage>& msg, int64_t delayUs) {
-    MutexAutoLock autoLock(mLock);
-
-    int64_t whenUs;
-    if (delayUs > 0) {
-        int64_t nowUs = GetNowUs();
-        whenUs = (delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs);
-
-    }
-    else {
-        whenUs = GetNowUs();
-    }
-
-    std::vector<Event>::iterator it = mEventQueue.begin();
-    while (it != mEventQueue.end() && (*it).mWhenUs <= whenUs) {
-        ++it;
-    }
-
-    Event event;
-    event.mWhenUs = whenUs;
-    event.mMessage = msg;
-
-    if (it == mEventQueue.begin()) {
-        mQueueChangedCondition.notify_one();
-    }
-
-    mEventQueue.insert(it, event);
-}
-
-bool ALooper::loop() {
-    Event event;
-    
-    {
-        MutexAutoLock autoLock(mLock);
-        if (mThread == NULL && !mRunningLocally) {
-            return false;
-        }
-        if (mEventQueue.empty()) {
-            mQueueChangedCondition.wait(autoLock);
-            return true;
-        }
-        int64_t whenUs = (*mEventQueue.begin()).mWhenUs;
-        int64_t nowUs = GetNowUs();
-
-        if (whenUs > nowUs) {
-            int64_t delayUs = whenUs - nowUs;
-            if (delayUs > INT64_MAX / 1000) {
-                delayUs = INT64_MAX / 1000;
-            }
-            mQueueChangedCondition.wait_for(autoLock, std::chrono::nanoseconds(delayUs * 1000));
-
-            return true;
-        }
-
-        event = *mEventQueue.begin();
-        mEventQueue.erase(mEventQueue.begin());
-    }
-
-    event.mMessage->deliver();
-
-    // NOTE: It's important to note that at this point our "ALooper" object
-    // may no longer exist (its final reference may have gone away while
-    // delivering the message). We have made sure, however, that loop()
-    // won't be called again.
-
-    return true;
-}
-
-// to be called by AMessage::postAndAwaitResponse only
-std::shared_ptr<AReplyToken> ALooper::createReplyToken() {
-    return std::make_shared<AReplyToken>(shared_from_this());
-}
-
-// to be called by AMessage::postAndAwaitResponse only
-status_t ALooper::awaitResponse(const std::shared_ptr<AReplyToken>& replyToken, std::shared_ptr<AMessage>* response) {
-    // return status in case we want to handle an interrupted wait
-    MutexAutoLock autoLock(mRepliesLock);
-    if (replyToken == nullptr) {
-        LOGE("null replyToken");
-        abort();
-    }
-    while (!replyToken->retrieveReply(response)) {
-        {
-            MutexAutoLock _l(mLock);
-            if (mThread == NULL) {
-                return -ENOENT;
-            }
-        }
-        mRepliesCondition.wait(autoLock);
-    }
-    return OK;
-}
-
-status_t ALooper::postReply(const std::shared_ptr<AReplyToken>& replyToken, const std::shared_ptr<AMessage>& reply) {
-    MutexAutoLock autoLock(mRepliesLock);
-    status_t err = replyToken->setReply(reply);
-    if (err == OK) {
-        mRepliesCondition.notify_all();
-    }
-    return err;
-}
-
+#include "ALooper.h"
+#include "AHandler.h"
+#include "ALooperRoster.h"
+#include "AMessage.h"
+#include "ATrace.h"
+#include "Logger.h"
+#include "Thread.h"
+
+#include <limits.h>
+#include <time.h>
+
+#include <algorithm>
+#include <iterator>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+namespace android {
+
+ALooperRoster gLooperRoster;
+
+// static
+thread_local ALooper* ALooper::sCurrentLooper = nullptr;
+// static
+thread_local const ALooper::Event* ALooper::sCurrentEvent = nullptr;
+
+struct ALooper::LooperThread : public Thread {
+    LooperThread(ALooper* looper, bool canCallJava)
+        : Thread(canCallJava),
+        mLooper(looper),
+        mThreadId(getThreadId()) {
+    }
+
+    virtual status_t readyToRun() {
+        mThreadId = getThreadId();
+
+        return Thread::readyToRun();
+    }
+
+    virtual bool threadLoop() {
+        bool ret= mLooper->loop();
+        return ret;
+    }
+
+    bool isCurrentThread() const {
+        return mThreadId == getThreadId();
+    }
+
+    virtual ~LooperThread() {}
+
+private:
+    ALooper* mLooper;
+    thread_id_t mThreadId;
+
+    DISALLOW_EVIL_CONSTRUCTORS(LooperThread);
+};
+
+// tells the CPU we are in a spin-wait loop
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// CPU time used by the calling thread, for setCpuAccounting()
+static int64_t threadCpuTimeNs() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    // 100ns units
+    uint64_t kernelTime = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    uint64_t userTime = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (int64_t)(kernelTime + userTime) * 100;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+// static
+ALooper::event_id ALooper::nextEventID() {
+    enum {
+        // ids a thread takes from the shared counter at a time
+        kEventIDBlock = 256,
+    };
+    static std::atomic<uint32_t> sNextEventBlock(0);
+    static thread_local uint32_t sNextID = 0;
+    static thread_local uint32_t sEndID = 0;
+
+    event_id id;
+    do {
+        if (sNextID == sEndID) {
+            sNextID = sNextEventBlock.fetch_add(kEventIDBlock, std::memory_order_relaxed);
+            sEndID = sNextID + kEventIDBlock;
+        }
+        // ids are positive, and leave 0 to messages
+        id = (event_id)(sNextID++ & INT32_MAX);
+    } while (id == 0);
+    return id;
+}
+
+// static
+int64_t ALooper::GetNowUs() {
+    auto now = std::chrono::high_resolution_clock::now();
+    auto duration = now.time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+ALooper::ALooper()
+    : mSchedPolicy(Thread::kSchedNormal),
+    mRtPriority(0),
+    mTimerSlackUs(0),
+    mHighWatermark(0),
+    mLowWatermark(0),
+    mAboveHighWatermark(false),
+    mBounded(false),
+    mMayBlock(false),
+    mRoomWaiters(0),
+    mDispatchingHandler(0),
+    mDispatchWaiters(0),
+    mCpuAccounting(false),
+    mIdlePolicy(kIdleBlock),
+    mIdleSpinUs(kDefaultIdleSpinUs),
+    mSpinning(false),
+    mQueueGeneration(0),
+    mArmedWakeUs(INT64_MIN),
+    mIdlePending(true),
+    mBackend(kBackendCondition),
+    mEpollFd(-1),
+    mWakeEventFd(-1),
+    mPolling(false),
+    mMessagesSinceFdPoll(0),
+    mRunningLocally(false),
+    mLooperID(gLooperRoster.registerLooper(this)) {
+    LOGV("constructed {}", fmt::ptr(this));
+    resetStats();
+    // stale AHandlers are reclaimed incrementally by ALooperRoster::registerHandler()
+}
+
+ALooper::~ALooper() {
+    LOGV("destructed {}", fmt::ptr(this));
+
+    retire();
+    stop();
+    if (mEventQueue.size() > 0) {
+        LOGV("destructed with droped {} message", mEventQueue.size());
+    }
+#ifdef __linux__
+    if (mEpollFd >= 0) {
+        close(mEpollFd);
+    }
+    if (mWakeEventFd >= 0) {
+        close(mWakeEventFd);
+    }
+#endif
+    // stale AHandlers are cleaned up by later registrations, see ALooperRoster
+}
+
+void ALooper::retire() {
+    // a no-op if a subclass has already retired this looper
+    gLooperRoster.unregisterLooper(mLooperID);
+}
+
+void ALooper::setName(const char* name) {
+    mName = name;
+}
+
+void ALooper::setSchedPolicy(Thread::SchedPolicy policy, int32_t rtPriority) {
+    MutexAutoLock autoLock(mLock);
+    mSchedPolicy = policy;
+    mRtPriority = rtPriority;
+}
+
+void ALooper::setIdlePolicy(IdlePolicy policy, int64_t spinUs) {
+    if (policy != kIdleBlock && std::thread::hardware_concurrency() == 1) {
+        // polling would only keep the producer from running
+        LOGW("idle policy {} ignored on a single cpu", (int)policy);
+        policy = kIdleBlock;
+    }
+
+    MutexAutoLock autoLock(mLock);
+    mIdlePolicy = policy;
+    mIdleSpinUs = spinUs;
+}
+
+void ALooper::setTimerSlack(int64_t slackUs) {
+    MutexAutoLock autoLock(mLock);
+    mTimerSlackUs = slackUs;
+}
+
+void ALooper::getStats(Stats* stats) {
+    MutexAutoLock autoLock(mLock);
+    *stats = mStats;
+}
+
+void ALooper::resetStats() {
+    MutexAutoLock autoLock(mLock);
+    mStats = Stats();
+    mStats.mSinceUs = GetNowUs();
+}
+
+status_t ALooper::setBackend(Backend backend) {
+    MutexAutoLock autoLock(mLock);
+
+    if (mThread != NULL || mRunningLocally) {
+        return INVALID_OPERATION;
+    }
+    if (backend == mBackend) {
+        return OK;
+    }
+
+#ifdef __linux__
+    if (backend == kBackendEpoll) {
+        mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (mEpollFd < 0) {
+            LOGE("could not create epoll instance: {}", strerror(errno));
+            return -errno;
+        }
+        mWakeEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (mWakeEventFd < 0) {
+            status_t err = -errno;
+            LOGE("could not create wake event fd: {}", strerror(errno));
+            close(mEpollFd);
+            mEpollFd = -1;
+            return err;
+        }
+
+        struct epoll_event item = {};
+        item.events = EPOLLIN;
+        item.data.fd = mWakeEventFd;
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeEventFd, &item);
+    }
+    else {
+        close(mEpollFd);
+        close(mWakeEventFd);
+        mEpollFd = -1;
+        mWakeEventFd = -1;
+        mFdRequests.clear();
+    }
+
+    mBackend = backend;
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif
+}
+
+#ifdef __linux__
+static uint32_t toEpollEvents(int events) {
+    uint32_t epollEvents = 0;
+    if (events & ALooper::EVENT_INPUT) {
+        epollEvents |= EPOLLIN;
+    }
+    if (events & ALooper::EVENT_OUTPUT) {
+        epollEvents |= EPOLLOUT;
+    }
+    return epollEvents;
+}
+
+static int fromEpollEvents(uint32_t epollEvents) {
+    int events = 0;
+    if (epollEvents & EPOLLIN) {
+        events |= ALooper::EVENT_INPUT;
+    }
+    if (epollEvents & EPOLLOUT) {
+        events |= ALooper::EVENT_OUTPUT;
+    }
+    if (epollEvents & EPOLLERR) {
+        events |= ALooper::EVENT_ERROR;
+    }
+    if (epollEvents & EPOLLHUP) {
+        events |= ALooper::EVENT_HANGUP;
+    }
+    return events;
+}
+#endif
+
+status_t ALooper::addFd(int fd, int events, const FdCallback& callback) {
+    if (callback == nullptr) {
+        return BAD_VALUE;
+    }
+    FdRequest request;
+    request.mEvents = events;
+    request.mCallback = callback;
+    return addFdRequest(fd, events, request);
+}
+
+status_t ALooper::addFd(int fd, int events, const std::shared_ptr<AMessage>& notify) {
+    if (notify == nullptr) {
+        return BAD_VALUE;
+    }
+    FdRequest request;
+    request.mEvents = events;
+    request.mNotify = notify;
+    return addFdRequest(fd, events, request);
+}
+
+status_t ALooper::addFdRequest(int fd, int events, const FdRequest& request) {
+#ifdef __linux__
+    if (fd < 0) {
+        return BAD_VALUE;
+    }
+
+    MutexAutoLock autoLock(mLock);
+
+    if (mBackend != kBackendEpoll) {
+        LOGE("addFd requires the epoll backend");
+        return INVALID_OPERATION;
+    }
+
+    struct epoll_event item = {};
+    item.events = toEpollEvents(events);
+    item.data.fd = fd;
+
+    bool exists = mFdRequests.find(fd) != mFdRequests.end();
+    if (epoll_ctl(mEpollFd, exists ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &item) != 0) {
+        LOGE("could not add fd {} to epoll instance: {}", fd, strerror(errno));
+        return -errno;
+    }
+    mFdRequests[fd] = request;
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif
+}
+
+status_t ALooper::removeFd(int fd) {
+#ifdef __linux__
+    MutexAutoLock autoLock(mLock);
+
+    auto it = mFdRequests.find(fd);
+    if (it == mFdRequests.end()) {
+        return NAME_NOT_FOUND;
+    }
+    mFdRequests.erase(it);
+
+    // the fd may already have been closed, which removes it from epoll by itself
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr) != 0 && errno != EBADF && errno != ENOENT) {
+        LOGW("could not remove fd {} from epoll instance: {}", fd, strerror(errno));
+    }
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif
+}
+
+ALooper::handler_id ALooper::registerHandler(const std::shared_ptr<AHandler>& handler) {
+    return gLooperRoster.registerHandler(shared_from_this(), handler);
+}
+
+void ALooper::unregisterHandler(handler_id handlerID) {
+    gLooperRoster.unregisterHandler(handlerID);
+
+    MutexAutoLock autoLock(mLock);
+    if (mHandlerLimits.erase(handlerID) > 0) {
+        updateBounded_l();
+    }
+}
+
+bool ALooper::canMigrateHandlers() const {
+    return true;
+}
+
+void ALooper::getHandlers(std::vector<std::shared_ptr<AHandler> >* handlers) {
+    gLooperRoster.getHandlers(this, handlers);
+}
+
+status_t ALooper::setCpuAccounting(bool enabled) {
+    MutexAutoLock autoLock(mLock);
+    mCpuAccounting = enabled;
+    return OK;
+}
+
+status_t ALooper::migrateHandler(const std::shared_ptr<AHandler>& handler) {
+    if (handler == nullptr) {
+        return BAD_VALUE;
+    }
+    handler_id handlerID = handler->id();
+    if (handlerID == 0) {
+        return NAME_NOT_FOUND;
+    }
+    if (!canMigrateHandlers()) {
+        return INVALID_OPERATION;
+    }
+
+    for (;;) {
+        looper_id fromID = handler->mLooperID.load();
+        if (fromID == mLooperID) {
+            return OK;
+        }
+        std::shared_ptr<ALooper> from;
+        {
+            ALooperRoster::PinnedLooper pinned(fromID);
+            if (pinned.get() != nullptr) {
+                from = pinned.get()->weak_from_this().lock();
+            }
+        }
+        if (from == nullptr) {
+            // unregistered, or its looper is gone
+            return NAME_NOT_FOUND;
+        }
+        if (!from->canMigrateHandlers()) {
+            return INVALID_OPERATION;
+        }
+
+        MutexAutoLock fromLock(from->mLock, std::defer_lock);
+        MutexAutoLock autoLock(mLock, std::defer_lock);
+        std::lock(fromLock, autoLock);
+
+        if (handler->mLooperID.load() != fromID) {
+            // moved or unregistered meanwhile
+            continue;
+        }
+        if (from->isDispatching_l(handlerID)) {
+            if (sCurrentLooper == from.get()) {
+                // called from within the handler
+                return WOULD_BLOCK;
+            }
+            autoLock.unlock();
+            from->mDispatchWaiters++;
+            while (from->isDispatching_l(handlerID)) {
+                if (from->mExitingThread != nullptr) {
+                    // nothing notifies once that thread is done
+                    from->mDispatchCondition.wait_for(fromLock, std::chrono::milliseconds(1));
+                }
+                else {
+                    from->mDispatchCondition.wait(fromLock);
+                }
+            }
+            from->mDispatchWaiters--;
+            // the looper thread holds back while anybody waits
+            from->mDispatchCondition.notify_all();
+            if (!autoLock.try_lock()) {
+                continue;
+            }
+            if (handler->mLooperID.load() != fromID) {
+                continue;
+            }
+        }
+
+        status_t err = gLooperRoster.moveHandler(handlerID, shared_from_this());
+        if (err != OK) {
+            return err;
+        }
+        from->mMigratedHandlers.insert(handlerID);
+        mMigratedHandlers.erase(handlerID);
+
+        // take the handler's events out of the old queue, keeping their order
+        std::vector<Event> moved;
+        EventQueue& queue = from->mEventQueue;
+        auto isMoved = [handlerID](const Event& event) {
+            return event.target() == handlerID;
+        };
+        if (std::any_of(queue.begin(), queue.end(), isMoved)) {
+            EventQueue kept;
+            for (Event& event : queue) {
+                if (isMoved(event)) {
+                    moved.push_back(std::move(event));
+                }
+                else {
+                    kept.push_back(std::move(event));
+                }
+            }
+            queue.swap(kept);
+        }
+
+        bool fromCrossed = false;
+        bool fromHigh = false;
+        if (from->mBounded) {
+            for (const Event& event : moved) {
+                bool high = false;
+                if (from->removed_l(event, &high)) {
+                    fromCrossed = true;
+                    fromHigh = high;
+                }
+            }
+        }
+        auto limit = from->mHandlerLimits.find(handlerID);
+        if (limit != from->mHandlerLimits.end()) {
+            QueueLimit& newLimit = mHandlerLimits[handlerID];
+            newLimit = limit->second;
+            newLimit.mQueued = 0;
+            from->mHandlerLimits.erase(limit);
+            from->updateBounded_l();
+            updateBounded_l();
+        }
+        if (!mHandlerLimits.empty()) {
+            limit = mHandlerLimits.find(handlerID);
+            if (limit != mHandlerLimits.end()) {
+                limit->second.mQueued += moved.size();
+            }
+        }
+
+        bool crossed = false;
+        if (!moved.empty()) {
+            int64_t latestUs = INT64_MAX;
+            for (Event& event : moved) {
+                int64_t slackUs = mTimerSlackUs;
+                if (event.mMessage != nullptr && event.mMessage->mTimerSlackUs >= 0) {
+                    slackUs = event.mMessage->mTimerSlackUs;
+                }
+                event.mLatestUs = (slackUs > INT64_MAX - event.mWhenUs ? INT64_MAX : event.mWhenUs + slackUs);
+                latestUs = std::min(latestUs, event.mLatestUs);
+            }
+
+            bool newHead = mEventQueue.empty() || moved.front().mWhenUs < mEventQueue.front().mWhenUs
+                || mEventQueue.front().mBarrier;
+            mergeEvents(mEventQueue, moved);
+            if (newHead || latestUs < mArmedWakeUs) {
+                mQueueGeneration++;
+                wake_l();
+            }
+
+            if (mWatermarkCallback != nullptr && !mAboveHighWatermark
+                    && mEventQueue.size() >= mHighWatermark) {
+                mAboveHighWatermark = true;
+                crossed = true;
+            }
+        }
+
+        LOGD("migrated handler {} with {} events from looper {} to {}",
+            handlerID, moved.size(), from->mName, mName);
+
+        // like notifyWatermark(), for both loopers
+        WatermarkCallback fromCallback = fromCrossed ? from->mWatermarkCallback : nullptr;
+        size_t fromDepth = from->mEventQueue.size();
+        WatermarkCallback callback = crossed ? mWatermarkCallback : nullptr;
+        size_t depth = mEventQueue.size();
+        autoLock.unlock();
+        fromLock.unlock();
+        if (fromCallback != nullptr) {
+            fromCallback(fromDepth, fromHigh);
+        }
+        if (callback != nullptr) {
+            callback(depth, true);
+        }
+        return OK;
+    }
+}
+
+status_t ALooper::forward(Event&& event, int64_t delayUs) {
+    handler_id target = event.target();
+    std::shared_ptr<AHandler> handler =
+        event.mMessage != nullptr ? event.mMessage->mHandler.lock() : event.mHandler.lock();
+    looper_id looperID = handler != nullptr && handler->id() == target ? handler->mLooperID.load() : 0;
+
+    std::shared_ptr<ALooper> looper;
+    {
+        ALooperRoster::PinnedLooper pinned(looperID);
+        if (pinned.get() != nullptr) {
+            looper = pinned.get()->weak_from_this().lock();
+        }
+    }
+    if (looper == nullptr) {
+        LOGW("failed to forward event for handler {} as it is gone.", target);
+        MutexAutoLock autoLock(mLock);
+        mMigratedHandlers.erase(target);
+        return -ENOENT;
+    }
+
+    if (event.mMessage != nullptr) {
+        // later posts of the message, e.g. repeats, go there directly
+        event.mMessage->mLooperID = looperID;
+    }
+    return looper->enqueue(std::move(event), delayUs);
+}
+
+void ALooper::setDispatching_l(handler_id handlerID) {
+    if (mDispatchingHandler != handlerID) {
+        mDispatchingHandler = handlerID;
+        if (mDispatchWaiters > 0) {
+            mDispatchCondition.notify_all();
+        }
+    }
+}
+
+bool ALooper::isDispatching_l(handler_id handlerID) const {
+    if (mDispatchingHandler != handlerID) {
+        return false;
+    }
+    return mExitingThread == nullptr || mExitingThread->isRunning();
+}
+
+status_t ALooper::start(
+    bool runOnCallingThread, bool canCallJava, int32_t priority, uint64_t cpuAffinityMask) {
+    if (runOnCallingThread) {
+        {
+            MutexAutoLock autoLock(mLock);
+
+            if (mThread != NULL || mRunningLocally) {
+                return INVALID_OPERATION;
+            }
+
+            mRunningLocally = true;
+        }
+
+        do {
+        } while (loop());
+
+        return OK;
+    }
+
+    MutexAutoLock autoLock(mLock);
+
+    if (mThread != NULL || mRunningLocally) {
+        return INVALID_OPERATION;
+    }
+
+    mExitingThread.reset();
+    mThread = std::make_shared<LooperThread>(this, canCallJava);
+    mThread->setSchedPolicy(mSchedPolicy, mRtPriority);
+    mThread->setCpuAffinity(cpuAffinityMask);
+
+    status_t err = mThread->run(
+        mName.empty() ? "ALooper" : mName.c_str(), priority);
+    if (err != OK) {
+        mThread.reset();
+    }
+
+    return err;
+}
+
+status_t ALooper::stop() {
+    std::shared_ptr<LooperThread> thread;
+    bool runningLocally;
+
+    {
+        MutexAutoLock autoLock(mLock);
+
+        thread = mThread;
+        runningLocally = mRunningLocally;
+        if (thread != NULL && thread->isCurrentThread()) {
+            mExitingThread = thread;
+        }
+        mThread.reset();
+        mRunningLocally = false;
+        mQueueGeneration++;
+        wake_l();
+    }
+
+    if (thread == NULL && !runningLocally) {
+        return INVALID_OPERATION;
+    }
+
+    if (thread != NULL) {
+        thread->requestExit();
+    }
+
+    mQueueChangedCondition.notify_one();
+    {
+        MutexAutoLock autoLock(mRepliesLock);
+        mRepliesCondition.notify_all();
+    }
+
+    if (!runningLocally && !thread->isCurrentThread()) {
+        // If not running locally and this thread _is_ the looper thread,
+        // the loop() function will return and never be called again.
+        thread->requestExitAndWait();
+        // the thread did not come back to loop() to say so
+        MutexAutoLock autoLock(mLock);
+        setDispatching_l(0);
+    }
+
+    return OK;
+}
+
+status_t ALooper::post(const std::shared_ptr<AMessage>& msg, int64_t delayUs) {
+    Event event;
+    event.mMessage = msg;
+    return enqueue(std::move(event), delayUs);
+}
+
+status_t ALooper::post(ACallable callable, int64_t delayUs, event_id* id) {
+    return postCallable(std::move(callable), delayUs, 0, std::weak_ptr<AHandler>(), id);
+}
+
+status_t ALooper::postCallable(
+        ACallable&& callable, int64_t delayUs,
+        handler_id handlerID, const std::weak_ptr<AHandler>& handler, event_id* id) {
+    if (!callable) {
+        return BAD_VALUE;
+    }
+
+    Event event;
+    event.mID = nextEventID();
+    event.mCallable = std::move(callable);
+    event.mHandlerID = handlerID;
+    event.mHandler = handler;
+
+    if (id != nullptr) {
+        *id = event.mID;
+    }
+    ATRACE_MESSAGE(kEventPost, event.traceID(), 0, handlerID);
+    return enqueue(std::move(event), delayUs);
+}
+
+status_t ALooper::enqueue(Event&& event, int64_t delayUs) {
+    // Destroyed after mLock is released, as they may post again. Senders
+    // waiting for a reply to a dropped message get WOULD_BLOCK.
+    struct Dropped {
+        std::vector<Event> mEvents;
+
+        ~Dropped() {
+            for (Event& event : mEvents) {
+                if (event.mMessage != nullptr) {
+                    event.mMessage->failReply(WOULD_BLOCK);
+                }
+            }
+        }
+    } dropped;
+    MutexAutoLock autoLock(mLock);
+
+    bool migrated = migrated_l(event.target());
+    if (!migrated && mBounded) {
+        bool dropNewest = false;
+        status_t err = admit_l(autoLock, event.target(), &dropped.mEvents, &dropNewest);
+        if (err != OK) {
+            return err;
+        }
+        if (dropNewest) {
+            // lets a sender that waits for a reply know there will be none
+            return WOULD_BLOCK;
+        }
+        // the handler may have moved on while this waited for room
+        migrated = migrated_l(event.target());
+    }
+    if (migrated) {
+        mStats.mForwarded++;
+        autoLock.unlock();
+        return forward(std::move(event), delayUs);
+    }
+
+    int64_t whenUs;
+    if (delayUs > 0) {
+        int64_t nowUs = GetNowUs();
+        whenUs = (delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs);
+
+    }
+    else {
+        whenUs = GetNowUs();
+    }
+
+    // most posts are due after everything queued, so search from the back
+    EventQueue::iterator it = mEventQueue.end();
+    while (it != mEventQueue.begin() && (*(it - 1)).mWhenUs > whenUs) {
+        --it;
+    }
+
+    int64_t slackUs = mTimerSlackUs;
+    if (event.mMessage != nullptr && event.mMessage->mTimerSlackUs >= 0) {
+        slackUs = event.mMessage->mTimerSlackUs;
+    }
+
+    event.mWhenUs = whenUs;
+    event.mLatestUs = (slackUs > INT64_MAX - whenUs ? INT64_MAX : whenUs + slackUs);
+
+    // an asynchronous message may pass a barrier at the head
+    if (it == mEventQueue.begin()
+            || (mEventQueue.front().mBarrier && event.isAsynchronous())
+            || event.mLatestUs < mArmedWakeUs) {
+        mQueueGeneration++;
+        wake_l();
+    }
+
+    bool high = false;
+    bool crossed = mBounded && queued_l(event, &high);
+
+    ATRACE_MESSAGE(kEventEnqueue, event.traceID(), event.traceWhat(), event.target());
+    mEventQueue.insert(it, std::move(event));
+
+    if (crossed) {
+        notifyWatermark(autoLock, high);
+    }
+    return OK;
+}
+
+status_t ALooper::postBatch(const BatchEntry* entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].mMessage == nullptr || entries[i].mMessage->mLooperID != mLooperID) {
+            LOGE("batch message {} does not target looper {}", i, mName);
+            return BAD_VALUE;
+        }
+    }
+
+    int64_t nowUs = GetNowUs();
+    std::vector<Event> batch(count);
+    for (size_t i = 0; i < count; i++) {
+        const BatchEntry& entry = entries[i];
+        int64_t delayUs = entry.mDelayUs;
+        batch[i].mWhenUs = (delayUs <= 0 ? nowUs
+            : delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs);
+        batch[i].mMessage = entry.mMessage;
+        AMessage* msg = entry.mMessage.get();
+        msg->mExpiresUs = msg->mTimeToLiveUs > 0 ? batch[i].mWhenUs + msg->mTimeToLiveUs : 0;
+        ATRACE_MESSAGE(kEventPost, entry.mMessage.get(), entry.mMessage->mWhat, entry.mMessage->mTarget);
+    }
+    std::stable_sort(batch.begin(), batch.end(), [](const Event& a, const Event& b) {
+        return a.mWhenUs < b.mWhenUs;
+    });
+
+    return enqueueBatch(batch, nowUs);
+}
+
+status_t ALooper::enqueueBatch(std::vector<Event>& batch, int64_t nowUs) {
+    if (batch.empty()) {
+        return OK;
+    }
+
+    MutexAutoLock autoLock(mLock);
+
+    if (mBounded || !mMigratedHandlers.empty()) {
+        // limits are applied, and events for migrated handlers forwarded, one
+        // event at a time; return the first failure
+        autoLock.unlock();
+        status_t result = OK;
+        for (Event& event : batch) {
+            int64_t delayUs = event.mWhenUs - nowUs;
+            status_t err = enqueue(std::move(event), delayUs);
+            if (result == OK) {
+                result = err;
+            }
+        }
+        return result;
+    }
+
+    int64_t latestUs = INT64_MAX;
+    for (Event& event : batch) {
+        int64_t slackUs = mTimerSlackUs;
+        if (event.mMessage != nullptr && event.mMessage->mTimerSlackUs >= 0) {
+            slackUs = event.mMessage->mTimerSlackUs;
+        }
+        event.mLatestUs = (slackUs > INT64_MAX - event.mWhenUs ? INT64_MAX : event.mWhenUs + slackUs);
+        latestUs = std::min(latestUs, event.mLatestUs);
+        ATRACE_MESSAGE(kEventEnqueue, event.traceID(), event.traceWhat(), event.target());
+    }
+
+    bool newHead = mEventQueue.empty() || batch.front().mWhenUs < mEventQueue.front().mWhenUs
+        || mEventQueue.front().mBarrier;
+    mergeEvents(mEventQueue, batch);
+
+    if (newHead || latestUs < mArmedWakeUs) {
+        mQueueGeneration++;
+        wake_l();
+    }
+    return OK;
+}
+
+// static
+void ALooper::mergeEvents(EventQueue& queue, std::vector<Event>& batch) {
+    if (queue.empty() || batch.front().mWhenUs >= queue.back().mWhenUs) {
+        // the common case: the whole batch goes after what is queued
+        queue.insert(queue.end(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+        return;
+    }
+
+    EventQueue merged;
+    // std::merge takes from the first range on ties
+    std::merge(
+        std::make_move_iterator(queue.begin()), std::make_move_iterator(queue.end()),
+        std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()),
+        std::back_inserter(merged),
+        [](const Event& a, const Event& b) {
+            return a.mWhenUs < b.mWhenUs;
+        });
+    queue.swap(merged);
+}
+
+status_t ALooper::cancel(event_id id) {
+    // destroyed after mLock is released
+    Event event;
+    MutexAutoLock autoLock(mLock);
+
+    for (EventQueue::iterator it = mEventQueue.begin(); it != mEventQueue.end(); ++it) {
+        if ((*it).mMessage == nullptr && !(*it).mBarrier && (*it).mID == id) {
+            event = std::move(*it);
+            mEventQueue.erase(it);
+            bool high = false;
+            if (mBounded && removed_l(event, &high)) {
+                notifyWatermark(autoLock, high);
+            }
+            return OK;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+status_t ALooper::setCapacity(size_t capacity, OverflowPolicy policy, int64_t timeoutUs) {
+    MutexAutoLock autoLock(mLock);
+    mQueueLimit.mCapacity = capacity;
+    mQueueLimit.mPolicy = policy;
+    mQueueLimit.mTimeoutUs = timeoutUs;
+    updateBounded_l();
+    // the new limit may leave room for waiting producers
+    mRoomCondition.notify_all();
+    return OK;
+}
+
+status_t ALooper::setHandlerCapacity(
+        handler_id handlerID, size_t capacity, OverflowPolicy policy, int64_t timeoutUs) {
+    if (handlerID == 0) {
+        return BAD_VALUE;
+    }
+
+    MutexAutoLock autoLock(mLock);
+    if (capacity == 0) {
+        mHandlerLimits.erase(handlerID);
+    }
+    else {
+        auto inserted = mHandlerLimits.emplace(handlerID, QueueLimit());
+        QueueLimit& limit = inserted.first->second;
+        if (inserted.second) {
+            for (const Event& event : mEventQueue) {
+                if (event.target() == handlerID) {
+                    limit.mQueued++;
+                }
+            }
+        }
+        limit.mCapacity = capacity;
+        limit.mPolicy = policy;
+        limit.mTimeoutUs = timeoutUs;
+    }
+    updateBounded_l();
+    mRoomCondition.notify_all();
+    return OK;
+}
+
+status_t ALooper::setWatermarks(size_t high, size_t low, const WatermarkCallback& callback) {
+    if (callback != nullptr && low >= high) {
+        return BAD_VALUE;
+    }
+
+    MutexAutoLock autoLock(mLock);
+    mHighWatermark = high;
+    mLowWatermark = low;
+    mWatermarkCallback = callback;
+    mAboveHighWatermark = false;
+    updateBounded_l();
+    return OK;
+}
+
+void ALooper::updateBounded_l() {
+    bool mayBlock = mQueueLimit.mCapacity > 0 && mQueueLimit.mPolicy == kOverflowBlock;
+    for (const auto& entry : mHandlerLimits) {
+        if (entry.second.mPolicy == kOverflowBlock) {
+            mayBlock = true;
+        }
+    }
+    mBounded = mQueueLimit.mCapacity > 0 || !mHandlerLimits.empty() || mWatermarkCallback != nullptr;
+    mMayBlock.store(mayBlock, std::memory_order_relaxed);
+}
+
+status_t ALooper::admit_l(
+        MutexAutoLock& autoLock, handler_id target,
+        std::vector<Event>* dropped, bool* dropNewest) {
+    int64_t deadlineUs = -1;
+
+    for (;;) {
+        // looked up again after every wait: the limits may have changed
+        QueueLimit* limit = nullptr;
+        if (mQueueLimit.mCapacity > 0 && mEventQueue.size() >= mQueueLimit.mCapacity) {
+            limit = &mQueueLimit;
+        }
+        else if (!mHandlerLimits.empty()) {
+            auto it = mHandlerLimits.find(target);
+            if (it != mHandlerLimits.end() && it->second.mQueued >= it->second.mCapacity) {
+                limit = &it->second;
+            }
+        }
+        if (limit == nullptr) {
+            return OK;
+        }
+
+        switch (limit->mPolicy) {
+            case kOverflowFail:
+                mStats.mRejected++;
+                return WOULD_BLOCK;
+
+            case kOverflowDropNewest:
+                mStats.mDropped++;
+                *dropNewest = true;
+                return OK;
+
+            case kOverflowDropOldest:
+            {
+                bool perHandler = limit != &mQueueLimit;
+                EventQueue::iterator it = mEventQueue.begin();
+                while (it != mEventQueue.end()
+                        && ((*it).mBarrier || (perHandler && (*it).target() != target))) {
+                    ++it;
+                }
+                if (it == mEventQueue.end()) {
+                    LOGE("queue accounting of handler {} is off", target);
+                    return OK;
+                }
+                dropped->push_back(std::move(*it));
+                mEventQueue.erase(it);
+                mStats.mDropped++;
+                // no watermark check: the post that follows queues an event
+                // again, so the depth does not really drop
+                forget_l(dropped->back());
+                break;
+            }
+
+            case kOverflowBlock:
+            {
+                if (sCurrentLooper == this) {
+                    // nobody else would make room
+                    mStats.mRejected++;
+                    return WOULD_BLOCK;
+                }
+                if (limit->mTimeoutUs < 0) {
+                    mRoomWaiters++;
+                    mRoomCondition.wait(autoLock);
+                    mRoomWaiters--;
+                    break;
+                }
+                int64_t nowUs = GetNowUs();
+                if (deadlineUs < 0) {
+                    deadlineUs = nowUs + limit->mTimeoutUs;
+                }
+                if (nowUs >= deadlineUs) {
+                    mStats.mRejected++;
+                    return TIMED_OUT;
+                }
+                mRoomWaiters++;
+                mRoomCondition.wait_for(autoLock, std::chrono::microseconds(deadlineUs - nowUs));
+                mRoomWaiters--;
+                break;
+            }
+        }
+    }
+}
+
+bool ALooper::queued_l(const Event& event, bool* high) {
+    if (!mHandlerLimits.empty()) {
+        auto it = mHandlerLimits.find(event.target());
+        if (it != mHandlerLimits.end()) {
+            it->second.mQueued++;
+        }
+    }
+
+    // the event is not in mEventQueue yet
+    if (mWatermarkCallback != nullptr && !mAboveHighWatermark
+            && mEventQueue.size() + 1 >= mHighWatermark) {
+        mAboveHighWatermark = true;
+        *high = true;
+        return true;
+    }
+    return false;
+}
+
+void ALooper::forget_l(const Event& event) {
+    if (!mHandlerLimits.empty()) {
+        auto it = mHandlerLimits.find(event.target());
+        if (it != mHandlerLimits.end() && it->second.mQueued > 0) {
+            it->second.mQueued--;
+        }
+    }
+    if (mRoomWaiters > 0) {
+        // waiters may be blocked on different limits
+        mRoomCondition.notify_all();
+    }
+}
+
+bool ALooper::removed_l(const Event& event, bool* high) {
+    forget_l(event);
+
+    if (mWatermarkCallback != nullptr && mAboveHighWatermark
+            && mEventQueue.size() <= mLowWatermark) {
+        mAboveHighWatermark = false;
+        *high = false;
+        return true;
+    }
+    return false;
+}
+
+void ALooper::notifyWatermark(MutexAutoLock& autoLock, bool high) {
+    WatermarkCallback callback = mWatermarkCallback;
+    size_t depth = mEventQueue.size();
+    autoLock.unlock();
+    if (callback != nullptr) {
+        callback(depth, high);
+    }
+}
+
+// static
+void ALooper::dispatch(Event& event) {
+    const Event* outer = sCurrentEvent;
+    sCurrentEvent = &event;
+
+    if (event.mMessage != nullptr) {
+        event.mMessage->deliver(event.mMessage);
+        sCurrentEvent = outer;
+        return;
+    }
+
+    // keep the handler alive while its callable runs
+    std::shared_ptr<AHandler> handler;
+    if (event.mHandlerID != 0) {
+        handler = event.mHandler.lock();
+        if (handler == nullptr) {
+            LOGW("failed to run callable {} as target handler {} is gone.", event.mID, event.mHandlerID);
+            sCurrentEvent = outer;
+            return;
+        }
+    }
+
+    ATRACE_MESSAGE(kEventDeliverBegin, event.traceID(), 0, event.mHandlerID);
+    event.mCallable();
+    ATRACE_MESSAGE(kEventDeliverEnd, event.traceID(), 0, event.mHandlerID);
+    sCurrentEvent = outer;
+}
+
+// static
+ALooper::DispatchContext ALooper::currentContext() {
+    DispatchContext context;
+    const Event* event = sCurrentEvent;
+    if (event != nullptr) {
+        if (event->mMessage != nullptr) {
+            context.mHandlerID = event->mMessage->mTarget;
+            context.mHandler = event->mMessage->mHandler;
+        }
+        else {
+            context.mHandlerID = event->mHandlerID;
+            context.mHandler = event->mHandler;
+        }
+    }
+    if (sCurrentLooper != nullptr) {
+        context.mLooper = sCurrentLooper->weak_from_this();
+        context.mValid = true;
+    }
+    return context;
+}
+
+status_t ALooper::DispatchContext::post(ACallable callable, int64_t delayUs) const {
+    if (mHandlerID != 0) {
+        std::shared_ptr<AHandler> handler = mHandler.lock();
+        if (handler == nullptr) {
+            return -ENOENT;
+        }
+        return handler->post(std::move(callable), delayUs);
+    }
+
+    std::shared_ptr<ALooper> looper = mLooper.lock();
+    if (looper == nullptr) {
+        return -ENOENT;
+    }
+    return looper->post(std::move(callable), delayUs);
+}
+
+bool ALooper::Event::isAsynchronous() const {
+    return mMessage != nullptr && mMessage->mAsynchronous;
+}
+
+ALooper::handler_id ALooper::Event::target() const {
+    return mMessage != nullptr ? mMessage->mTarget : mHandlerID;
+}
+
+const void* ALooper::Event::traceID() const {
+    return mMessage != nullptr ? (const void*)mMessage.get() : (const void*)(intptr_t)mID;
+}
+
+uint32_t ALooper::Event::traceWhat() const {
+    return mMessage != nullptr ? mMessage->mWhat : 0;
+}
+
+bool ALooper::loop() {
+    Event event;
+    bool expired = false;
+    bool cpuAccounting = false;
+    sCurrentLooper = this;
+    
+    {
+        MutexAutoLock autoLock(mLock);
+        // the previous event, if any, is done
+        setDispatching_l(0);
+        while (mDispatchWaiters > 0) {
+            // let migrateHandler() move the handler before its next event
+            mDispatchCondition.wait(autoLock);
+        }
+        if (mThread == NULL && !mRunningLocally) {
+            sCurrentLooper = nullptr;
+            return false;
+        }
+        if (mBackend == kBackendEpoll && mMessagesSinceFdPoll >= kFdPollInterval) {
+            pollFds_l(autoLock, 0);
+        }
+        EventQueue::iterator next = mEventQueue.begin();
+        if (next != mEventQueue.end() && (*next).mBarrier) {
+            // only asynchronous messages pass a sync barrier
+            while (next != mEventQueue.end() && !(*next).isAsynchronous()) {
+                ++next;
+            }
+        }
+        int64_t nowUs = GetNowUs();
+
+        if (next == mEventQueue.end() || (*next).mWhenUs > nowUs) {
+            if (mIdlePending && !mIdleHandlers.empty()) {
+                // they may take a while; the queue is looked at again after
+                runIdleHandlers_l(autoLock);
+                return true;
+            }
+            int64_t delayUs = -1;
+            if (next == mEventQueue.begin()) {
+                delayUs = nextWakeUs_l() - nowUs;
+            }
+            else if (next != mEventQueue.end()) {
+                delayUs = (*next).mLatestUs - nowUs;
+            }
+            mArmedWakeUs = delayUs < 0 ? INT64_MAX : nowUs + delayUs;
+            idleWait_l(autoLock, delayUs);
+            mArmedWakeUs = INT64_MIN;
+            return true;
+        }
+        int64_t whenUs = (*next).mWhenUs;
+
+        event = std::move(*next);
+        if (next == mEventQueue.begin()) {
+            mEventQueue.pop_front();
+        }
+        else {
+            mEventQueue.erase(next);
+        }
+        ATRACE_MESSAGE(kEventDequeue, event.traceID(), event.traceWhat(), event.target());
+        mMessagesSinceFdPoll++;
+        mIdlePending = true;
+        setDispatching_l(event.target());
+        cpuAccounting = mCpuAccounting;
+
+        mStats.mMessages++;
+        mStats.mTotalLatenessUs += nowUs - whenUs;
+        if (nowUs - whenUs > mStats.mMaxLatenessUs) {
+            mStats.mMaxLatenessUs = nowUs - whenUs;
+        }
+
+        if (event.mMessage != nullptr && event.mMessage->expired(nowUs)) {
+            mStats.mExpired++;
+            expired = true;
+        }
+
+        bool high = false;
+        if (mBounded && removed_l(event, &high)) {
+            notifyWatermark(autoLock, high);
+        }
+    }
+
+    if (expired) {
+        event.mMessage->expire();
+    }
+    else if (cpuAccounting && event.target() != 0) {
+        std::shared_ptr<AHandler> handler =
+            event.mMessage != nullptr ? event.mMessage->mHandler.lock() : event.mHandler.lock();
+        int64_t startNs = threadCpuTimeNs();
+        dispatch(event);
+        if (handler != nullptr) {
+            handler->mCpuTimeNs.fetch_add(threadCpuTimeNs() - startNs, std::memory_order_relaxed);
+        }
+    }
+    else {
+        dispatch(event);
+    }
+
+    // NOTE: It's important to note that at this point our "ALooper" object
+    // may no longer exist (its final reference may have gone away while
+    // delivering the message). We have made sure, however, that loop()
+    // won't be called again.
+
+    return true;
+}
+
+status_t ALooper::postSyncBarrier(event_id* token) {
+    if (token == nullptr) {
+        return BAD_VALUE;
+    }
+
+    Event barrier;
+    barrier.mID = nextEventID();
+    barrier.mBarrier = true;
+
+    MutexAutoLock autoLock(mLock);
+    // not counted against queue limits; due after what is due now
+    barrier.mWhenUs = GetNowUs();
+    barrier.mLatestUs = barrier.mWhenUs;
+    EventQueue::iterator it = mEventQueue.end();
+    while (it != mEventQueue.begin() && (*(it - 1)).mWhenUs > barrier.mWhenUs) {
+        --it;
+    }
+    *token = barrier.mID;
+    mEventQueue.insert(it, std::move(barrier));
+    return OK;
+}
+
+status_t ALooper::removeSyncBarrier(event_id token) {
+    MutexAutoLock autoLock(mLock);
+
+    for (EventQueue::iterator it = mEventQueue.begin(); it != mEventQueue.end(); ++it) {
+        if ((*it).mBarrier && (*it).mID == token) {
+            if (it == mEventQueue.begin()) {
+                // the messages it held back may be due
+                mQueueGeneration++;
+                wake_l();
+            }
+            mEventQueue.erase(it);
+            return OK;
+        }
+    }
+    LOGE("sync barrier {} is not posted on looper {}", token, mName);
+    return NAME_NOT_FOUND;
+}
+
+ALooper::event_id ALooper::addIdleHandler(const IdleHandler& handler) {
+    IdleRequest request;
+    request.mID = nextEventID();
+    request.mHandler = handler;
+
+    MutexAutoLock autoLock(mLock);
+    mIdleHandlers.push_back(request);
+    // an already idle looper runs it right away
+    mIdlePending = true;
+    mQueueGeneration++;
+    wake_l();
+    return request.mID;
+}
+
+status_t ALooper::removeIdleHandler(event_id id) {
+    MutexAutoLock autoLock(mLock);
+    for (std::vector<IdleRequest>::iterator it = mIdleHandlers.begin(); it != mIdleHandlers.end(); ++it) {
+        if ((*it).mID == id) {
+            mIdleHandlers.erase(it);
+            return OK;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+void ALooper::runIdleHandlers_l(MutexAutoLock& autoLock) {
+    mIdlePending = false;
+    std::vector<IdleRequest> handlers = mIdleHandlers;
+    autoLock.unlock();
+
+    std::vector<event_id> done;
+    for (IdleRequest& request : handlers) {
+        if (!request.mHandler()) {
+            done.push_back(request.mID);
+        }
+    }
+
+    autoLock.lock();
+    for (event_id id : done) {
+        for (std::vector<IdleRequest>::iterator it = mIdleHandlers.begin(); it != mIdleHandlers.end(); ++it) {
+            if ((*it).mID == id) {
+                mIdleHandlers.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+int64_t ALooper::nextWakeUs_l() const {
+    // Sleep until the earliest mLatestUs. Everything due by then gets delivered
+    // in that one wakeup. The queue is sorted by mWhenUs, so later entries
+    // cannot lower the result once they are due after it.
+    int64_t wakeUs = INT64_MAX;
+    for (const Event& event : mEventQueue) {
+        if (event.mWhenUs >= wakeUs) {
+            break;
+        }
+        if (event.mLatestUs < wakeUs) {
+            wakeUs = event.mLatestUs;
+        }
+    }
+    return wakeUs;
+}
+
+void ALooper::idleWait_l(MutexAutoLock& autoLock, int64_t delayUs) {
+    if (mIdlePolicy != kIdleBlock) {
+        int64_t spinUs = mIdlePolicy == kIdleBusyPoll ? INT64_MAX : mIdleSpinUs;
+        if (delayUs >= 0 && delayUs < spinUs) {
+            spinUs = delayUs;
+        }
+
+        uint32_t generation = mQueueGeneration;
+        mSpinning = true;
+        autoLock.unlock();
+
+        int64_t startUs = GetNowUs();
+        int64_t spunUs = 0;
+        while (mQueueGeneration.load(std::memory_order_acquire) == generation && spunUs < spinUs) {
+            cpuRelax();
+            spunUs = GetNowUs() - startUs;
+        }
+
+        autoLock.lock();
+        mSpinning = false;
+        mStats.mSpinUs += spunUs;
+
+        if (mQueueGeneration != generation || mIdlePolicy == kIdleBusyPoll) {
+            return;
+        }
+        if (delayUs >= 0) {
+            delayUs -= spunUs;
+            if (delayUs <= 0) {
+                return;
+            }
+        }
+        // spin budget used up: block for the rest of the wait
+    }
+
+    if (mBackend == kBackendEpoll) {
+        pollFds_l(autoLock, delayUs);
+        return;
+    }
+
+    mStats.mWakeups++;
+    if (delayUs < 0) {
+        mQueueChangedCondition.wait(autoLock);
+        return;
+    }
+    if (delayUs > INT64_MAX / 1000) {
+        delayUs = INT64_MAX / 1000;
+    }
+    if (mQueueChangedCondition.wait_for(autoLock, std::chrono::nanoseconds(delayUs * 1000))
+            == std::cv_status::timeout) {
+        mStats.mTimerWakeups++;
+    }
+}
+
+void ALooper::wake_l() {
+    if (mSpinning) {
+        // the looper thread is watching mQueueGeneration
+        return;
+    }
+#ifdef __linux__
+    if (mBackend == kBackendEpoll) {
+        if (mPolling) {
+            uint64_t inc = 1;
+            ssize_t nWrite = write(mWakeEventFd, &inc, sizeof(inc));
+            if (nWrite != sizeof(inc) && errno != EAGAIN) {
+                LOGW("could not write to wake event fd: {}", strerror(errno));
+            }
+            // one wakeup is enough until the looper thread polls again
+            mPolling = false;
+        }
+        return;
+    }
+#endif
+    mQueueChangedCondition.notify_one();
+}
+
+void ALooper::pollFds_l(MutexAutoLock& autoLock, int64_t timeoutUs) {
+#ifdef __linux__
+    enum {
+        kMaxEvents = 16,
+    };
+
+    mMessagesSinceFdPoll = 0;
+
+    mPolling = timeoutUs != 0;
+    autoLock.unlock();
+
+    struct epoll_event items[kMaxEvents];
+    int count = -1;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    // epoll_pwait2() takes a timespec, so delayed messages are not rounded to
+    // milliseconds. Kernels before 5.11 do not have it.
+    static std::atomic<bool> sHavePwait2(true);
+    if (sHavePwait2) {
+        struct timespec timeout;
+        timeout.tv_sec = timeoutUs / 1000000;
+        timeout.tv_nsec = (timeoutUs % 1000000) * 1000;
+        count = epoll_pwait2(mEpollFd, items, kMaxEvents, timeoutUs < 0 ? nullptr : &timeout, nullptr);
+        if (count < 0 && errno == ENOSYS) {
+            sHavePwait2 = false;
+        }
+    }
+    if (!sHavePwait2)
+#endif
+    {
+        int timeoutMs = -1;
+        if (timeoutUs >= 0) {
+            // round up so that a delayed message is never handled early and the
+            // loop does not come back just to wait again
+            int64_t ms = (timeoutUs + 999) / 1000;
+            timeoutMs = ms > INT_MAX ? INT_MAX : (int)ms;
+        }
+        count = epoll_wait(mEpollFd, items, kMaxEvents, timeoutMs);
+    }
+    if (count < 0 && errno != EINTR) {
+        LOGW("epoll_wait failed: {}", strerror(errno));
+    }
+
+    // pick up the callbacks of the ready fds
+    struct ReadyFd {
+        int mFd;
+        int mEvents;
+        FdRequest mRequest;
+    };
+    std::vector<ReadyFd> ready;
+    autoLock.lock();
+    mPolling = false;
+    if (timeoutUs != 0) {
+        mStats.mWakeups++;
+        if (count == 0) {
+            mStats.mTimerWakeups++;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int fd = items[i].data.fd;
+        if (fd == mWakeEventFd) {
+            uint64_t counter;
+            (void)read(mWakeEventFd, &counter, sizeof(counter));
+            continue;
+        }
+        auto it = mFdRequests.find(fd);
+        if (it != mFdRequests.end()) {
+            ready.push_back({ fd, fromEpollEvents(items[i].events), it->second });
+        }
+    }
+    if (ready.empty()) {
+        return;
+    }
+    autoLock.unlock();
+
+    for (const ReadyFd& entry : ready) {
+        if (entry.mRequest.mCallback != nullptr) {
+            if (!entry.mRequest.mCallback(entry.mFd, entry.mEvents)) {
+                removeFd(entry.mFd);
+            }
+        }
+        else {
+            std::shared_ptr<AMessage> notify = entry.mRequest.mNotify->dup();
+            notify->setInt32("fd", entry.mFd);
+            notify->setInt32("events", entry.mEvents);
+            notify->post();
+        }
+    }
+
+    autoLock.lock();
+#else
+    (void)autoLock;
+    (void)timeoutUs;
+#endif
+}
+
+bool ALooper::isLooping() {
+    MutexAutoLock autoLock(mLock);
+    return mThread != NULL;
+}
+
+// to be called by AMessage::postAndAwaitResponse only
+std::shared_ptr<AReplyToken> ALooper::createReplyToken(bool reusable) {
+    if (!reusable) {
+        return std::make_shared<AReplyToken>(shared_from_this());
+    }
+
+    // The last synchronous call's token. If the cache holds the only
+    // reference, no other thread can get at it and it is safe to reset.
+    static thread_local std::shared_ptr<AReplyToken> sCachedToken;
+    if (sCachedToken != nullptr && sCachedToken.use_count() == 1) {
+        sCachedToken->recycle(shared_from_this());
+    }
+    else {
+        sCachedToken = std::make_shared<AReplyToken>(shared_from_this());
+    }
+    return sCachedToken;
+}
+
+// to be called by AMessage::postAndAwaitResponse only
+status_t ALooper::awaitResponse(const std::shared_ptr<AReplyToken>& replyToken, std::shared_ptr<AMessage>* response) {
+    // return status in case we want to handle an interrupted wait
+    MutexAutoLock autoLock(mRepliesLock);
+    if (replyToken == nullptr) {
+        LOGE("null replyToken");
+        abort();
+    }
+    while (!replyToken->retrieveReply(response)) {
+        if (!isLooping()) {
+            return -ENOENT;
+        }
+        mRepliesCondition.wait(autoLock);
+    }
+    return replyToken->mError;
+}
+
+status_t ALooper::postReply(const std::shared_ptr<AReplyToken>& replyToken, const std::shared_ptr<AMessage>& reply) {
+    return completeReply(replyToken, OK, reply);
+}
+
+status_t ALooper::postReplyError(const std::shared_ptr<AReplyToken>& replyToken, status_t error) {
+    return completeReply(replyToken, error, nullptr);
+}
+
+status_t ALooper::completeReply(
+        const std::shared_ptr<AReplyToken>& replyToken, status_t error, const std::shared_ptr<AMessage>& reply) {
+    MutexAutoLock autoLock(mRepliesLock);
+    status_t err = error == OK ? replyToken->setReply(reply) : replyToken->setError(error);
+    if (err != OK) {
+        return err;
+    }
+    if (replyToken->mOnReply == nullptr) {
+        mRepliesCondition.notify_all();
+        return OK;
+    }
+
+    // nobody waits on the condition; hand the reply to the callback instead
+    AReplyToken::ReplyCallback onReply = std::move(replyToken->mOnReply);
+    replyToken->mOnReply = nullptr;
+    std::shared_ptr<AMessage> response = std::move(replyToken->mReply);
+    replyToken->mReply = nullptr;
+    autoLock.unlock();
+
+    onReply(error, response);
+    return OK;
+}
+
 }  // namespace android
\ No newline at end of file
@@ -1,85 +1,546 @@
-#pragma once
-#include <stdint.h>
-
-#include "Errors.h"
-#include "Base.h"
-namespace android {
-
-    struct AHandler;
-    struct AMessage;
-    struct AReplyToken;
-
-    struct ALooper : public std::enable_shared_from_this<ALooper> {
-        typedef int32_t event_id;
-        typedef int32_t handler_id;
-
-        ALooper();
-
-        // Takes effect in a subsequent call to start().
-        void setName(const char* name);
-
-        handler_id registerHandler(const std::shared_ptr<AHandler>& handler);
-        void unregisterHandler(handler_id handlerID);
-
-        status_t start(
-            bool runOnCallingThread = false,
-            bool canCallJava = false,
-            int32_t priority = 0
-        );
-
-        status_t stop();
-
-        static int64_t GetNowUs();
-
-        const char* getName() const {
-            return mName.c_str();
-        }
-
-        virtual ~ALooper();
-
-    private:
-        friend struct AMessage;       // post()
-
-        struct Event {
-            int64_t mWhenUs;
-            std::shared_ptr<AMessage> mMessage;
-        };
-
-        std::mutex mLock;
-        std::condition_variable mQueueChangedCondition;
-
-        std::string mName;
-
-        std::vector<Event> mEventQueue;
-
-        struct LooperThread;
-        std::shared_ptr<LooperThread> mThread;
-        bool mRunningLocally;
-
-        // use a separate lock for reply handling, as it is always on another thread
-        // use a central lock, however, to avoid creating a mutex for each reply
-        std::mutex mRepliesLock;
-        std::condition_variable mRepliesCondition;
-
-        // START --- methods used only by AMessage
-
-        // posts a message on this looper with the given timeout
-        void post(const std::shared_ptr<AMessage>& msg, int64_t delayUs);
-
-        // creates a reply token to be used with this looper
-        std::shared_ptr<AReplyToken> createReplyToken();
-        // waits for a response for the reply token.  If status is OK, the response
-        // is stored into the supplied variable.  Otherwise, it is unchanged.
-        status_t awaitResponse(const std::shared_ptr<AReplyToken>& replyToken, std::shared_ptr<AMessage>* response);
-        // posts a reply for a reply token.  If the reply could be successfully posted,
-        // it returns OK. Otherwise, it returns an error value.
-        status_t postReply(const std::shared_ptr<AReplyToken>& replyToken, const std::shared_ptr<AMessage>& msg);
-
-        // END --- methods used only by AMessage
-
-        bool loop();
-
-        DISALLOW_EVIL_CONSTRUCTORS(ALooper);
-    };
-
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <unordered_set>
+
+#include "ACallable.h"
+#include "Errors.h"
+#include "Base.h"
+#include "Thread.h"
+namespace android {
+
+    struct AHandler;
+    struct AMessage;
+    struct AReplyToken;
+
+    struct ALooper : public std::enable_shared_from_this<ALooper> {
+        typedef int32_t event_id;
+        typedef int32_t handler_id;
+        // generation-checked name of a looper, see ALooperRoster::registerLooper()
+        typedef uint64_t looper_id;
+
+        // what the looper thread does while no message is due
+        enum IdlePolicy {
+            // block on a condition variable until a message is posted (default)
+            kIdleBlock,
+            // poll the queue for up to spinUs, then block
+            kIdleSpinThenBlock,
+            // poll the queue and never block; burns a core for lowest latency
+            kIdleBusyPoll,
+        };
+
+        enum {
+            kDefaultIdleSpinUs = 50,
+        };
+
+        // how the looper thread sleeps
+        enum Backend {
+            // condition variable; messages only (default)
+            kBackendCondition,
+            // epoll with an eventfd for wakeups; messages and file descriptors
+            // registered with addFd() are serviced on the same thread. Linux only.
+            kBackendEpoll,
+        };
+
+        // file descriptor events, as in Android's Looper
+        enum {
+            EVENT_INPUT = 1 << 0,
+            EVENT_OUTPUT = 1 << 1,
+            EVENT_ERROR = 1 << 2,
+            EVENT_HANGUP = 1 << 3,
+        };
+
+        // called on the looper thread with the fd and the EVENT_* flags that are
+        // ready. Returns true to keep the fd registered, false to remove it.
+        typedef std::function<bool(int fd, int events)> FdCallback;
+
+        ALooper();
+
+        // Takes effect in a subsequent call to start().
+        void setName(const char* name);
+
+        // Takes effect in a subsequent call to start(). See Thread::setSchedPolicy().
+        void setSchedPolicy(Thread::SchedPolicy policy, int32_t rtPriority = 0);
+
+        // Takes effect the next time the looper runs out of due messages.
+        // While the looper thread is polling, post() does not need to wake it,
+        // which saves the futex wake and context switch on every message.
+        void setIdlePolicy(IdlePolicy policy, int64_t spinUs = kDefaultIdleSpinUs);
+
+        // Lets delayed messages be delivered up to |slackUs| after their due
+        // time, so that messages due close together share one wakeup of the
+        // looper thread. Messages are never delivered early. A slack set on
+        // the message with AMessage::setTimerSlack() takes precedence.
+        void setTimerSlack(int64_t slackUs);
+
+        // counters describing how often the looper thread woke up and how late
+        // messages were delivered, e.g. to tune the timer slack
+        struct Stats {
+            int64_t mSinceUs;           // when the counters were last reset
+            uint64_t mWakeups;          // returns from a blocking wait
+            uint64_t mTimerWakeups;     // ... of which ended by a timeout
+            uint64_t mMessages;         // messages taken off the queue
+            int64_t mTotalLatenessUs;   // sum of (delivery - due time)
+            int64_t mMaxLatenessUs;
+            int64_t mSpinUs;            // time spent polling, see IdlePolicy
+            uint64_t mDropped;          // dropped by kOverflowDrop* policies
+            uint64_t mRejected;         // posts failed by a full queue
+            uint64_t mExpired;          // messages dropped by their time to live
+            uint64_t mForwarded;        // posts passed on to a migrated handler
+        };
+
+        void getStats(Stats* stats);
+        void resetStats();
+
+        // what a post to a full queue does, see setCapacity()
+        enum OverflowPolicy {
+            // wait for room, up to the timeout, then fail with TIMED_OUT
+            kOverflowBlock,
+            // fail with WOULD_BLOCK
+            kOverflowFail,
+            // drop the queued event that is due first to make room; a sender
+            // waiting for a reply to it gets WOULD_BLOCK
+            kOverflowDropOldest,
+            // drop the event being posted and fail with WOULD_BLOCK, counted
+            // in Stats::mDropped rather than mRejected
+            kOverflowDropNewest,
+        };
+
+        // Bounds the number of queued messages and callables; 0 (the default)
+        // means unbounded. |timeoutUs| is how long kOverflowBlock waits,
+        // forever if negative. The looper thread never waits for its own queue:
+        // kOverflowBlock fails with WOULD_BLOCK there. Not supported by
+        // ALooperPool.
+        virtual status_t setCapacity(
+            size_t capacity, OverflowPolicy policy = kOverflowFail, int64_t timeoutUs = -1);
+
+        // Like setCapacity(), but bounds the events queued for one handler.
+        virtual status_t setHandlerCapacity(
+            handler_id handlerID, size_t capacity,
+            OverflowPolicy policy = kOverflowFail, int64_t timeoutUs = -1);
+
+        // called with the queue depth when it rises to the high watermark
+        // (|high| is true) and when it falls back to the low one
+        typedef std::function<void(size_t depth, bool high)> WatermarkCallback;
+
+        // Lets producers throttle themselves before the queue fills up. The
+        // callback runs without the looper lock held, on the thread whose post
+        // or dequeue crossed the watermark. |low| must be below |high|. A null
+        // callback removes the watermarks. Not supported by ALooperPool.
+        virtual status_t setWatermarks(size_t high, size_t low, const WatermarkCallback& callback);
+
+        // Must be called before start(). Returns INVALID_OPERATION if the
+        // looper is already running or the backend is not available.
+        // ALooperPool workers do not poll fds.
+        status_t setBackend(Backend backend);
+
+        // Watches |fd| for |events| (EVENT_INPUT and/or EVENT_OUTPUT; errors and
+        // hangups are always reported) and calls |callback| on the looper thread
+        // when it is ready. Registering an fd again replaces its callback.
+        // Requires kBackendEpoll.
+        status_t addFd(int fd, int events, const FdCallback& callback);
+
+        // Like above, but posts a copy of |notify| with "fd" and "events" int32
+        // entries each time |fd| is ready. The fd stays registered until removeFd().
+        status_t addFd(int fd, int events, const std::shared_ptr<AMessage>& notify);
+
+        status_t removeFd(int fd);
+
+        handler_id registerHandler(const std::shared_ptr<AHandler>& handler);
+        void unregisterHandler(handler_id handlerID);
+
+        // Moves a registered |handler| from its looper to this one. Its queued
+        // messages and callables move along in order, ahead of anything posted
+        // after this returns, and messages still addressed to the old looper
+        // are forwarded. If the old looper thread is delivering to the
+        // handler, this waits for it to return, so the handler never runs on
+        // two threads at once; from within the handler itself it fails with
+        // WOULD_BLOCK. A setHandlerCapacity() limit moves along; moved events
+        // are not checked against this looper's limits. Loopers that cannot
+        // migrate handlers (see canMigrateHandlers()) fail with
+        // INVALID_OPERATION.
+        status_t migrateHandler(const std::shared_ptr<AHandler>& handler);
+
+        // false for ALooperPool and the transport clients
+        virtual bool canMigrateHandlers() const;
+
+        // appends the handlers registered on this looper to |handlers|
+        void getHandlers(std::vector<std::shared_ptr<AHandler> >* handlers);
+
+        // Charges the thread CPU time of every message and callable delivered
+        // to a handler to AHandler::cpuTimeNs(), e.g. for ALooperBalancer.
+        // Costs two clock reads per event while on. Not supported by
+        // ALooperPool.
+        virtual status_t setCpuAccounting(bool enabled);
+
+        // a message and its delay for postBatch()
+        struct BatchEntry {
+            std::shared_ptr<AMessage> mMessage;
+            int64_t mDelayUs;
+        };
+
+        // Posts |count| messages as if by mMessage->post(mDelayUs) in order,
+        // but reading the clock and taking the queue lock once and waking the
+        // looper thread at most once. Every message must target a handler
+        // registered on this looper; otherwise BAD_VALUE is returned and
+        // nothing is posted.
+        status_t postBatch(const BatchEntry* entries, size_t count);
+
+        status_t postBatch(const std::vector<BatchEntry>& entries) {
+            return postBatch(entries.data(), entries.size());
+        }
+
+        // Runs |callable| on the looper thread |delayUs| from now, in due time
+        // order with posted messages. Typical lambdas are stored inline, so no
+        // AMessage or heap allocation is needed. If |id| is not null it
+        // receives an id for cancel().
+        status_t post(ACallable callable, int64_t delayUs = 0, event_id* id = nullptr);
+
+        // Removes a callable posted with post() or AHandler::post() before it
+        // runs. Returns NAME_NOT_FOUND if it has already run or been removed.
+        virtual status_t cancel(event_id id);
+
+        // Where the code running on the calling thread was dispatched from:
+        // the handler whose message or callable it is handling, or else the
+        // looper whose callable it is running. Lets work be posted back to it
+        // later, e.g. to resume a coroutine (see ACoroutine.h).
+        struct DispatchContext {
+            DispatchContext() : mValid(false), mHandlerID(0) {}
+
+            // false if captured off a looper thread
+            bool mValid;
+            // 0 for a callable posted to the looper itself
+            handler_id mHandlerID;
+            std::weak_ptr<AHandler> mHandler;
+            std::weak_ptr<ALooper> mLooper;
+
+            // Posts |callable| to the handler, serialized with its messages, or
+            // else to the looper. Returns -ENOENT if it is gone.
+            status_t post(ACallable callable, int64_t delayUs = 0) const;
+        };
+
+        static DispatchContext currentContext();
+
+        // co_await looper->schedule() resumes the coroutine on this looper.
+        // On an ALooperPool such coroutines share one strand and run one at a
+        // time. Defined in ACoroutine.h, which requires C++20.
+        struct ScheduleAwaiter;
+        ScheduleAwaiter schedule(int64_t delayUs = 0);
+
+        // Posts a sync barrier due now: once it reaches the head of the
+        // queue, only asynchronous messages (AMessage::setAsynchronous()) are
+        // delivered until removeSyncBarrier(*token). Messages due before the
+        // barrier are delivered first. Not supported by ALooperPool.
+        virtual status_t postSyncBarrier(event_id* token);
+        virtual status_t removeSyncBarrier(event_id token);
+
+        // Runs on the looper thread once the queue has no message due, for
+        // deferred work such as cache trimming or log flushes. Returns true
+        // to run again in the next idle period, false to be removed.
+        typedef std::function<bool()> IdleHandler;
+
+        // Idle handlers run in the order they were added, once each time the
+        // looper runs out of due messages. Not run by ALooperPool. Returns an
+        // id for removeIdleHandler().
+        event_id addIdleHandler(const IdleHandler& handler);
+        status_t removeIdleHandler(event_id id);
+
+        // |priority| is the looper thread's nice value. A non-zero
+        // |cpuAffinityMask| restricts the thread to the CPUs whose bits are set.
+        status_t start(
+            bool runOnCallingThread = false,
+            bool canCallJava = false,
+            int32_t priority = 0,
+            uint64_t cpuAffinityMask = 0
+        );
+
+        virtual status_t stop();
+
+        static int64_t GetNowUs();
+
+        const char* getName() const {
+            return mName.c_str();
+        }
+
+        virtual ~ALooper();
+
+    protected:
+        // a posted message, or a posted callable if mMessage is null
+        struct Event {
+            Event() : mWhenUs(0), mLatestUs(0), mID(0), mHandlerID(0), mBarrier(false) {}
+
+            int64_t mWhenUs;
+            // mWhenUs plus the timer slack: latest time to deliver the message
+            int64_t mLatestUs;
+            std::shared_ptr<AMessage> mMessage;
+
+            event_id mID;
+            ACallable mCallable;
+            // for AHandler::post(): the handler the callable is serialized
+            // with and dropped along with. 0 for ALooper::post().
+            handler_id mHandlerID;
+            std::weak_ptr<AHandler> mHandler;
+            // a sync barrier, see postSyncBarrier(); mID is its token
+            bool mBarrier;
+
+            // true for an asynchronous message, which passes sync barriers
+            bool isAsynchronous() const;
+
+            // the handler this event is delivered to, 0 for a looper callable
+            handler_id target() const;
+
+            // for ATrace: the message, or the callable's id
+            const void* traceID() const;
+            uint32_t traceWhat() const;
+        };
+
+        // sorted by mWhenUs. A deque, so that taking the head does not move
+        // every queued event.
+        typedef std::deque<Event> EventQueue;
+
+        std::string mName;
+        Thread::SchedPolicy mSchedPolicy;
+        int32_t mRtPriority;
+
+        // use a separate lock for reply handling, as it is always on another thread
+        // use a central lock, however, to avoid creating a mutex for each reply
+        std::mutex mRepliesLock;
+        std::condition_variable mRepliesCondition;
+
+        // posts a message on this looper with the given timeout
+        status_t post(const std::shared_ptr<AMessage>& msg, int64_t delayUs);
+
+        // queues |event| to be dispatched |delayUs| from now
+        virtual status_t enqueue(Event&& event, int64_t delayUs);
+
+        // queues |batch|, sorted by mWhenUs, in one go. Events due by |nowUs|
+        // are not delayed.
+        virtual status_t enqueueBatch(std::vector<Event>& batch, int64_t nowUs);
+
+        // true if a post may wait for room in the queue. Posters then hold a
+        // strong reference instead of a PinnedLooper, so that a waiting
+        // producer does not hold up the reclamation of other loopers.
+        bool mayBlock() const {
+            return mMayBlock.load(std::memory_order_relaxed);
+        }
+
+        // merges |batch|, sorted by mWhenUs, into |queue|. Of events due at
+        // the same time, those already queued stay first.
+        static void mergeEvents(EventQueue& queue, std::vector<Event>& batch);
+
+        // delivers the message of |event| or runs its callable
+        static void dispatch(Event& event);
+
+        // the looper whose loop is running on this thread, for currentContext()
+        static thread_local ALooper* sCurrentLooper;
+
+        // returns true while posted messages are still being serviced, so that
+        // awaitResponse() can give up once the looper has been stopped
+        virtual bool isLooping();
+
+        // makes this looper unreachable for messages and waits for posts still
+        // in flight. Subclasses that override enqueue() must call it first thing
+        // in their destructor, while their own state is still intact.
+        void retire();
+
+    private:
+        friend struct AMessage;       // post(), mLooperID
+        friend struct AHandler;       // postCallable()
+        friend struct ALooperRoster;  // mLooperID
+        friend struct AShmClient;     // completeReply()
+        friend struct ASocketClient;  // completeReply()
+
+        // ids for callables, barriers and idle handlers. Unique across
+        // loopers, so that a callable keeps its id when its handler migrates.
+        static event_id nextEventID();
+
+        // the event dispatch() is running on this thread, for currentContext()
+        static thread_local const Event* sCurrentEvent;
+
+        status_t postCallable(
+            ACallable&& callable, int64_t delayUs,
+            handler_id handlerID, const std::weak_ptr<AHandler>& handler, event_id* id);
+
+        std::mutex mLock;
+        std::condition_variable mQueueChangedCondition;
+
+        EventQueue mEventQueue;
+
+        int64_t mTimerSlackUs;
+        Stats mStats;
+
+        struct QueueLimit {
+            QueueLimit() : mCapacity(0), mPolicy(kOverflowFail), mTimeoutUs(-1), mQueued(0) {}
+
+            size_t mCapacity;
+            OverflowPolicy mPolicy;
+            int64_t mTimeoutUs;
+            // events queued for the handler; unused for the looper-wide limit
+            size_t mQueued;
+        };
+
+        QueueLimit mQueueLimit;
+        std::unordered_map<handler_id, QueueLimit> mHandlerLimits;
+        size_t mHighWatermark;
+        size_t mLowWatermark;
+        bool mAboveHighWatermark;
+        WatermarkCallback mWatermarkCallback;
+        // set while any limit or watermark is configured, so that posts and
+        // dequeues do the accounting. Only accessed with mLock held.
+        bool mBounded;
+        std::atomic<bool> mMayBlock;
+        // kOverflowBlock producers wait on this for room in the queue
+        std::condition_variable mRoomCondition;
+        uint32_t mRoomWaiters;
+
+        // handlers migrated away from this looper. Posts still addressed to
+        // this looper for them are forwarded, see forward().
+        std::unordered_set<handler_id> mMigratedHandlers;
+        // the handler the looper thread is delivering to, 0 between events.
+        // migrateHandler() waits on mDispatchCondition for it to change.
+        handler_id mDispatchingHandler;
+        uint32_t mDispatchWaiters;
+        std::condition_variable mDispatchCondition;
+        bool mCpuAccounting;
+
+        IdlePolicy mIdlePolicy;
+        int64_t mIdleSpinUs;
+        // set while the looper thread polls instead of waiting on
+        // mQueueChangedCondition. Only accessed with mLock held.
+        bool mSpinning;
+        // bumped whenever the head of mEventQueue changes or the looper is
+        // stopped; this is what a polling looper thread watches
+        std::atomic<uint32_t> mQueueGeneration;
+        // when the waiting looper thread wakes up by itself, INT64_MIN while
+        // it is not waiting. An event due to be delivered before it wakes
+        // the thread, even if it is not the new head.
+        int64_t mArmedWakeUs;
+
+        struct IdleRequest {
+            event_id mID;
+            IdleHandler mHandler;
+        };
+
+        std::vector<IdleRequest> mIdleHandlers;
+        // set once a message was handled since the idle handlers last ran
+        bool mIdlePending;
+
+        struct FdRequest {
+            int mEvents;
+            FdCallback mCallback;
+            std::shared_ptr<AMessage> mNotify;
+        };
+
+        enum {
+            // with kBackendEpoll, fds are also checked after this many messages
+            // in a row so that a busy message queue cannot starve them
+            kFdPollInterval = 16,
+        };
+
+        Backend mBackend;
+        int mEpollFd;
+        int mWakeEventFd;
+        // set while the looper thread is blocked in epoll_wait(). Only accessed
+        // with mLock held.
+        bool mPolling;
+        uint32_t mMessagesSinceFdPoll;
+        std::unordered_map<int, FdRequest> mFdRequests;
+
+        struct LooperThread;
+        std::shared_ptr<LooperThread> mThread;
+        bool mRunningLocally;
+        // a thread that stop() was called on from within one of its events;
+        // it exits without coming back to loop()
+        std::shared_ptr<LooperThread> mExitingThread;
+
+        const looper_id mLooperID;
+
+        // START --- methods used only by AMessage
+
+        // creates a reply token to be used with this looper. With |reusable|,
+        // the calling thread's cached token is recycled if nobody else still
+        // references it, which saves an allocation per synchronous call.
+        std::shared_ptr<AReplyToken> createReplyToken(bool reusable);
+        // waits for a response for the reply token.  If status is OK, the response
+        // is stored into the supplied variable.  Otherwise, it is unchanged.
+        status_t awaitResponse(const std::shared_ptr<AReplyToken>& replyToken, std::shared_ptr<AMessage>* response);
+        // posts a reply for a reply token.  If the reply could be successfully posted,
+        // it returns OK. Otherwise, it returns an error value.
+        status_t postReply(const std::shared_ptr<AReplyToken>& replyToken, const std::shared_ptr<AMessage>& msg);
+        // completes a reply token with an error instead of a reply
+        status_t postReplyError(const std::shared_ptr<AReplyToken>& replyToken, status_t error);
+        status_t completeReply(
+            const std::shared_ptr<AReplyToken>& replyToken, status_t error, const std::shared_ptr<AMessage>& reply);
+
+        // END --- methods used only by AMessage
+
+        bool loop();
+
+        // returns the time the looper thread has to wake up by so that no queued
+        // message is delivered later than its mLatestUs. Must be called with
+        // mLock held and a non-empty queue.
+        int64_t nextWakeUs_l() const;
+
+        // waits until a message may be due, at most |delayUs| if it is not
+        // negative, following mIdlePolicy. Must be called with mLock held.
+        void idleWait_l(MutexAutoLock& autoLock, int64_t delayUs);
+
+        // runs the idle handlers without mLock held and removes those that
+        // are done. Must be called with mLock held.
+        void runIdleHandlers_l(MutexAutoLock& autoLock);
+
+        // wakes the looper thread after the head of the queue changed, if it is
+        // sleeping. Must be called with mLock held.
+        void wake_l();
+
+        // kBackendEpoll: waits up to |timeoutUs| (forever if negative, not at all
+        // if 0) for fds or a wakeup, and runs the callbacks of ready fds. mLock
+        // is released while waiting and during callbacks.
+        void pollFds_l(MutexAutoLock& autoLock, int64_t timeoutUs);
+
+        status_t addFdRequest(int fd, int events, const FdRequest& request);
+
+        // recomputes mBounded and mMayBlock. Must be called with mLock held.
+        void updateBounded_l();
+
+        // Makes room for an event for |target| according to the limits, which
+        // may wait for it or move dropped events to |dropped|, to be destroyed
+        // without mLock held. Sets |dropNewest| if the event is to be dropped
+        // instead. Must be called with mLock held.
+        status_t admit_l(
+            MutexAutoLock& autoLock, handler_id target,
+            std::vector<Event>* dropped, bool* dropNewest);
+
+        // accounting for an event that was queued or left the queue. Returns
+        // true if the watermark callback is to be called with |*high|. Must be
+        // called with mLock held.
+        bool queued_l(const Event& event, bool* high);
+        bool removed_l(const Event& event, bool* high);
+        // removed_l() without the watermark check
+        void forget_l(const Event& event);
+
+        // calls the watermark callback without mLock held
+        void notifyWatermark(MutexAutoLock& autoLock, bool high);
+
+        // true if events for |target| are to be forwarded to the looper the
+        // handler migrated to. Must be called with mLock held.
+        bool migrated_l(handler_id target) const {
+            return !mMigratedHandlers.empty() && mMigratedHandlers.count(target) > 0;
+        }
+
+        // enqueues |event| on the looper its handler is registered on now
+        status_t forward(Event&& event, int64_t delayUs);
+
+        // Must be called with mLock held.
+        void setDispatching_l(handler_id handlerID);
+        // true while the looper thread may still be delivering to
+        // |handlerID|. Must be called with mLock held.
+        bool isDispatching_l(handler_id handlerID) const;
+
+        DISALLOW_EVIL_CONSTRUCTORS(ALooper);
+    };
+
 } // namespace android
\ No newline at end of file
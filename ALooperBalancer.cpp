@@ -0,0 +1,208 @@
+#include "ALooperBalancer.h"
+#include "AMessage.h"
+#include "Logger.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+namespace android {
+
+ALooperBalancer::ALooperBalancer()
+    : mLastPassUs(0),
+    mMigrations(0) {
+}
+
+ALooperBalancer::~ALooperBalancer() {
+}
+
+status_t ALooperBalancer::addLooper(const std::shared_ptr<ALooper>& looper) {
+    if (looper == nullptr) {
+        return BAD_VALUE;
+    }
+    if (!looper->canMigrateHandlers()) {
+        return INVALID_OPERATION;
+    }
+    status_t err = looper->setCpuAccounting(true);
+    if (err != OK) {
+        return err;
+    }
+
+    MutexAutoLock autoLock(mLock);
+    for (const std::weak_ptr<ALooper>& entry : mLoopers) {
+        if (entry.lock() == looper) {
+            return OK;
+        }
+    }
+    mLoopers.push_back(looper);
+    return OK;
+}
+
+status_t ALooperBalancer::removeLooper(const std::shared_ptr<ALooper>& looper) {
+    MutexAutoLock autoLock(mLock);
+    for (auto it = mLoopers.begin(); it != mLoopers.end(); ++it) {
+        if ((*it).lock() == looper) {
+            mLoopers.erase(it);
+            return OK;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+void ALooperBalancer::pinHandler(ALooper::handler_id handlerID, bool pinned) {
+    MutexAutoLock autoLock(mLock);
+    if (pinned) {
+        mPinned.insert(handlerID);
+    }
+    else {
+        mPinned.erase(handlerID);
+    }
+}
+
+status_t ALooperBalancer::start(int64_t periodUs) {
+    if (periodUs <= 0) {
+        return BAD_VALUE;
+    }
+    if (mLooper != nullptr) {
+        return INVALID_OPERATION;
+    }
+
+    mLooper = std::make_shared<ALooper>();
+    mLooper->setName("ALooperBalancer");
+    status_t err = mLooper->start();
+    if (err != OK) {
+        mLooper.reset();
+        return err;
+    }
+    mLooper->registerHandler(shared_from_this());
+
+    mRebalance = std::make_shared<AMessage>(kWhatRebalance, shared_from_this());
+    err = mRebalance->postRepeating(periodUs, AMessage::kRepeatFixedDelay);
+    if (err != OK) {
+        stop();
+    }
+    return err;
+}
+
+status_t ALooperBalancer::stop() {
+    if (mLooper == nullptr) {
+        return INVALID_OPERATION;
+    }
+    if (mRebalance != nullptr) {
+        mRebalance->cancelRepeating();
+        mRebalance.reset();
+    }
+    mLooper->unregisterHandler(id());
+    mLooper->stop();
+    mLooper.reset();
+    return OK;
+}
+
+uint64_t ALooperBalancer::numMigrations() {
+    return mMigrations;
+}
+
+void ALooperBalancer::onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+    switch (msg->what()) {
+        case kWhatRebalance:
+            rebalance();
+            break;
+        default:
+            LOGE("unknown msg what={}", msg->what());
+            break;
+    }
+}
+
+bool ALooperBalancer::rebalance() {
+    struct Load {
+        std::shared_ptr<ALooper> mLooper;
+        std::vector<std::shared_ptr<AHandler> > mHandlers;
+        // CPU time of each of mHandlers since the previous pass
+        std::vector<int64_t> mDeltaNs;
+        int64_t mTotalNs;
+    };
+
+    // released after mLock, as dropping the last reference to a handler
+    // runs its destructor
+    std::vector<Load> loads;
+    MutexAutoLock autoLock(mLock);
+
+    for (auto it = mLoopers.begin(); it != mLoopers.end();) {
+        std::shared_ptr<ALooper> looper = (*it).lock();
+        if (looper == nullptr) {
+            it = mLoopers.erase(it);
+            continue;
+        }
+        ++it;
+        loads.push_back(Load());
+        loads.back().mLooper = looper;
+        loads.back().mTotalNs = 0;
+    }
+
+    std::unordered_map<ALooper::handler_id, int64_t> cpuTimeNs;
+    for (Load& load : loads) {
+        load.mLooper->getHandlers(&load.mHandlers);
+        for (const std::shared_ptr<AHandler>& handler : load.mHandlers) {
+            int64_t nowNs = handler->cpuTimeNs();
+            // a handler seen for the first time is only measured from now on
+            auto last = mLastCpuTimeNs.find(handler->id());
+            int64_t deltaNs = last != mLastCpuTimeNs.end() ? nowNs - last->second : 0;
+            cpuTimeNs[handler->id()] = nowNs;
+            load.mDeltaNs.push_back(deltaNs);
+            load.mTotalNs += deltaNs;
+        }
+    }
+    mLastCpuTimeNs.swap(cpuTimeNs);
+
+    int64_t nowUs = ALooper::GetNowUs();
+    int64_t elapsedUs = nowUs - mLastPassUs;
+    bool first = mLastPassUs == 0;
+    mLastPassUs = nowUs;
+    if (first || loads.size() < 2) {
+        return false;
+    }
+
+    auto byTotal = [](const Load& a, const Load& b) {
+        return a.mTotalNs < b.mTotalNs;
+    };
+    Load& idlest = *std::min_element(loads.begin(), loads.end(), byTotal);
+    Load& busiest = *std::max_element(loads.begin(), loads.end(), byTotal);
+    int64_t gapNs = busiest.mTotalNs - idlest.mTotalNs;
+    if (gapNs * 100 <= elapsedUs * 1000 * kMinImbalancePercent) {
+        return false;
+    }
+
+    // moving a handler that took less than the gap always narrows it; the one
+    // closest to half the gap narrows it most
+    std::shared_ptr<AHandler> best;
+    int64_t bestDistanceNs = INT64_MAX;
+    for (size_t i = 0; i < busiest.mHandlers.size(); i++) {
+        const std::shared_ptr<AHandler>& handler = busiest.mHandlers[i];
+        int64_t deltaNs = busiest.mDeltaNs[i];
+        if (deltaNs <= 0 || deltaNs >= gapNs || handler.get() == this
+                || mPinned.count(handler->id()) > 0) {
+            continue;
+        }
+        int64_t distanceNs = std::abs(deltaNs - gapNs / 2);
+        if (distanceNs < bestDistanceNs) {
+            best = handler;
+            bestDistanceNs = distanceNs;
+        }
+    }
+    if (best == nullptr) {
+        return false;
+    }
+
+    std::shared_ptr<ALooper> to = idlest.mLooper;
+    // may wait for the handler's current message
+    autoLock.unlock();
+    status_t err = to->migrateHandler(best);
+    if (err != OK) {
+        LOGW("could not migrate handler {} to looper {}: {}", best->id(), to->getName(), err);
+        return false;
+    }
+    mMigrations++;
+    return true;
+}
+
+}  // namespace android
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "AHandler.h"
+
+namespace android {
+
+    // Evens out the CPU load of a set of loopers by migrating handlers between
+    // them. Each period it compares the thread CPU time the handlers of every
+    // looper took since the previous one, and if the busiest and the idlest
+    // looper differ by more than kMinImbalancePercent of the period, moves the
+    // one handler from the busiest to the idlest that best halves the gap.
+    // One move per period keeps handlers from bouncing between loopers.
+    struct ALooperBalancer : public AHandler {
+        enum {
+            kDefaultPeriodUs = 1000000,
+            kMinImbalancePercent = 10,
+        };
+
+        ALooperBalancer();
+        virtual ~ALooperBalancer();
+
+        // Turns CPU accounting on for |looper|. INVALID_OPERATION for loopers
+        // that cannot migrate handlers.
+        status_t addLooper(const std::shared_ptr<ALooper>& looper);
+        status_t removeLooper(const std::shared_ptr<ALooper>& looper);
+
+        // keeps a handler where it is, e.g. one that owns thread affine state
+        void pinHandler(ALooper::handler_id handlerID, bool pinned = true);
+
+        // Rebalances every |periodUs| on a looper of the balancer's own.
+        status_t start(int64_t periodUs = kDefaultPeriodUs);
+        status_t stop();
+
+        // Runs one pass now. Returns true if a handler was moved.
+        bool rebalance();
+
+        // handlers moved so far
+        uint64_t numMigrations();
+
+    protected:
+        virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg);
+
+    private:
+        enum {
+            kWhatRebalance = 1,
+        };
+
+        std::mutex mLock;
+        std::vector<std::weak_ptr<ALooper> > mLoopers;
+        std::unordered_set<ALooper::handler_id> mPinned;
+        // AHandler::cpuTimeNs() of every handler at the previous pass
+        std::unordered_map<ALooper::handler_id, int64_t> mLastCpuTimeNs;
+        int64_t mLastPassUs;
+        std::atomic<uint64_t> mMigrations;
+
+        std::shared_ptr<ALooper> mLooper;
+        std::shared_ptr<AMessage> mRebalance;
+
+        DISALLOW_EVIL_CONSTRUCTORS(ALooperBalancer);
+    };
+
+}  // namespace android
@@ -0,0 +1,497 @@
+#include "ALooperPool.h"
+#include "AMessage.h"
+#include "ATrace.h"
+#include "Logger.h"
+#include "Thread.h"
+
+#include <thread>
+
+namespace android {
+
+struct ALooperPool::Worker : public Thread {
+    Worker(ALooperPool* pool, size_t index)
+        : Thread(false),
+        mPool(pool),
+        mIndex(index),
+        mThreadId(getThreadId(false)) {
+    }
+
+    virtual status_t readyToRun();
+
+    virtual bool threadLoop() {
+        return mPool->workerLoop(this);
+    }
+
+    bool isCurrentThread() const {
+        return mThreadId == getThreadId();
+    }
+
+    virtual ~Worker() {}
+
+    ALooperPool* const mPool;
+    const size_t mIndex;
+
+    // kSchedulingWorkStealing: this worker's runnable strands. The owner pops
+    // from the front, thieves take from the back.
+    std::mutex mRunLock;
+    std::deque<std::shared_ptr<Strand> > mRunQueue;
+
+private:
+    thread_id_t mThreadId;
+
+    DISALLOW_EVIL_CONSTRUCTORS(Worker);
+};
+
+// static
+thread_local ALooperPool::Worker* ALooperPool::sCurrentWorker = nullptr;
+
+status_t ALooperPool::Worker::readyToRun() {
+    mThreadId = getThreadId();
+    sCurrentWorker = this;
+
+    return Thread::readyToRun();
+}
+
+ALooperPool::ALooperPool()
+    : mNextTimerUs(INT64_MAX),
+    mRunnable(0),
+    mIdleWorkers(0),
+    mNextWorker(0),
+    mMode(kSchedulingShared),
+    mRunning(false) {
+}
+
+ALooperPool::~ALooperPool() {
+    retire();
+    stop();
+    if (mTimerQueue.size() > 0 || mRunQueue.size() > 0) {
+        LOGV("destructed with droped {} delayed message, {} runnable handler",
+            mTimerQueue.size(), mRunQueue.size());
+    }
+}
+
+status_t ALooperPool::setSchedulingMode(SchedulingMode mode) {
+    MutexAutoLock autoLock(mPoolLock);
+
+    if (mRunning) {
+        return INVALID_OPERATION;
+    }
+
+    mMode = mode;
+    return OK;
+}
+
+status_t ALooperPool::start(size_t numWorkers, int32_t priority, uint64_t cpuAffinityMask) {
+    if (numWorkers == 0) {
+        numWorkers = std::thread::hardware_concurrency();
+        if (numWorkers == 0) {
+            numWorkers = 1;
+        }
+    }
+
+    MutexAutoLock autoLock(mPoolLock);
+
+    if (mRunning) {
+        return INVALID_OPERATION;
+    }
+
+    for (size_t i = 0; i < numWorkers; i++) {
+        std::shared_ptr<Worker> worker = std::make_shared<Worker>(this, i);
+        worker->setSchedPolicy(mSchedPolicy, mRtPriority);
+        worker->setCpuAffinity(cpuAffinityMask);
+        mWorkers.push_back(worker);
+    }
+
+    if (mMode == kSchedulingWorkStealing) {
+        // hand out whatever was posted before the workers existed
+        while (!mRunQueue.empty()) {
+            pushLocal(mWorkers[mNextWorker++ % numWorkers].get(), mRunQueue.front());
+            mRunQueue.pop_front();
+        }
+    }
+
+    mRunning = true;
+
+    std::string baseName = mName.empty() ? "ALooperPool" : mName;
+    for (size_t i = 0; i < numWorkers; i++) {
+        std::string name = baseName + "-" + std::to_string(i);
+        status_t err = mWorkers[i]->run(name.c_str(), priority);
+        if (err != OK) {
+            LOGE("failed to start worker {} of {}", i, baseName);
+            autoLock.unlock();
+            stop();
+            return err;
+        }
+    }
+
+    return OK;
+}
+
+status_t ALooperPool::stop() {
+    std::vector<std::shared_ptr<Worker> > workers;
+
+    {
+        MutexAutoLock autoLock(mPoolLock);
+
+        if (!mRunning) {
+            return INVALID_OPERATION;
+        }
+
+        mRunning = false;
+        workers = mWorkers;
+    }
+
+    mWorkAvailableCondition.notify_all();
+    {
+        MutexAutoLock autoLock(mRepliesLock);
+        mRepliesCondition.notify_all();
+    }
+
+    for (const std::shared_ptr<Worker>& worker : workers) {
+        worker->requestExit();
+    }
+    for (const std::shared_ptr<Worker>& worker : workers) {
+        // a worker stopping its own pool returns from workerLoop() and is
+        // never called again
+        if (!worker->isCurrentThread()) {
+            worker->requestExitAndWait();
+        }
+    }
+
+    // no other worker is looking at mWorkers any more
+    MutexAutoLock autoLock(mPoolLock);
+    for (const std::shared_ptr<Worker>& worker : mWorkers) {
+        MutexAutoLock runLock(worker->mRunLock);
+        mRunnable -= (int32_t)worker->mRunQueue.size();
+        mRunQueue.insert(mRunQueue.end(), worker->mRunQueue.begin(), worker->mRunQueue.end());
+        worker->mRunQueue.clear();
+    }
+    mWorkers.clear();
+
+    return OK;
+}
+
+size_t ALooperPool::numWorkers() {
+    MutexAutoLock autoLock(mPoolLock);
+    return mWorkers.size();
+}
+
+bool ALooperPool::isLooping() {
+    MutexAutoLock autoLock(mPoolLock);
+    return mRunning;
+}
+
+status_t ALooperPool::enqueue(Event&& event, int64_t delayUs) {
+    MutexAutoLock autoLock(mPoolLock);
+
+    if (delayUs <= 0) {
+        enqueue_l(std::move(event));
+        return OK;
+    }
+
+    int64_t nowUs = GetNowUs();
+    int64_t whenUs = (delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs);
+
+    EventQueue::iterator it = mTimerQueue.end();
+    while (it != mTimerQueue.begin() && (*(it - 1)).mWhenUs > whenUs) {
+        --it;
+    }
+
+    event.mWhenUs = whenUs;
+
+    if (it == mTimerQueue.begin()) {
+        mNextTimerUs = whenUs;
+        mWorkAvailableCondition.notify_one();
+    }
+
+    mTimerQueue.insert(it, std::move(event));
+    return OK;
+}
+
+status_t ALooperPool::enqueueBatch(std::vector<Event>& batch, int64_t nowUs) {
+    MutexAutoLock autoLock(mPoolLock);
+
+    // the batch is sorted, so whatever is due comes first
+    std::vector<Event>::iterator firstTimer = batch.begin();
+    while (firstTimer != batch.end() && (*firstTimer).mWhenUs <= nowUs) {
+        enqueue_l(std::move(*firstTimer));
+        ++firstTimer;
+    }
+    if (firstTimer == batch.end()) {
+        return OK;
+    }
+
+    batch.erase(batch.begin(), firstTimer);
+    bool newHead = mTimerQueue.empty() || batch.front().mWhenUs < mTimerQueue.front().mWhenUs;
+    mergeEvents(mTimerQueue, batch);
+    if (newHead) {
+        mNextTimerUs = mTimerQueue.front().mWhenUs;
+        mWorkAvailableCondition.notify_one();
+    }
+    return OK;
+}
+
+status_t ALooperPool::setCapacity(size_t capacity, OverflowPolicy policy, int64_t timeoutUs) {
+    (void)capacity;
+    (void)policy;
+    (void)timeoutUs;
+    return INVALID_OPERATION;
+}
+
+status_t ALooperPool::setHandlerCapacity(
+        handler_id handlerID, size_t capacity, OverflowPolicy policy, int64_t timeoutUs) {
+    (void)handlerID;
+    (void)capacity;
+    (void)policy;
+    (void)timeoutUs;
+    return INVALID_OPERATION;
+}
+
+status_t ALooperPool::setWatermarks(size_t high, size_t low, const WatermarkCallback& callback) {
+    (void)high;
+    (void)low;
+    (void)callback;
+    return INVALID_OPERATION;
+}
+
+status_t ALooperPool::postSyncBarrier(event_id* token) {
+    (void)token;
+    return INVALID_OPERATION;
+}
+
+status_t ALooperPool::removeSyncBarrier(event_id token) {
+    (void)token;
+    return INVALID_OPERATION;
+}
+
+bool ALooperPool::canMigrateHandlers() const {
+    return false;
+}
+
+status_t ALooperPool::setCpuAccounting(bool enabled) {
+    (void)enabled;
+    return INVALID_OPERATION;
+}
+
+status_t ALooperPool::cancel(event_id id) {
+    MutexAutoLock autoLock(mPoolLock);
+
+    for (EventQueue::iterator it = mTimerQueue.begin(); it != mTimerQueue.end(); ++it) {
+        if ((*it).mMessage == nullptr && (*it).mID == id) {
+            mTimerQueue.erase(it);
+            return OK;
+        }
+    }
+
+    // a drained strand is left scheduled; runStrand() retires it
+    for (auto& entry : mStrands) {
+        Strand* strand = entry.second.get();
+        MutexAutoLock strandLock(strand->mLock);
+        for (std::deque<Event>::iterator it = strand->mQueue.begin(); it != strand->mQueue.end(); ++it) {
+            if ((*it).mMessage == nullptr && (*it).mID == id) {
+                strand->mQueue.erase(it);
+                return OK;
+            }
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+void ALooperPool::enqueue_l(Event&& event) {
+    handler_id target = event.target();
+    std::shared_ptr<Strand>& strand = mStrands[target];
+    if (strand == nullptr) {
+        strand = std::make_shared<Strand>(target);
+    }
+
+    MutexAutoLock strandLock(strand->mLock);
+    ATRACE_MESSAGE(kEventEnqueue, event.traceID(), event.traceWhat(), target);
+    strand->mQueue.push_back(std::move(event));
+    if (!strand->mScheduled) {
+        strand->mScheduled = true;
+        schedule_l(strand);
+    }
+}
+
+void ALooperPool::schedule_l(const std::shared_ptr<Strand>& strand) {
+    if (mMode == kSchedulingShared || mWorkers.empty()) {
+        mRunQueue.push_back(strand);
+        mWorkAvailableCondition.notify_one();
+        return;
+    }
+
+    // keep work created on a worker local to it; spread everything else
+    Worker* worker = sCurrentWorker;
+    if (worker == nullptr || worker->mPool != this) {
+        worker = mWorkers[mNextWorker++ % mWorkers.size()].get();
+    }
+    pushLocal(worker, strand);
+
+    if (mIdleWorkers > 0) {
+        mWorkAvailableCondition.notify_one();
+    }
+}
+
+void ALooperPool::pushLocal(Worker* worker, const std::shared_ptr<Strand>& strand) {
+    MutexAutoLock runLock(worker->mRunLock);
+    worker->mRunQueue.push_back(strand);
+    mRunnable++;
+}
+
+std::shared_ptr<ALooperPool::Strand> ALooperPool::takeStrand(Worker* worker) {
+    std::shared_ptr<Strand> strand;
+
+    {
+        MutexAutoLock runLock(worker->mRunLock);
+        if (!worker->mRunQueue.empty()) {
+            strand = std::move(worker->mRunQueue.front());
+            worker->mRunQueue.pop_front();
+            mRunnable--;
+            return strand;
+        }
+    }
+
+    size_t numWorkers = mWorkers.size();
+    for (size_t i = 1; i < numWorkers; i++) {
+        Worker* victim = mWorkers[(worker->mIndex + i) % numWorkers].get();
+        MutexAutoLock runLock(victim->mRunLock);
+        if (!victim->mRunQueue.empty()) {
+            strand = std::move(victim->mRunQueue.back());
+            victim->mRunQueue.pop_back();
+            mRunnable--;
+            return strand;
+        }
+    }
+
+    return strand;
+}
+
+int64_t ALooperPool::promoteTimers_l(int64_t nowUs) {
+    size_t due = 0;
+    while (due < mTimerQueue.size() && mTimerQueue[due].mWhenUs <= nowUs) {
+        enqueue_l(std::move(mTimerQueue[due]));
+        due++;
+    }
+    mTimerQueue.erase(mTimerQueue.begin(), mTimerQueue.begin() + due);
+
+    if (mTimerQueue.empty()) {
+        mNextTimerUs = INT64_MAX;
+        return -1;
+    }
+    mNextTimerUs = mTimerQueue.front().mWhenUs;
+    return mTimerQueue.front().mWhenUs - nowUs;
+}
+
+void ALooperPool::runStrand(Worker* worker, const std::shared_ptr<Strand>& strand) {
+    for (int i = 0; i < kStrandQuantum; i++) {
+        Event event;
+        {
+            MutexAutoLock strandLock(strand->mLock);
+            if (strand->mQueue.empty()) {
+                break;
+            }
+            event = std::move(strand->mQueue.front());
+            strand->mQueue.pop_front();
+        }
+        ATRACE_MESSAGE(kEventDequeue, event.traceID(), event.traceWhat(), event.target());
+        if (event.mMessage != nullptr && event.mMessage->mExpiresUs != 0
+                && event.mMessage->expired(GetNowUs())) {
+            event.mMessage->expire();
+            continue;
+        }
+        dispatch(event);
+    }
+
+    if (mMode == kSchedulingWorkStealing) {
+        // still busy: requeue locally without touching mPoolLock
+        MutexAutoLock strandLock(strand->mLock);
+        if (!strand->mQueue.empty()) {
+            pushLocal(worker, strand);
+            return;
+        }
+    }
+
+    MutexAutoLock autoLock(mPoolLock);
+    MutexAutoLock strandLock(strand->mLock);
+    if (!strand->mQueue.empty()) {
+        // go to the back of the line so other handlers get their turn
+        schedule_l(strand);
+        return;
+    }
+
+    strand->mScheduled = false;
+    auto it = mStrands.find(strand->mHandlerID);
+    if (it != mStrands.end() && it->second == strand) {
+        mStrands.erase(it);
+    }
+}
+
+bool ALooperPool::workerLoop(Worker* worker) {
+    std::shared_ptr<Strand> strand;
+    sCurrentLooper = this;
+
+    if (mMode == kSchedulingWorkStealing) {
+        if (GetNowUs() >= mNextTimerUs) {
+            MutexAutoLock autoLock(mPoolLock);
+            promoteTimers_l(GetNowUs());
+        }
+
+        strand = takeStrand(worker);
+        if (strand == nullptr) {
+            MutexAutoLock autoLock(mPoolLock);
+            if (!mRunning) {
+                return false;
+            }
+
+            int64_t delayUs = promoteTimers_l(GetNowUs());
+            if (mRunnable == 0) {
+                waitForWork_l(autoLock, delayUs);
+            }
+            return true;
+        }
+    }
+    else {
+        MutexAutoLock autoLock(mPoolLock);
+        if (!mRunning) {
+            return false;
+        }
+
+        int64_t delayUs = promoteTimers_l(GetNowUs());
+
+        if (mRunQueue.empty()) {
+            waitForWork_l(autoLock, delayUs);
+            return true;
+        }
+
+        strand = std::move(mRunQueue.front());
+        mRunQueue.pop_front();
+    }
+
+    // runStrand() touches the pool again after delivering, so keep it alive in
+    // case the last reference goes away in a handler. If that happens, stop()
+    // runs on this worker and makes sure workerLoop() won't be called again.
+    std::shared_ptr<ALooper> self = weak_from_this().lock();
+    if (self == nullptr) {
+        return false;
+    }
+
+    runStrand(worker, strand);
+
+    return true;
+}
+
+void ALooperPool::waitForWork_l(MutexAutoLock& autoLock, int64_t delayUs) {
+    mIdleWorkers++;
+    if (delayUs < 0) {
+        mWorkAvailableCondition.wait(autoLock);
+    }
+    else {
+        if (delayUs > INT64_MAX / 1000) {
+            delayUs = INT64_MAX / 1000;
+        }
+        mWorkAvailableCondition.wait_for(autoLock, std::chrono::nanoseconds(delayUs * 1000));
+    }
+    mIdleWorkers--;
+}
+
+}  // namespace android
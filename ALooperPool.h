@@ -0,0 +1,146 @@
+#pragma once
+#include <atomic>
+#include <deque>
+
+#include "ALooper.h"
+
+namespace android {
+
+    // An ALooper whose messages are executed by a fixed set of worker threads
+    // instead of one dedicated LooperThread. Handlers register on it exactly as
+    // they do on an ALooper. Messages for one handler are still delivered one at
+    // a time and in order (the handler's "strand"), while different handlers are
+    // serviced in parallel by the workers.
+    struct ALooperPool : public ALooper {
+        enum SchedulingMode {
+            // all workers take runnable handlers from one shared run queue
+            kSchedulingShared,
+            // each worker has its own run queue; handlers made runnable by a
+            // worker stay on it, and idle workers steal from busy ones
+            kSchedulingWorkStealing,
+        };
+
+        ALooperPool();
+
+        // Must be called before start(). Defaults to kSchedulingShared.
+        status_t setSchedulingMode(SchedulingMode mode);
+
+        // Starts |numWorkers| worker threads. If |numWorkers| is 0, one worker
+        // per hardware thread is started. |priority| and |cpuAffinityMask| apply
+        // to every worker, as for ALooper::start().
+        status_t start(
+            size_t numWorkers = 0,
+            int32_t priority = PRIORITY_DEFAULT,
+            uint64_t cpuAffinityMask = 0
+        );
+
+        virtual status_t stop();
+
+        size_t numWorkers();
+
+        virtual ~ALooperPool();
+
+        virtual status_t cancel(event_id id);
+
+        // pools reject bounded queues, watermarks and sync barriers: INVALID_OPERATION
+        virtual status_t setCapacity(
+            size_t capacity, OverflowPolicy policy = kOverflowFail, int64_t timeoutUs = -1);
+        virtual status_t setHandlerCapacity(
+            handler_id handlerID, size_t capacity,
+            OverflowPolicy policy = kOverflowFail, int64_t timeoutUs = -1);
+        virtual status_t setWatermarks(size_t high, size_t low, const WatermarkCallback& callback);
+        virtual status_t postSyncBarrier(event_id* token);
+        virtual status_t removeSyncBarrier(event_id token);
+        // handler migration and CPU accounting are not supported either
+        virtual bool canMigrateHandlers() const;
+        virtual status_t setCpuAccounting(bool enabled);
+
+    protected:
+        virtual status_t enqueue(Event&& event, int64_t delayUs);
+        virtual status_t enqueueBatch(std::vector<Event>& batch, int64_t nowUs);
+
+        virtual bool isLooping();
+
+    private:
+        struct Worker;
+
+        // pending messages of one handler. A strand is runnable (on a run queue)
+        // or being drained by a worker while mScheduled is set, which is what
+        // keeps a handler from being entered by two workers at once.
+        struct Strand {
+            explicit Strand(handler_id id) : mHandlerID(id), mScheduled(false) {}
+
+            const handler_id mHandlerID;
+            std::mutex mLock;
+            std::deque<Event> mQueue;
+            bool mScheduled;
+        };
+
+        enum {
+            // messages delivered from one strand before a worker moves on to
+            // the next runnable strand
+            kStrandQuantum = 8,
+        };
+
+        // lock order: mPoolLock, then Strand::mLock, then Worker::mRunLock
+        std::mutex mPoolLock;
+        std::condition_variable mWorkAvailableCondition;
+
+        // delayed messages, sorted by mWhenUs
+        EventQueue mTimerQueue;
+        // deadline of mTimerQueue's head, so that busy workers in work-stealing
+        // mode only take mPoolLock when a delayed message is actually due
+        std::atomic<int64_t> mNextTimerUs;
+
+        std::unordered_map<handler_id, std::shared_ptr<Strand> > mStrands;
+        // kSchedulingShared, and strands posted before start() in
+        // kSchedulingWorkStealing
+        std::deque<std::shared_ptr<Strand> > mRunQueue;
+
+        // kSchedulingWorkStealing only: strands queued across all workers, and
+        // number of workers blocked on mWorkAvailableCondition
+        std::atomic<int32_t> mRunnable;
+        size_t mIdleWorkers;
+        std::atomic<size_t> mNextWorker;
+
+        // the pool worker running on the calling thread, if any
+        static thread_local Worker* sCurrentWorker;
+
+        // not modified while running, so that workers can steal without mPoolLock
+        std::vector<std::shared_ptr<Worker> > mWorkers;
+        SchedulingMode mMode;
+        bool mRunning;
+
+        // appends |event| to its handler's strand and schedules the strand if
+        // it was idle. Callables posted to the pool itself share strand 0.
+        // Must be called with mPoolLock held.
+        void enqueue_l(Event&& event);
+
+        // puts a runnable strand on a run queue and wakes a worker for it.
+        // Must be called with mPoolLock held.
+        void schedule_l(const std::shared_ptr<Strand>& strand);
+
+        void pushLocal(Worker* worker, const std::shared_ptr<Strand>& strand);
+
+        // pops |worker|'s own run queue, or steals from the back of another
+        // worker's run queue. Returns nullptr if nothing is runnable.
+        std::shared_ptr<Strand> takeStrand(Worker* worker);
+
+        // moves due delayed messages onto their strands. Returns the delay until
+        // the next delayed message, or -1 if there is none.
+        int64_t promoteTimers_l(int64_t nowUs);
+
+        // delivers up to kStrandQuantum messages of |strand|, then either
+        // reschedules it or retires it if it drained
+        void runStrand(Worker* worker, const std::shared_ptr<Strand>& strand);
+
+        bool workerLoop(Worker* worker);
+
+        // blocks an idle worker until work is posted or |delayUs| elapses
+        // (forever if negative). Must be called with mPoolLock held.
+        void waitForWork_l(MutexAutoLock& autoLock, int64_t delayUs);
+
+        DISALLOW_EVIL_CONSTRUCTORS(ALooperPool);
+    };
+
+}  // namespace android
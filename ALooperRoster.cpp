@@ -1,74 +1,304 @@
-#include "ALooperRoster.h"
-#include "AHandler.h"
-#include "AMessage.h"
-#include "Logger.h"
-namespace android {
-
-    static bool verboseStats = false;
-
-    ALooperRoster::ALooperRoster()
-        : mNextHandlerID(1) {
-    }
-
-    ALooper::handler_id ALooperRoster::registerHandler(
-        const std::shared_ptr<ALooper>& looper, const std::shared_ptr<AHandler>& handler) {
-        MutexAutoLock autoLock(mLock);
-
-        if (handler->id() != 0) {
-            //CHECK(!"A handler must only be registered once.");
-            LOGE("A handler must only be registered once.");
-            return INVALID_OPERATION;
-        }
-
-        HandlerInfo info;
-        info.mLooper = looper;
-        info.mHandler = handler;
-        ALooper::handler_id handlerID = mNextHandlerID++;
-        mHandlers.emplace(handlerID, info);
-
-        handler->setID(handlerID, looper);
-
-        return handlerID;
-    }
-
-    void ALooperRoster::unregisterHandler(ALooper::handler_id handlerID) {
-        MutexAutoLock autoLock(mLock);
-        auto it = mHandlers.find(handlerID);
-        if (it == mHandlers.end()) {
-            return;
-        }
-
-        const HandlerInfo& info = it->second;
-        std::shared_ptr<AHandler> handler = info.mHandler.lock();
-        if (handler != nullptr) {
-            handler->clear();
-        }
-        mHandlers.erase(it);
-    }
-
-    void ALooperRoster::unregisterStaleHandlers() {
-
-        std::vector<std::shared_ptr<ALooper> > activeLoopers;
-        {
-            MutexAutoLock autoLock(mLock);
-            auto it = mHandlers.begin();
-            while (it != mHandlers.end()) {
-                const HandlerInfo& info = it->second;
-                std::shared_ptr<ALooper> looper = info.mLooper.lock();
-                if (looper == nullptr) {
-                    it = mHandlers.erase(it);
-                }
-                else 
-                {
-                    activeLoopers.emplace_back(looper);
-                    it++;
-                }
-            }
-        }
-    }
-
-    void ALooperRoster::dump(int fd, const std::vector<std::string>& args) {
-
-    }
-
+#include "ALooperRoster.h"
+#include "AHandler.h"
+#include "AMessage.h"
+#include "Logger.h"
+
+#include <thread>
+
+namespace android {
+
+    extern ALooperRoster gLooperRoster;
+
+    static bool verboseStats = false;
+
+    struct ALooperRoster::EpochRecordHolder {
+        EpochRecordHolder() : mRecord(nullptr) {}
+
+        ~EpochRecordHolder() {
+            if (mRecord != nullptr) {
+                mRecord->mInUse.store(false, std::memory_order_release);
+            }
+        }
+
+        EpochRecord* mRecord;
+    };
+
+    // static
+    thread_local ALooperRoster::EpochRecordHolder ALooperRoster::sEpochRecord;
+
+    ALooperRoster::ALooperRoster()
+        : mNextHandlerID(1),
+        mNumSlots(0),
+        mEpoch(1),
+        mEpochRecords(nullptr) {
+        for (std::atomic<LooperSlot*>& chunk : mSlotChunks) {
+            chunk.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ALooper::handler_id ALooperRoster::registerHandler(
+        const std::shared_ptr<ALooper>& looper, const std::shared_ptr<AHandler>& handler) {
+        ALooper::handler_id handlerID = mNextHandlerID++;
+
+        if (!handler->claimID(handlerID)) {
+            //CHECK(!"A handler must only be registered once.");
+            LOGE("A handler must only be registered once.");
+            return INVALID_OPERATION;
+        }
+
+        HandlerInfo info;
+        info.mLooper = looper;
+        info.mHandler = handler;
+
+        Shard& shard = shardFor(handlerID);
+        MutexAutoLock autoLock(shard.mLock);
+        shard.mHandlers.emplace(handlerID, info);
+        handler->setLooper(looper->mLooperID);
+
+        // reclaim handlers of loopers that have gone away, a little at a time
+        sweepStale_l(shard, kSweepBuckets);
+
+        return handlerID;
+    }
+
+    void ALooperRoster::unregisterHandler(ALooper::handler_id handlerID) {
+        Shard& shard = shardFor(handlerID);
+        MutexAutoLock autoLock(shard.mLock);
+        auto it = shard.mHandlers.find(handlerID);
+        if (it == shard.mHandlers.end()) {
+            return;
+        }
+
+        const HandlerInfo& info = it->second;
+        std::shared_ptr<AHandler> handler = info.mHandler.lock();
+        if (handler != nullptr) {
+            handler->clear();
+        }
+        shard.mHandlers.erase(it);
+    }
+
+    status_t ALooperRoster::moveHandler(
+        ALooper::handler_id handlerID, const std::shared_ptr<ALooper>& looper) {
+        Shard& shard = shardFor(handlerID);
+        MutexAutoLock autoLock(shard.mLock);
+        auto it = shard.mHandlers.find(handlerID);
+        if (it == shard.mHandlers.end()) {
+            return NAME_NOT_FOUND;
+        }
+
+        HandlerInfo& info = it->second;
+        std::shared_ptr<AHandler> handler = info.mHandler.lock();
+        if (handler == nullptr) {
+            return NAME_NOT_FOUND;
+        }
+        info.mLooper = looper;
+        handler->setLooper(looper->mLooperID);
+        return OK;
+    }
+
+    void ALooperRoster::getHandlers(const ALooper* looper, std::vector<std::shared_ptr<AHandler> >* handlers) {
+        // filtered without the shard locks held, as dropping the last
+        // reference to a handler runs its destructor
+        std::vector<std::shared_ptr<AHandler> > live;
+        for (Shard& shard : mShards) {
+            MutexAutoLock autoLock(shard.mLock);
+            for (const auto& entry : shard.mHandlers) {
+                std::shared_ptr<AHandler> handler = entry.second.mHandler.lock();
+                if (handler != nullptr) {
+                    live.push_back(std::move(handler));
+                }
+            }
+        }
+        for (std::shared_ptr<AHandler>& handler : live) {
+            if (handler->mLooperID.load() == looper->mLooperID) {
+                handlers->push_back(std::move(handler));
+            }
+        }
+    }
+
+    void ALooperRoster::unregisterStaleHandlers() {
+        for (Shard& shard : mShards) {
+            MutexAutoLock autoLock(shard.mLock);
+            sweepStale_l(shard, shard.mHandlers.bucket_count());
+        }
+    }
+
+    void ALooperRoster::sweepStale_l(Shard& shard, size_t numBuckets) {
+        // Only check expired(): promoting the looper here could make this the
+        // last reference and run ~ALooper() with the shard locked.
+        std::vector<ALooper::handler_id> stale;
+        size_t bucketCount = shard.mHandlers.bucket_count();
+        for (size_t i = 0; i < numBuckets && i < bucketCount; i++) {
+            size_t bucket = (shard.mSweepBucket + i) % bucketCount;
+            for (auto it = shard.mHandlers.begin(bucket); it != shard.mHandlers.end(bucket); ++it) {
+                if (it->second.mLooper.expired()) {
+                    stale.push_back(it->first);
+                }
+            }
+        }
+        shard.mSweepBucket = (shard.mSweepBucket + numBuckets) % bucketCount;
+
+        for (ALooper::handler_id handlerID : stale) {
+            shard.mHandlers.erase(handlerID);
+        }
+    }
+
+    size_t ALooperRoster::numHandlers() {
+        size_t count = 0;
+        for (Shard& shard : mShards) {
+            MutexAutoLock autoLock(shard.mLock);
+            count += shard.mHandlers.size();
+        }
+        return count;
+    }
+
+    size_t ALooperRoster::numLoopers() {
+        MutexAutoLock autoLock(mSlotLock);
+        return mNumSlots - mFreeSlots.size();
+    }
+
+    ALooper::looper_id ALooperRoster::registerLooper(ALooper* looper) {
+        MutexAutoLock autoLock(mSlotLock);
+
+        uint32_t index;
+        if (!mFreeSlots.empty()) {
+            index = mFreeSlots.back();
+            mFreeSlots.pop_back();
+        }
+        else {
+            if (mNumSlots == kSlotsPerChunk * kMaxSlotChunks) {
+                LOGE("too many loopers");
+                return 0;
+            }
+            index = mNumSlots++;
+            if (index % kSlotsPerChunk == 0) {
+                mSlotChunks[index / kSlotsPerChunk].store(
+                    new LooperSlot[kSlotsPerChunk], std::memory_order_release);
+            }
+        }
+
+        LooperSlot* slot = slotFor(index);
+        uint32_t generation = slot->mGeneration.load(std::memory_order_relaxed) + 1;
+        slot->mLooper.store(looper, std::memory_order_relaxed);
+        slot->mGeneration.store(generation, std::memory_order_release);
+
+        return ((ALooper::looper_id)generation << 32) | index;
+    }
+
+    void ALooperRoster::unregisterLooper(ALooper::looper_id looperID) {
+        uint32_t index = (uint32_t)looperID;
+        uint32_t generation = (uint32_t)(looperID >> 32);
+        if (looperID == 0) {
+            return;
+        }
+
+        {
+            MutexAutoLock autoLock(mSlotLock);
+            LooperSlot* slot = slotFor(index);
+            if (slot == nullptr || slot->mGeneration.load(std::memory_order_relaxed) != generation) {
+                // never registered, or already unregistered
+                return;
+            }
+            slot->mLooper.store(nullptr, std::memory_order_relaxed);
+            slot->mGeneration.store(generation + 1);
+        }
+
+        // the slot may only be handed out again once nobody can still be
+        // looking at the looper it held
+        synchronizeEpoch();
+
+        MutexAutoLock autoLock(mSlotLock);
+        mFreeSlots.push_back(index);
+    }
+
+    ALooperRoster::LooperSlot* ALooperRoster::slotFor(uint32_t index) {
+        if (index >= kSlotsPerChunk * kMaxSlotChunks) {
+            return nullptr;
+        }
+        LooperSlot* chunk = mSlotChunks[index / kSlotsPerChunk].load(std::memory_order_acquire);
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+        return &chunk[index % kSlotsPerChunk];
+    }
+
+    ALooperRoster::EpochRecord* ALooperRoster::currentEpochRecord() {
+        EpochRecord* record = sEpochRecord.mRecord;
+        if (record != nullptr) {
+            return record;
+        }
+
+        // take over the record of a thread that has exited, if there is one
+        for (record = mEpochRecords.load(std::memory_order_acquire); record != nullptr; record = record->mNext) {
+            bool inUse = false;
+            if (record->mInUse.compare_exchange_strong(inUse, true)) {
+                sEpochRecord.mRecord = record;
+                return record;
+            }
+        }
+
+        record = new EpochRecord;
+        record->mNext = mEpochRecords.load(std::memory_order_relaxed);
+        while (!mEpochRecords.compare_exchange_weak(record->mNext, record)) {
+        }
+        sEpochRecord.mRecord = record;
+        return record;
+    }
+
+    void ALooperRoster::enterEpoch() {
+        EpochRecord* record = currentEpochRecord();
+        if (record->mDepth++ == 0) {
+            // seq_cst pairs with unregisterLooper(): either synchronizeEpoch()
+            // sees this record busy, or the slot lookup after it sees the looper
+            // unregistered
+            record->mEpoch.store(mEpoch.load(std::memory_order_acquire));
+        }
+    }
+
+    void ALooperRoster::exitEpoch() {
+        EpochRecord* record = sEpochRecord.mRecord;
+        if (--record->mDepth == 0) {
+            record->mEpoch.store(0, std::memory_order_release);
+        }
+    }
+
+    void ALooperRoster::synchronizeEpoch() {
+        uint64_t epoch = mEpoch.fetch_add(1) + 1;
+        EpochRecord* self = sEpochRecord.mRecord;
+
+        for (EpochRecord* record = mEpochRecords.load(); record != nullptr; record = record->mNext) {
+            if (record == self) {
+                // a looper destroyed while this thread holds a PinnedLooper is
+                // never the pinned one: pinning hands out no reference whose
+                // release could destroy it. Waiting here would deadlock.
+                continue;
+            }
+            for (;;) {
+                uint64_t recordEpoch = record->mEpoch.load();
+                if (recordEpoch == 0 || recordEpoch >= epoch) {
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    ALooperRoster::PinnedLooper::PinnedLooper(ALooper::looper_id looperID)
+        : mLooper(nullptr) {
+        gLooperRoster.enterEpoch();
+
+        LooperSlot* slot = gLooperRoster.slotFor((uint32_t)looperID);
+        if (slot != nullptr && slot->mGeneration.load() == (uint32_t)(looperID >> 32)) {
+            mLooper = slot->mLooper.load(std::memory_order_acquire);
+        }
+    }
+
+    ALooperRoster::PinnedLooper::~PinnedLooper() {
+        gLooperRoster.exitEpoch();
+    }
+
+    void ALooperRoster::dump(int fd, const std::vector<std::string>& args) {
+
+    }
+
 }  // namespace android
\ No newline at end of file
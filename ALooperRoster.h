@@ -1,34 +1,156 @@
-#pragma once
-
-#include "ALooper.h"
-#include "Base.h"
-
-namespace android {
-
-    struct ALooperRoster {
-        ALooperRoster();
-
-        ALooper::handler_id registerHandler(
-            const std::shared_ptr<ALooper>& looper, const std::shared_ptr<AHandler>& handler);
-
-        void unregisterHandler(ALooper::handler_id handlerID);
-
-        void unregisterStaleHandlers();
-
-        void dump(int fd, const std::vector<std::string>& args);
-
-    private:
-        struct HandlerInfo {
-            std::weak_ptr<ALooper> mLooper;
-            std::weak_ptr<AHandler> mHandler;
-        };
-
-        std::mutex mLock;
-        std::unordered_map<ALooper::handler_id, HandlerInfo> mHandlers;
-        ALooper::handler_id mNextHandlerID;
-
-        DISALLOW_EVIL_CONSTRUCTORS(ALooperRoster);
-    };
-
-}  // namespace android
-
+#pragma once
+
+#include "ALooper.h"
+#include "Base.h"
+
+#include <atomic>
+
+namespace android {
+
+    struct ALooperRoster {
+        ALooperRoster();
+
+        ALooper::handler_id registerHandler(
+            const std::shared_ptr<ALooper>& looper, const std::shared_ptr<AHandler>& handler);
+
+        void unregisterHandler(ALooper::handler_id handlerID);
+
+        // Points a registered handler at |looper|, see
+        // ALooper::migrateHandler(). Returns NAME_NOT_FOUND if it is not
+        // registered.
+        status_t moveHandler(ALooper::handler_id handlerID, const std::shared_ptr<ALooper>& looper);
+
+        // appends the live handlers registered on |looper| to |handlers|
+        void getHandlers(const ALooper* looper, std::vector<std::shared_ptr<AHandler> >* handlers);
+
+        // Drops all handlers whose looper is gone. Stale handlers are also
+        // reclaimed a few at a time by registerHandler(), so this full sweep is
+        // not needed for the roster to stay bounded.
+        void unregisterStaleHandlers();
+
+        void dump(int fd, const std::vector<std::string>& args);
+
+        // registered handlers, including stale ones not swept yet
+        size_t numHandlers();
+        // loopers that have been constructed and not yet destroyed
+        size_t numLoopers();
+
+        // Loopers are named by generation-checked ids so that messages can find
+        // their looper without holding a reference to it. The id of an
+        // unregistered looper never resolves again, even if its slot is reused.
+        ALooper::looper_id registerLooper(ALooper* looper);
+
+        // Makes |looperID| unresolvable, then waits until every PinnedLooper
+        // that resolved it has gone away.
+        void unregisterLooper(ALooper::looper_id looperID);
+
+        // Resolves a looper id and keeps the looper from being destroyed for the
+        // lifetime of this object. Unlike locking a weak_ptr this only writes to
+        // the calling thread's own epoch record, not to a control block shared
+        // with every other thread posting to the same looper. Keep it short
+        // lived: unregisterLooper() blocks on it.
+        struct PinnedLooper {
+            explicit PinnedLooper(ALooper::looper_id looperID);
+            ~PinnedLooper();
+
+            // nullptr if the looper is gone
+            ALooper* get() const {
+                return mLooper;
+            }
+
+        private:
+            ALooper* mLooper;
+
+            DISALLOW_EVIL_CONSTRUCTORS(PinnedLooper);
+        };
+
+    private:
+        struct HandlerInfo {
+            std::weak_ptr<ALooper> mLooper;
+            std::weak_ptr<AHandler> mHandler;
+        };
+
+        enum {
+            // handler ids are spread over this many independently locked maps
+            kNumShards = 16,
+            // buckets of a shard checked for stale handlers per registration
+            kSweepBuckets = 2,
+        };
+
+        // cache line aligned so that shards do not share lock cache lines
+        struct alignas(64) Shard {
+            Shard() : mSweepBucket(0) {}
+
+            std::mutex mLock;
+            std::unordered_map<ALooper::handler_id, HandlerInfo> mHandlers;
+            // next bucket of mHandlers for sweepStale_l()
+            size_t mSweepBucket;
+        };
+
+        Shard mShards[kNumShards];
+        std::atomic<ALooper::handler_id> mNextHandlerID;
+
+        Shard& shardFor(ALooper::handler_id handlerID) {
+            return mShards[(uint32_t)handlerID % kNumShards];
+        }
+
+        struct LooperSlot {
+            LooperSlot() : mGeneration(0), mLooper(nullptr) {}
+
+            // odd while a looper is registered in the slot
+            std::atomic<uint32_t> mGeneration;
+            std::atomic<ALooper*> mLooper;
+        };
+
+        enum {
+            kSlotsPerChunk = 256,
+            kMaxSlotChunks = 1024,
+        };
+
+        // Slots are allocated a chunk at a time and never freed, so that
+        // resolving an id needs no lock. mSlotLock guards allocation only.
+        std::atomic<LooperSlot*> mSlotChunks[kMaxSlotChunks];
+        std::mutex mSlotLock;
+        uint32_t mNumSlots;
+        std::vector<uint32_t> mFreeSlots;
+
+        LooperSlot* slotFor(uint32_t index);
+
+        // Epoch based reclamation for looper slots. A thread that resolves an
+        // id publishes the global epoch in its own record while it uses the
+        // looper; unregisterLooper() advances the epoch and waits for records
+        // that still show an older one.
+        struct alignas(64) EpochRecord {
+            EpochRecord() : mEpoch(0), mDepth(0), mInUse(true), mNext(nullptr) {}
+
+            // 0 while the owning thread holds no PinnedLooper
+            std::atomic<uint64_t> mEpoch;
+            // nesting of PinnedLooper on the owning thread
+            uint32_t mDepth;
+            // false once the owning thread has exited, so the record can be reused
+            std::atomic<bool> mInUse;
+            EpochRecord* mNext;
+        };
+
+        struct EpochRecordHolder;
+        static thread_local EpochRecordHolder sEpochRecord;
+
+        std::atomic<uint64_t> mEpoch;
+        // records are only ever added to this list
+        std::atomic<EpochRecord*> mEpochRecords;
+
+        EpochRecord* currentEpochRecord();
+        void enterEpoch();
+        void exitEpoch();
+        // returns once every thread has left the PinnedLooper it was in
+        void synchronizeEpoch();
+
+        // erases the stale handlers found in the next |numBuckets| buckets of
+        // |shard|. Must be called with the shard's lock held.
+        void sweepStale_l(Shard& shard, size_t numBuckets);
+
+        DISALLOW_EVIL_CONSTRUCTORS(ALooperRoster);
+    };
+
+}  // namespace android
+
@@ -1,352 +1,799 @@
-#include "AMessage.h"
-#include "Logger.h"
-#include "AHandler.h"
-#include "ALooperRoster.h"
-namespace android {
-
-extern ALooperRoster gLooperRoster;
-
-status_t AReplyToken::setReply(const std::shared_ptr<AMessage>& reply) {
-    if (mReplied) {
-        LOGE("trying to post a duplicate reply");
-        return -EBUSY;
-    }
-    //CHECK(mReply == NULL);
-    if (reply == nullptr) {
-        abort();
-    }
-    mReply = reply;
-    mReplied = true;
-    return OK;
-}
-
-AMessage::AMessage(void)
-    : mWhat(0),
-    mTarget(0) {
-    LOGV("constructed {}", fmt::ptr(this));
-}
-
-AMessage::AMessage(uint32_t what, const std::shared_ptr<AHandler>& handler)
-    : mWhat(what) {
-    setTarget(handler);
-    LOGV("constructed {}", fmt::ptr(this));
-}
-
-AMessage::AMessage(const std::shared_ptr<AHandler>& handler)
-{
-    setTarget(handler);
-    LOGV("constructed {}", fmt::ptr(this));
-}
-
-AMessage::~AMessage() {
-    clear();
-    LOGV("destructed {}", fmt::ptr(this));
-}
-
-void AMessage::setWhat(uint32_t what) {
-    mWhat = what;
-}
-
-uint32_t AMessage::what() const {
-    return mWhat;
-}
-
-void AMessage::setTarget(const std::shared_ptr<AHandler>& handler) {
-    if (handler == nullptr) {
-        mTarget = 0;
-        mHandler.reset();
-        mLooper.reset();
-    }
-    else {
-        mTarget = handler->id();
-        mHandler = handler->getHandler();
-        mLooper = handler->getLooper();
-    }
-}
-
-
-status_t AMessage::post(int64_t delayUs) {
-    std::shared_ptr<ALooper> looper = mLooper.lock();
-    if (looper == nullptr) {
-        LOGW("failed to post message as target looper for handler {} is gone.", mTarget);
-        return -ENOENT;
-    }
-
-    looper->post(shared_from_this(), delayUs);
-    return OK;
-}
-
-status_t AMessage::postAndAwaitResponse(std::shared_ptr<AMessage>* response) {
-    std::shared_ptr<ALooper> looper = mLooper.lock();
-    if (looper == nullptr) {
-        LOGW("failed to post message as target looper for handler {} is gone.", mTarget);
-        return -ENOENT;
-    }
-
-    std::shared_ptr<AReplyToken> token = looper->createReplyToken();
-    if (token == nullptr) {
-        LOGE("failed to create reply token");
-        return -ENOMEM;
-    }
-    setReplyToken("replyID", token);
-
-    looper->post(shared_from_this(), 0 /* delayUs */);
-    return looper->awaitResponse(token, response);
-}
-
-status_t AMessage::postReply(const std::shared_ptr<AReplyToken>& replyToken) {
-    if (replyToken == nullptr) {
-        LOGW("failed to post reply to a NULL token");
-        return -ENOENT;
-    }
-    std::shared_ptr<ALooper> looper = replyToken->getLooper();
-    if (looper == nullptr) {
-        LOGW("failed to post reply as target looper is gone.");
-        return -ENOENT;
-    }
-    return looper->postReply(replyToken, shared_from_this());
-}
-
-bool AMessage::senderAwaitsResponse(std::shared_ptr<AReplyToken>* replyToken) {
-
-    std::shared_ptr<AReplyToken> tmp;
-    bool found = findReplyToken("replyID", &tmp);
-
-    if (!found) {
-        return false;
-    }
-
-    *replyToken = mToken;
-    tmp.reset();
-    mToken.reset();
-    mTokenName.clear();
-    return *replyToken != nullptr;
-}
-
-void AMessage::clear() {
-     //Item needs to be handled delicately
-    for (Item& item : mItems) {
-        delete[] item.mName;
-        item.mName = NULL;
-        freeItemValue(&item);
-    }
-    mItems.clear();
-}
-
-void AMessage::freeItemValue(Item* item) {
-    switch (item->mType) {
-    case kTypeString:
-    {
-        delete item->u.stringValue;
-        break;
-    }
-    default:
-        break;
-    }
-    item->mType = kTypeInt32; // clear type
-}
-
-#define BASIC_TYPE(NAME,FIELDNAME,TYPENAME)                             \
-void AMessage::set##NAME(const char *name, TYPENAME value) {            \
-Item *item = allocateItem(name);                                    \
-if (item) {                                                         \
-    item->mType = kType##NAME;                                      \
-    item->u.FIELDNAME = value;                                      \
-}                                                                   \
-}                                                                       \
-                                                                    \
-/* NOLINT added to avoid incorrect warning/fix from clang.tidy */       \
-bool AMessage::find##NAME(const char *name, TYPENAME *value) const {  /* NOLINT */ \
-const Item *item = findItem(name, kType##NAME);                     \
-if (item) {                                                         \
-    *value = item->u.FIELDNAME;                                     \
-    return true;                                                    \
-}                                                                   \
-return false;                                                       \
-}
-
-BASIC_TYPE(Int32, int32Value, int32_t)
-BASIC_TYPE(Int64, int64Value, int64_t)
-BASIC_TYPE(Size, sizeValue, size_t)
-BASIC_TYPE(Float, floatValue, float)
-BASIC_TYPE(Double, doubleValue, double)
-BASIC_TYPE(Pointer, ptrValue, void*)
-
-#undef BASIC_TYPE
-
-void AMessage::setString(
-        const char* name, const char* s, ssize_t len) {
-    Item* item = allocateItem(name);
-    if (item) {
-        item->mType = kTypeString;
-        item->u.stringValue = new std::string(s, len < 0 ? strlen(s) : len);
-    }
-}
-
-void AMessage::setString(
-    const char* name, const std::string& s) {
-    setString(name, s.c_str(), s.size());
-}
-
-bool AMessage::contains(const char* name) const {
-    size_t i = findItemIndex(name, strlen(name));
-    return i < mItems.size();
-}
-
-bool AMessage::findString(const char* name, std::string& value) const {
-    const Item* item = findItem(name, kTypeString);
-    if (item) {
-        value = *item->u.stringValue;
-        return true;
-    }
-    return false;
-}
-
-bool AMessage::findAsFloat(const char* name, float* value) const {
-    size_t i = findItemIndex(name, strlen(name));
-    if (i < mItems.size()) {
-        const Item* item = &mItems[i];
-        switch (item->mType) {
-        case kTypeFloat:
-            *value = item->u.floatValue;
-            return true;
-        case kTypeDouble:
-            *value = (float)item->u.doubleValue;
-            return true;
-        case kTypeInt64:
-            *value = (float)item->u.int64Value;
-            return true;
-        case kTypeInt32:
-            *value = (float)item->u.int32Value;
-            return true;
-        case kTypeSize:
-            *value = (float)item->u.sizeValue;
-            return true;
-        default:
-            return false;
-        }
-    }
-    return false;
-}
-
-bool AMessage::findAsInt64(const char* name, int64_t* value) const {
-    size_t i = findItemIndex(name, strlen(name));
-    if (i < mItems.size()) {
-        const Item* item = &mItems[i];
-        switch (item->mType) {
-        case kTypeInt64:
-            *value = item->u.int64Value;
-            return true;
-        case kTypeInt32:
-            *value = item->u.int32Value;
-            return true;
-        default:
-            return false;
-        }
-    }
-    return false;
-}
-
-bool AMessage::findRect(
-    const char* name,
-    int32_t* left, int32_t* top, int32_t* right, int32_t* bottom) const {
-    const Item* item = findItem(name, kTypeRect);
-    if (item == NULL) {
-        return false;
-    }
-
-    *left = item->u.rectValue.mLeft;
-    *top = item->u.rectValue.mTop;
-    *right = item->u.rectValue.mRight;
-    *bottom = item->u.rectValue.mBottom;
-
-    return true;
-}
-
-// assumes item's name was uninitialized or NULL
-void AMessage::Item::setName(const char* name, size_t len) {
-    mNameLength = len;
-    mName = new char[len + 1];
-    memcpy((void*)mName, name, len + 1);
-}
-
-AMessage::Item::Item(const char* name, size_t len)
-    : mType(kTypeInt32) {
-    // mName and mNameLength are initialized by setName
-    setName(name, len);
-}
-
-AMessage::Item* AMessage::allocateItem(const char* name) {
-    size_t len = strlen(name);
-    size_t i = findItemIndex(name, len);
-    Item* item;
-
-    if (i < mItems.size()) {
-        item = &mItems[i];
-        freeItemValue(item);
-    }
-    else {
-        //CHECK(mItems.size() < kMaxNumItems);
-        if (mItems.size() > kMaxNumItems) {
-            //too big items
-            abort();
-        }
-        i = mItems.size();
-        // place a 'blank' item at the end - this is of type kTypeInt32
-        mItems.emplace_back(name, len);
-        item = &mItems[i];
-    }
-
-    return item;
-}
-
-const AMessage::Item* AMessage::findItem(
-    const char* name, Type type) const {
-    size_t i = findItemIndex(name, strlen(name));
-    if (i < mItems.size()) {
-        const Item* item = &mItems[i];
-        return item->mType == type ? item : NULL;
-
-    }
-    return NULL;
-}
-
-inline size_t AMessage::findItemIndex(const char* name, size_t len) const {
-    size_t i = 0;
-    for (; i < mItems.size(); i++) {
-        if (len != mItems[i].mNameLength) {
-            continue;
-        }
-        if (!memcmp(mItems[i].mName, name, len)) {
-            break;
-        }
-    }
-    return i;
-}
-
-void AMessage::setReplyToken(const char* name, const std::shared_ptr<AReplyToken>& token)
-{
-    mTokenName = std::string(name);
-    mToken = token;
-    }
-
-bool AMessage::findReplyToken(const char* name, std::shared_ptr<AReplyToken>* obj)
-{
-    if (mTokenName == name) {
-        *obj = mToken;
-        return true;
-    }
-    return false;
-}
-
-void AMessage::deliver() {
-    std::shared_ptr<AHandler> handler = mHandler.lock();
-    if (handler == nullptr) {
-        LOGW("failed to deliver message as target handler {} is gone.", mTarget);
-        return;
-    }
-
-    handler->deliverMessage(shared_from_this());
-}
-
+#include "AMessage.h"
+#include "Logger.h"
+#include "AHandler.h"
+#include "ALooperRoster.h"
+#include "ATrace.h"
+namespace android {
+
+extern ALooperRoster gLooperRoster;
+
+status_t AReplyToken::setReply(const std::shared_ptr<AMessage>& reply) {
+    if (mReplied) {
+        LOGE("trying to post a duplicate reply");
+        return -EBUSY;
+    }
+    //CHECK(mReply == NULL);
+    if (reply == nullptr) {
+        abort();
+    }
+    mReply = reply;
+    mReplied = true;
+    return OK;
+}
+
+status_t AReplyToken::setError(status_t err) {
+    if (mReplied) {
+        LOGE("trying to complete a reply token twice");
+        return -EBUSY;
+    }
+    mError = err;
+    mReplied = true;
+    return OK;
+}
+
+AMessage::AMessage(void)
+    : mWhat(0),
+    mTarget(0),
+    mResource(std::pmr::get_default_resource()),
+    mItems(mResource) {
+    LOGV("constructed {}", fmt::ptr(this));
+}
+
+AMessage::AMessage(uint32_t what, const std::shared_ptr<AHandler>& handler)
+    : mWhat(what),
+    mResource(std::pmr::get_default_resource()),
+    mItems(mResource) {
+    setTarget(handler);
+    LOGV("constructed {}", fmt::ptr(this));
+}
+
+AMessage::AMessage(const std::shared_ptr<AHandler>& handler)
+    : mResource(std::pmr::get_default_resource()),
+    mItems(mResource) {
+    setTarget(handler);
+    LOGV("constructed {}", fmt::ptr(this));
+}
+
+AMessage::AMessage(uint32_t what, const std::shared_ptr<AHandler>& handler, std::pmr::memory_resource* resource)
+    : mWhat(what),
+    mResource(resource),
+    mItems(mResource) {
+    setTarget(handler);
+    LOGV("constructed {}", fmt::ptr(this));
+}
+
+AMessage::~AMessage() {
+    clear();
+    LOGV("destructed {}", fmt::ptr(this));
+}
+
+void AMessage::setWhat(uint32_t what) {
+    mWhat = what;
+}
+
+uint32_t AMessage::what() const {
+    return mWhat;
+}
+
+void AMessage::setTarget(const std::shared_ptr<AHandler>& handler) {
+    if (handler == nullptr) {
+        mTarget = 0;
+        mHandler.reset();
+        mLooperID = 0;
+    }
+    else {
+        mTarget = handler->id();
+        mHandler = handler;
+        mLooperID = handler->mLooperID.load(std::memory_order_relaxed);
+    }
+}
+
+
+status_t AMessage::post(int64_t delayUs) {
+    stampExpiry(delayUs);
+
+    std::shared_ptr<ALooper> strong;
+    {
+        ALooperRoster::PinnedLooper looper(mLooperID);
+        if (looper.get() == nullptr) {
+            LOGW("failed to post message as target looper for handler {} is gone.", mTarget);
+            return -ENOENT;
+        }
+        if (!looper.get()->mayBlock()) {
+            ATRACE_MESSAGE(kEventPost, this, mWhat, mTarget);
+            return looper.get()->post(shared_from_this(), delayUs);
+        }
+        // waiting for room must not hold up the reclamation of other loopers
+        strong = looper.get()->weak_from_this().lock();
+    }
+    if (strong == nullptr) {
+        LOGW("failed to post message as target looper for handler {} is gone.", mTarget);
+        return -ENOENT;
+    }
+
+    ATRACE_MESSAGE(kEventPost, this, mWhat, mTarget);
+    return strong->post(shared_from_this(), delayUs);
+}
+
+status_t AMessage::postRepeating(
+        int64_t periodUs, RepeatMode mode, CatchUpPolicy catchUp, int64_t initialDelayUs) {
+    if (periodUs <= 0) {
+        return BAD_VALUE;
+    }
+
+    if (initialDelayUs < 0) {
+        initialDelayUs = periodUs;
+    }
+    mRepeatPeriodUs = periodUs;
+    mRepeatMode = mode;
+    mRepeatCatchUp = catchUp;
+    mRepeatOverruns = 0;
+    mRepeatCancelled = false;
+    mRepeatDueUs = ALooper::GetNowUs() + initialDelayUs;
+
+    status_t err = post(initialDelayUs);
+    if (err != OK) {
+        mRepeatPeriodUs = 0;
+    }
+    return err;
+}
+
+void AMessage::cancelRepeating() {
+    mRepeatCancelled = true;
+}
+
+uint64_t AMessage::repeatOverruns() const {
+    return mRepeatOverruns;
+}
+
+void AMessage::postNextRepeat() {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (mRepeatMode == kRepeatFixedDelay) {
+        mRepeatDueUs = nowUs + mRepeatPeriodUs;
+    }
+    else {
+        // advance from the schedule, not from the delivery time
+        mRepeatDueUs += mRepeatPeriodUs;
+        if (mRepeatDueUs < nowUs && mRepeatCatchUp == kCatchUpSkip) {
+            int64_t missed = (nowUs - mRepeatDueUs) / mRepeatPeriodUs + 1;
+            mRepeatDueUs += missed * mRepeatPeriodUs;
+            mRepeatOverruns += missed;
+        }
+    }
+
+    ALooperRoster::PinnedLooper looper(mLooperID);
+    if (looper.get() == nullptr) {
+        mRepeatPeriodUs = 0;
+        return;
+    }
+    mExpiresUs = mTimeToLiveUs > 0 ? mRepeatDueUs + mTimeToLiveUs : 0;
+    ATRACE_MESSAGE(kEventPost, this, mWhat, mTarget);
+    status_t err = looper.get()->post(shared_from_this(), mRepeatDueUs - nowUs);
+    if (err != OK) {
+        LOGW("repeating message what={} stopped: {}", mWhat, err);
+        mRepeatPeriodUs = 0;
+    }
+}
+
+void AMessage::setTimerSlack(int64_t slackUs) {
+    mTimerSlackUs = slackUs;
+}
+
+void AMessage::setAsynchronous(bool async) {
+    mAsynchronous = async;
+}
+
+bool AMessage::isAsynchronous() const {
+    return mAsynchronous;
+}
+
+void AMessage::setTimeToLive(int64_t ttlUs) {
+    mTimeToLiveUs = ttlUs > 0 ? ttlUs : 0;
+}
+
+void AMessage::setExpiryNotify(const std::shared_ptr<AMessage>& notify) {
+    mExpiryNotify = notify;
+}
+
+status_t AMessage::postAndAwaitResponse(std::shared_ptr<AMessage>* response) {
+    std::shared_ptr<ALooper> looper;
+    std::shared_ptr<AReplyToken> token;
+    status_t err = postWithReplyToken(nullptr, &looper, &token);
+    if (err != OK) {
+        return err;
+    }
+    return looper->awaitResponse(token, response);
+}
+
+status_t AMessage::postRequest(AReplyToken::ReplyCallback onReply) {
+    return postWithReplyToken(std::move(onReply), nullptr, nullptr);
+}
+
+status_t AMessage::postWithReplyToken(
+        AReplyToken::ReplyCallback onReply,
+        std::shared_ptr<ALooper>* looperOut, std::shared_ptr<AReplyToken>* tokenOut) {
+    // the caller may block on the looper, so hold a real reference rather
+    // than a PinnedLooper
+    std::shared_ptr<ALooper> looper;
+    {
+        ALooperRoster::PinnedLooper pinned(mLooperID);
+        if (pinned.get() != nullptr) {
+            // empty if the looper is already being destroyed
+            looper = pinned.get()->weak_from_this().lock();
+        }
+    }
+    if (looper == nullptr) {
+        LOGW("failed to post message as target looper for handler {} is gone.", mTarget);
+        return -ENOENT;
+    }
+
+    // a callback token must be released once the receiver drops it, so only
+    // synchronous calls reuse tokens
+    std::shared_ptr<AReplyToken> token = looper->createReplyToken(onReply == nullptr);
+    if (token == nullptr) {
+        LOGE("failed to create reply token");
+        return -ENOMEM;
+    }
+    // set before posting, so the replier sees it without taking a lock
+    token->mOnReply = std::move(onReply);
+    setReplyToken(token);
+    stampExpiry(0);
+
+    ATRACE_MESSAGE(kEventPost, this, mWhat, mTarget);
+    status_t err = looper->post(shared_from_this(), 0 /* delayUs */);
+    if (err != OK) {
+        // the caller learns from |err|; nobody is to be called back
+        token->mOnReply = nullptr;
+        mToken = nullptr;
+        return err;
+    }
+
+    if (looperOut != nullptr) {
+        *looperOut = looper;
+    }
+    if (tokenOut != nullptr) {
+        *tokenOut = token;
+    }
+    return OK;
+}
+
+status_t AMessage::postReply(const std::shared_ptr<AReplyToken>& replyToken) {
+    if (replyToken == nullptr) {
+        LOGW("failed to post reply to a NULL token");
+        return -ENOENT;
+    }
+    std::shared_ptr<ALooper> looper = replyToken->getLooper();
+    if (looper == nullptr) {
+        LOGW("failed to post reply as target looper is gone.");
+        return -ENOENT;
+    }
+    ATRACE_MESSAGE(kEventReply, this, mWhat, mTarget);
+    return looper->postReply(replyToken, shared_from_this());
+}
+
+bool AMessage::senderAwaitsResponse(std::shared_ptr<AReplyToken>* replyToken) {
+    if (mToken == nullptr) {
+        return false;
+    }
+
+    *replyToken = std::move(mToken);
+    mToken = nullptr;
+    return true;
+}
+
+std::shared_ptr<AMessage> AMessage::dup() const {
+    std::shared_ptr<AMessage> msg = std::make_shared<AMessage>();
+    dupInto(msg.get());
+    return msg;
+}
+
+void AMessage::dupInto(AMessage* msg) const {
+    msg->mWhat = mWhat;
+    msg->mTarget = mTarget;
+    msg->mHandler = mHandler;
+    msg->mLooperID = mLooperID;
+    msg->mTimerSlackUs = mTimerSlackUs;
+    msg->mAsynchronous = mAsynchronous;
+
+    msg->mItems.reserve(mItems.size());
+    for (const Item& from : mItems) {
+        msg->mItems.emplace_back(from.mName, from.mNameLength, msg->mResource);
+        Item& to = msg->mItems.back();
+        to.mType = from.mType;
+        if (from.mType == kTypeString) {
+            to.u.stringValue = msg->newString(from.u.stringValue->data(), from.u.stringValue->size());
+        }
+        else {
+            to.u = from.u;
+        }
+    }
+}
+
+void AMessage::clear() {
+     //Item needs to be handled delicately
+    for (Item& item : mItems) {
+        mResource->deallocate((void*)item.mName, item.mNameLength + 1, 1);
+        item.mName = NULL;
+        freeItemValue(&item);
+    }
+    mItems.clear();
+}
+
+void AMessage::freeItemValue(Item* item) {
+    switch (item->mType) {
+    case kTypeString:
+    {
+        std::pmr::string* str = item->u.stringValue;
+        str->~basic_string();
+        mResource->deallocate(str, sizeof(std::pmr::string), alignof(std::pmr::string));
+        break;
+    }
+    default:
+        break;
+    }
+    item->mType = kTypeInt32; // clear type
+}
+
+#define BASIC_TYPE(NAME,FIELDNAME,TYPENAME)                             \
+void AMessage::set##NAME(const char *name, TYPENAME value) {            \
+Item *item = allocateItem(name);                                    \
+if (item) {                                                         \
+    item->mType = kType##NAME;                                      \
+    item->u.FIELDNAME = value;                                      \
+}                                                                   \
+}                                                                       \
+                                                                    \
+/* NOLINT added to avoid incorrect warning/fix from clang.tidy */       \
+bool AMessage::find##NAME(const char *name, TYPENAME *value) const {  /* NOLINT */ \
+const Item *item = findItem(name, kType##NAME);                     \
+if (item) {                                                         \
+    *value = item->u.FIELDNAME;                                     \
+    return true;                                                    \
+}                                                                   \
+return false;                                                       \
+}
+
+BASIC_TYPE(Int32, int32Value, int32_t)
+BASIC_TYPE(Int64, int64Value, int64_t)
+BASIC_TYPE(Size, sizeValue, size_t)
+BASIC_TYPE(Float, floatValue, float)
+BASIC_TYPE(Double, doubleValue, double)
+BASIC_TYPE(Pointer, ptrValue, void*)
+
+#undef BASIC_TYPE
+
+void AMessage::setString(
+        const char* name, const char* s, ssize_t len) {
+    Item* item = allocateItem(name);
+    if (item) {
+        item->mType = kTypeString;
+        item->u.stringValue = newString(s, len < 0 ? strlen(s) : len);
+    }
+}
+
+std::pmr::string* AMessage::newString(const char* s, size_t len) {
+    void* storage = mResource->allocate(sizeof(std::pmr::string), alignof(std::pmr::string));
+    return new (storage) std::pmr::string(s, len, mResource);
+}
+
+void AMessage::setString(
+    const char* name, const std::string& s) {
+    setString(name, s.c_str(), s.size());
+}
+
+bool AMessage::contains(const char* name) const {
+    size_t i = findItemIndex(name, strlen(name));
+    return i < mItems.size();
+}
+
+bool AMessage::findString(const char* name, std::string& value) const {
+    const Item* item = findItem(name, kTypeString);
+    if (item) {
+        value.assign(item->u.stringValue->data(), item->u.stringValue->size());
+        return true;
+    }
+    return false;
+}
+
+bool AMessage::findAsFloat(const char* name, float* value) const {
+    size_t i = findItemIndex(name, strlen(name));
+    if (i < mItems.size()) {
+        const Item* item = &mItems[i];
+        switch (item->mType) {
+        case kTypeFloat:
+            *value = item->u.floatValue;
+            return true;
+        case kTypeDouble:
+            *value = (float)item->u.doubleValue;
+            return true;
+        case kTypeInt64:
+            *value = (float)item->u.int64Value;
+            return true;
+        case kTypeInt32:
+            *value = (float)item->u.int32Value;
+            return true;
+        case kTypeSize:
+            *value = (float)item->u.sizeValue;
+            return true;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+bool AMessage::findAsInt64(const char* name, int64_t* value) const {
+    size_t i = findItemIndex(name, strlen(name));
+    if (i < mItems.size()) {
+        const Item* item = &mItems[i];
+        switch (item->mType) {
+        case kTypeInt64:
+            *value = item->u.int64Value;
+            return true;
+        case kTypeInt32:
+            *value = item->u.int32Value;
+            return true;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+bool AMessage::findRect(
+    const char* name,
+    int32_t* left, int32_t* top, int32_t* right, int32_t* bottom) const {
+    const Item* item = findItem(name, kTypeRect);
+    if (item == NULL) {
+        return false;
+    }
+
+    *left = item->u.rectValue.mLeft;
+    *top = item->u.rectValue.mTop;
+    *right = item->u.rectValue.mRight;
+    *bottom = item->u.rectValue.mBottom;
+
+    return true;
+}
+
+namespace {
+
+// appends to a flatten() buffer, or only counts the bytes if it has none
+struct FlatWriter {
+    FlatWriter(uint8_t* data, size_t size)
+        : mData(data), mSize(size), mOffset(0), mOverflow(false) {}
+
+    template <typename T>
+    void write(const T& value) {
+        write(&value, sizeof(value));
+    }
+
+    void write(const void* p, size_t n) {
+        if (mData != nullptr) {
+            if (mOverflow || n > mSize - mOffset) {
+                mOverflow = true;
+            }
+            else {
+                memcpy(mData + mOffset, p, n);
+            }
+        }
+        mOffset += n;
+    }
+
+    uint8_t* mData;
+    size_t mSize;
+    size_t mOffset;
+    bool mOverflow;
+};
+
+struct FlatReader {
+    FlatReader(const uint8_t* data, size_t size)
+        : mData(data), mSize(size), mOffset(0) {}
+
+    template <typename T>
+    bool read(T* value) {
+        return read(value, sizeof(*value));
+    }
+
+    bool read(void* p, size_t n) {
+        if (n > mSize - mOffset) {
+            return false;
+        }
+        memcpy(p, mData + mOffset, n);
+        mOffset += n;
+        return true;
+    }
+
+    const uint8_t* mData;
+    size_t mSize;
+    size_t mOffset;
+};
+
+}  // namespace
+
+// layout: what and the item count as uint32_t, then per item the name length
+// and type as uint16_t, the name without its terminator and the value. A
+// string value is its uint32_t length and bytes. Host byte order.
+ssize_t AMessage::flatten(uint8_t* data, size_t size) const {
+    if (mPayloadType != nullptr) {
+        LOGE("cannot flatten the payload of a typed message what={}", mWhat);
+        return BAD_TYPE;
+    }
+
+    FlatWriter writer(data, size);
+    writer.write(mWhat);
+    writer.write((uint32_t)mItems.size());
+    for (const Item& item : mItems) {
+        if (item.mNameLength > UINT16_MAX) {
+            return BAD_VALUE;
+        }
+        writer.write((uint16_t)item.mNameLength);
+        writer.write((uint16_t)item.mType);
+        writer.write(item.mName, item.mNameLength);
+        switch (item.mType) {
+            case kTypeInt32:
+                writer.write(item.u.int32Value);
+                break;
+            case kTypeInt64:
+                writer.write(item.u.int64Value);
+                break;
+            case kTypeSize:
+                writer.write((uint64_t)item.u.sizeValue);
+                break;
+            case kTypeFloat:
+                writer.write(item.u.floatValue);
+                break;
+            case kTypeDouble:
+                writer.write(item.u.doubleValue);
+                break;
+            case kTypeString:
+                if (item.u.stringValue->size() > UINT32_MAX) {
+                    return BAD_VALUE;
+                }
+                writer.write((uint32_t)item.u.stringValue->size());
+                writer.write(item.u.stringValue->data(), item.u.stringValue->size());
+                break;
+            case kTypeRect:
+                writer.write(item.u.rectValue);
+                break;
+            default:
+                LOGE("cannot flatten item {} of message what={}", item.mName, mWhat);
+                return BAD_TYPE;
+        }
+    }
+
+    if (writer.mOverflow) {
+        return NO_MEMORY;
+    }
+    return writer.mOffset;
+}
+
+// static
+std::shared_ptr<AMessage> AMessage::unflatten(const uint8_t* data, size_t size) {
+    FlatReader reader(data, size);
+    uint32_t what;
+    uint32_t numItems;
+    if (!reader.read(&what) || !reader.read(&numItems) || numItems > kMaxNumItems) {
+        return nullptr;
+    }
+
+    std::shared_ptr<AMessage> msg = std::make_shared<AMessage>();
+    msg->mWhat = what;
+    msg->mItems.reserve(numItems);
+    std::string nameBuffer;
+    for (uint32_t i = 0; i < numItems; i++) {
+        uint16_t nameLength;
+        uint16_t type;
+        if (!reader.read(&nameLength) || !reader.read(&type) || nameLength > size - reader.mOffset) {
+            return nullptr;
+        }
+        nameBuffer.assign((const char*)data + reader.mOffset, nameLength);
+        reader.mOffset += nameLength;
+        if (nameBuffer.find('\0') != std::string::npos) {
+            return nullptr;
+        }
+        const char* name = nameBuffer.c_str();
+
+        bool ok = false;
+        switch (type) {
+            case kTypeInt32:
+            {
+                int32_t value;
+                if ((ok = reader.read(&value))) {
+                    msg->setInt32(name, value);
+                }
+                break;
+            }
+            case kTypeInt64:
+            {
+                int64_t value;
+                if ((ok = reader.read(&value))) {
+                    msg->setInt64(name, value);
+                }
+                break;
+            }
+            case kTypeSize:
+            {
+                uint64_t value;
+                if ((ok = reader.read(&value))) {
+                    msg->setSize(name, (size_t)value);
+                }
+                break;
+            }
+            case kTypeFloat:
+            {
+                float value;
+                if ((ok = reader.read(&value))) {
+                    msg->setFloat(name, value);
+                }
+                break;
+            }
+            case kTypeDouble:
+            {
+                double value;
+                if ((ok = reader.read(&value))) {
+                    msg->setDouble(name, value);
+                }
+                break;
+            }
+            case kTypeString:
+            {
+                uint32_t length;
+                if ((ok = reader.read(&length) && length <= size - reader.mOffset)) {
+                    msg->setString(name, (const char*)data + reader.mOffset, length);
+                    reader.mOffset += length;
+                }
+                break;
+            }
+            case kTypeRect:
+            {
+                Rect value;
+                if ((ok = reader.read(&value))) {
+                    Item* item = msg->allocateItem(name);
+                    item->mType = kTypeRect;
+                    item->u.rectValue = value;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        if (!ok) {
+            return nullptr;
+        }
+    }
+    return msg;
+}
+
+// assumes item's name was uninitialized or NULL
+void AMessage::Item::setName(const char* name, size_t len, std::pmr::memory_resource* resource) {
+    mNameLength = len;
+    mName = (const char*)resource->allocate(len + 1, 1);
+    memcpy((void*)mName, name, len + 1);
+}
+
+AMessage::Item::Item(const char* name, size_t len, std::pmr::memory_resource* resource)
+    : mType(kTypeInt32) {
+    // mName and mNameLength are initialized by setName
+    setName(name, len, resource);
+}
+
+AMessage::Item* AMessage::allocateItem(const char* name) {
+    size_t len = strlen(name);
+    size_t i = findItemIndex(name, len);
+    Item* item;
+
+    if (i < mItems.size()) {
+        item = &mItems[i];
+        freeItemValue(item);
+    }
+    else {
+        //CHECK(mItems.size() < kMaxNumItems);
+        if (mItems.size() > kMaxNumItems) {
+            //too big items
+            abort();
+        }
+        i = mItems.size();
+        // place a 'blank' item at the end - this is of type kTypeInt32
+        mItems.emplace_back(name, len, mResource);
+        item = &mItems[i];
+    }
+
+    return item;
+}
+
+const AMessage::Item* AMessage::findItem(
+    const char* name, Type type) const {
+    size_t i = findItemIndex(name, strlen(name));
+    if (i < mItems.size()) {
+        const Item* item = &mItems[i];
+        return item->mType == type ? item : NULL;
+
+    }
+    return NULL;
+}
+
+inline size_t AMessage::findItemIndex(const char* name, size_t len) const {
+    size_t i = 0;
+    for (; i < mItems.size(); i++) {
+        if (len != mItems[i].mNameLength) {
+            continue;
+        }
+        if (!memcmp(mItems[i].mName, name, len)) {
+            break;
+        }
+    }
+    return i;
+}
+
+void AMessage::setReplyToken(const std::shared_ptr<AReplyToken>& token)
+{
+    mToken = token;
+}
+
+void AMessage::expire() {
+    LOGV("message what={} for handler {} expired", mWhat, mTarget);
+
+    failReply(TIMED_OUT);
+    if (mExpiryNotify != nullptr) {
+        mExpiryNotify->post();
+    }
+
+    // a late tick of a repeating message does not end the schedule
+    if (mRepeatPeriodUs > 0) {
+        if (!mRepeatCancelled) {
+            postNextRepeat();
+        }
+        else {
+            mRepeatPeriodUs = 0;
+        }
+    }
+}
+
+void AMessage::failReply(status_t err) {
+    if (mToken == nullptr) {
+        return;
+    }
+    std::shared_ptr<AReplyToken> token = std::move(mToken);
+    mToken = nullptr;
+    std::shared_ptr<ALooper> looper = token->getLooper();
+    if (looper != nullptr) {
+        looper->postReplyError(token, err);
+    }
+}
+
+void AMessage::deliver(const std::shared_ptr<AMessage>& self) {
+    if (mRepeatPeriodUs > 0 && mRepeatCancelled) {
+        LOGV("dropped cancelled tick of message what={}", mWhat);
+        // the schedule is over; a later post() is a one-shot again
+        mRepeatPeriodUs = 0;
+        failReply(-ECANCELED);
+        return;
+    }
+
+    std::shared_ptr<AHandler> handler = mHandler.lock();
+    if (handler == nullptr) {
+        LOGW("failed to deliver message as target handler {} is gone.", mTarget);
+        // nobody will reply
+        failReply(-ENOENT);
+        mRepeatPeriodUs = 0;
+        return;
+    }
+
+    ATRACE_MESSAGE(kEventDeliverBegin, this, mWhat, mTarget);
+    handler->deliverMessage(self);
+    ATRACE_MESSAGE(kEventDeliverEnd, this, mWhat, mTarget);
+
+    if (mRepeatPeriodUs > 0) {
+        if (!mRepeatCancelled) {
+            postNextRepeat();
+        }
+        else {
+            // cancelled while it was being handled
+            mRepeatPeriodUs = 0;
+        }
+    }
+}
+
 }
\ No newline at end of file
@@ -1,197 +1,375 @@
-#pragma once
-#include "Base.h"
-#include "ALooper.h"
-#include "Logger.h"
-namespace android {
-
-struct AHandler;
-
-struct AReplyToken : public std::enable_shared_from_this<AReplyToken> {
-    explicit AReplyToken(const std::shared_ptr<ALooper>& looper)
-        : mLooper(looper),
-        mReplied(false) {
-        LOGV("constructed {}", fmt::ptr(this));
-    }
-    ~AReplyToken() {
-        LOGV("destructed {}", fmt::ptr(this));
-    }
-
-private:
-    friend struct AMessage;
-    friend struct ALooper;
-    std::weak_ptr<ALooper> mLooper;
-    std::shared_ptr<AMessage> mReply;
-    bool mReplied;
-
-    std::shared_ptr<ALooper> getLooper() const {
-        return mLooper.lock();
-    }
-    // if reply is not set, returns false; otherwise, it retrieves the reply and returns true
-    bool retrieveReply(std::shared_ptr<AMessage>* reply) {
-        if (reply == nullptr) {
-            LOGE("reply is null pointer");
-            abort();
-        }
-        if (mReplied) {
-            *reply = mReply;
-            mReply = nullptr;
-        }
-        return mReplied;
-    }
-    // sets the reply for this token. returns OK or error
-    status_t setReply(const std::shared_ptr<AMessage>& reply);
-};
-
-struct AMessage : std::enable_shared_from_this<AMessage> {
-public:
-    enum Type {
-        kTypeInt32,
-        kTypeInt64,
-        kTypeSize,
-        kTypeFloat,
-        kTypeDouble,
-        kTypePointer,
-        kTypeString,
-        kTypeRect,
-        kTypeSpAReplayToken,
-    };
-
-    struct Rect {
-        int32_t mLeft, mTop, mRight, mBottom;
-    };
-
-    AMessage();
-    AMessage(uint32_t what, const std::shared_ptr<AHandler>& handler);
-    AMessage(const std::shared_ptr<AHandler>& handler);
-    void setWhat(uint32_t what);
-    uint32_t what() const;
-
-    void setTarget(const std::shared_ptr<AHandler>& handler);
-
-    status_t post(int64_t delayUs = 0);
-
-    // Posts the message to its target and waits for a response (or error)
-    // before returning.
-    status_t postAndAwaitResponse(std::shared_ptr<AMessage>* response);
-
-    // If this returns true, the sender of this message is synchronously
-    // awaiting a response and the reply token is consumed from the message
-    // and stored into replyID. The reply token must be used to send the response
-    // using "postReply" below.
-    bool senderAwaitsResponse(std::shared_ptr<AReplyToken>* replyID);
-
-    // Posts the message as a response to a reply token.  A reply token can
-    // only be used once. Returns OK if the response could be posted; otherwise,
-    // an error.
-    status_t postReply(const std::shared_ptr<AReplyToken>& replyID);
-
-    // removes all items
-    void clear();
-
-    void setInt32(const char* name, int32_t value);
-    void setInt64(const char* name, int64_t value);
-    void setSize(const char* name, size_t value);
-    void setFloat(const char* name, float value);
-    void setDouble(const char* name, double value);
-    void setPointer(const char* name, void* value);
-    void setString(const char* name, const char* s, ssize_t len = -1);
-    void setString(const char* name, const std::string& s);
-
-    bool contains(const char* name) const;
-
-    bool findInt32(const char* name, int32_t* value) const;
-    bool findInt64(const char* name, int64_t* value) const;
-    bool findSize(const char* name, size_t* value) const;
-    bool findFloat(const char* name, float* value) const;
-    bool findDouble(const char* name, double* value) const;
-    bool findPointer(const char* name, void** value) const;
-    bool findString(const char* name, std::string& value) const;
-
-    // finds signed integer types cast to int64_t
-    bool findAsInt64(const char* name, int64_t* value) const;
-
-    // finds any numeric type cast to a float
-    bool findAsFloat(const char* name, float* value) const;
-
-    bool findRect(
-        const char* name,
-        int32_t* left, int32_t* top, int32_t* right, int32_t* bottom) const;
-
-    virtual ~AMessage();
-
-private:
-    friend struct ALooper; // deliver()
-
-    uint32_t mWhat;
-
-    // used only for debugging
-    ALooper::handler_id mTarget;
-
-    std::weak_ptr<AHandler> mHandler;
-    std::weak_ptr<ALooper> mLooper;
-
-    struct Item {
-        union {
-            int32_t int32Value;
-            int64_t int64Value;
-            size_t sizeValue;
-            float floatValue;
-            double doubleValue;
-            void* ptrValue;
-            std::string* stringValue;
-            Rect rectValue;
-        } u;
-        const char* mName;
-        size_t      mNameLength;
-        Type mType;
-        void setName(const char* name, size_t len);
-        Item() : mName(nullptr), mNameLength(0), mType(kTypeInt32) { }
-        Item(const char* name, size_t length);
-    };
-
-    enum {
-        kMaxNumItems = 256
-    };
-    std::vector<Item> mItems;
-
-    /**
-        * Allocates an item with the given key |name|. If the key already exists, the corresponding
-        * item value is freed. Otherwise a new item is added.
-        *
-        * This method currently asserts if the number of elements would exceed the max number of
-        * elements allowed (kMaxNumItems). This is a security precaution to avoid arbitrarily large
-        * AMessage structures.
-        *
-        * @todo(b/192153245) Either revisit this security precaution, or change the behavior to
-        *      silently ignore keys added after the max number of elements are reached.
-        *
-        * @note All previously returned Item* pointers are deemed invalid after this call. (E.g. from
-        *       allocateItem or findItem)
-        *
-        * @param name the key for the requested item.
-        *
-        * @return Item* a pointer to the item.
-        */
-    Item* allocateItem(const char* name);
-
-    /** Frees the value for the item. */
-    void freeItemValue(Item* item);
-
-    /** Finds an item with given key |name| and |type|. Returns nullptr if item is not found. */
-    const Item* findItem(const char* name, Type type) const;
-
-    size_t findItemIndex(const char* name, size_t len) const;
-
-    std::shared_ptr<AReplyToken> mToken = nullptr;
-    std::string mTokenName;
-
-    void setReplyToken(const char* name, const std::shared_ptr<AReplyToken>& token);
-    bool findReplyToken(const char* name, std::shared_ptr<AReplyToken>* obj);
-
-    void deliver();
-
-    DISALLOW_EVIL_CONSTRUCTORS(AMessage);
-};
-}
-
-
+#pragma once
+#include <memory_resource>
+#include <string>
+
+#include "Base.h"
+#include "ALooper.h"
+#include "Logger.h"
+namespace android {
+
+struct AHandler;
+
+struct AReplyToken : public std::enable_shared_from_this<AReplyToken> {
+    // receives OK and the reply, or an error and nullptr: TIMED_OUT if the
+    // message expired, -ENOENT if the token is released without a reply
+    typedef std::function<void(status_t err, const std::shared_ptr<AMessage>& reply)> ReplyCallback;
+
+    explicit AReplyToken(const std::shared_ptr<ALooper>& looper)
+        : mLooper(looper),
+        mReplied(false),
+        mError(OK) {
+        LOGV("constructed {}", fmt::ptr(this));
+    }
+    ~AReplyToken() {
+        if (mOnReply != nullptr) {
+            mOnReply(-ENOENT, nullptr);
+        }
+        LOGV("destructed {}", fmt::ptr(this));
+    }
+
+private:
+    friend struct AMessage;
+    friend struct ALooper;
+    std::weak_ptr<ALooper> mLooper;
+    std::shared_ptr<AMessage> mReply;
+    bool mReplied;
+    // set instead of mReply if the request failed, e.g. TIMED_OUT
+    status_t mError;
+    // set for AMessage::request(): called instead of waking awaitResponse()
+    ReplyCallback mOnReply;
+
+    // Readies a token nobody else references for a new call to |looper|.
+    // Holding a reference, as a message or a replier does, keeps a token from
+    // being recycled, so a late reply cannot complete another call.
+    void recycle(const std::shared_ptr<ALooper>& looper) {
+        mLooper = looper;
+        mReply = nullptr;
+        mReplied = false;
+        mError = OK;
+    }
+
+    std::shared_ptr<ALooper> getLooper() const {
+        return mLooper.lock();
+    }
+    // if reply is not set, returns false; otherwise, it retrieves the reply and returns true
+    bool retrieveReply(std::shared_ptr<AMessage>* reply) {
+        if (reply == nullptr) {
+            LOGE("reply is null pointer");
+            abort();
+        }
+        if (mReplied) {
+            *reply = mReply;
+            mReply = nullptr;
+        }
+        return mReplied;
+    }
+    // sets the reply for this token. returns OK or error
+    status_t setReply(const std::shared_ptr<AMessage>& reply);
+    // completes this token with |err| instead of a reply. returns OK or error
+    status_t setError(status_t err);
+};
+
+struct AMessage : std::enable_shared_from_this<AMessage> {
+public:
+    enum Type {
+        kTypeInt32,
+        kTypeInt64,
+        kTypeSize,
+        kTypeFloat,
+        kTypeDouble,
+        kTypePointer,
+        kTypeString,
+        kTypeRect,
+        kTypeSpAReplayToken,
+    };
+
+    struct Rect {
+        int32_t mLeft, mTop, mRight, mBottom;
+    };
+
+    // how postRepeating() schedules the next delivery
+    enum RepeatMode {
+        // every period after the first due time, independent of how long the
+        // handler takes: the schedule does not drift
+        kRepeatFixedRate,
+        // one period after the handler returned
+        kRepeatFixedDelay,
+    };
+
+    // what kRepeatFixedRate does with ticks that were missed because the
+    // handler or the looper fell behind
+    enum CatchUpPolicy {
+        // drop them and continue with the next tick on the original schedule
+        kCatchUpSkip,
+        // deliver them back to back until the schedule is caught up
+        kCatchUpBurst,
+    };
+
+    AMessage();
+    AMessage(uint32_t what, const std::shared_ptr<AHandler>& handler);
+    AMessage(const std::shared_ptr<AHandler>& handler);
+    // Items, names and strings are allocated from |resource| instead of the
+    // default resource, e.g. so that a burst of messages built on one thread
+    // and freed on a looper thread does not churn the heap's thread caches.
+    // |resource| must outlive the message; see AMessageArena for one that does.
+    AMessage(uint32_t what, const std::shared_ptr<AHandler>& handler, std::pmr::memory_resource* resource);
+    void setWhat(uint32_t what);
+    uint32_t what() const;
+
+    void setTarget(const std::shared_ptr<AHandler>& handler);
+
+    status_t post(int64_t delayUs = 0);
+
+    // Posts this message |initialDelayUs| from now (one period if negative)
+    // and then re-posts the same message object every |periodUs| after it has
+    // been handled, until cancelRepeating() is called or the handler goes away.
+    status_t postRepeating(
+        int64_t periodUs,
+        RepeatMode mode = kRepeatFixedRate,
+        CatchUpPolicy catchUp = kCatchUpSkip,
+        int64_t initialDelayUs = -1);
+
+    // Stops a postRepeating() schedule. A pending tick is dropped. Can be
+    // called from any thread, including from the handler. Once the pending
+    // tick is gone the message can be posted again as a one-shot.
+    void cancelRepeating();
+
+    // number of ticks dropped by kCatchUpSkip so far
+    uint64_t repeatOverruns() const;
+
+    // Lets the looper deliver this message up to |slackUs| after it is due
+    // when that saves a wakeup. Overrides the looper's timer slack; a
+    // negative value (the default) uses it.
+    void setTimerSlack(int64_t slackUs);
+
+    // Drops the message instead of delivering it if it is still queued
+    // |ttlUs| after it became due, e.g. because the looper is overloaded.
+    // A sender waiting in postAndAwaitResponse() or request() gets
+    // TIMED_OUT. 0 (the default) never expires. Takes effect on the next post.
+    void setTimeToLive(int64_t ttlUs);
+
+    // |notify| is posted when this message expires, see setTimeToLive()
+    void setExpiryNotify(const std::shared_ptr<AMessage>& notify);
+
+    // An asynchronous message is delivered past a sync barrier, see
+    // ALooper::postSyncBarrier(), e.g. for vsync or input events that must
+    // not wait behind bulk work. Takes effect on the next post.
+    void setAsynchronous(bool async);
+    bool isAsynchronous() const;
+
+    // Posts the message to its target and waits for a response (or error)
+    // before returning.
+    status_t postAndAwaitResponse(std::shared_ptr<AMessage>* response);
+
+    // co_await msg->request(&response) posts the message and suspends the
+    // coroutine until the reply arrives, without blocking a thread. Defined
+    // in ACoroutine.h, which requires C++20.
+    struct RequestAwaiter;
+    RequestAwaiter request(std::shared_ptr<AMessage>* response);
+
+    // If this returns true, the sender of this message is synchronously
+    // awaiting a response and the reply token is consumed from the message
+    // and stored into replyID. The reply token must be used to send the response
+    // using "postReply" below.
+    bool senderAwaitsResponse(std::shared_ptr<AReplyToken>* replyID);
+
+    // Posts the message as a response to a reply token.  A reply token can
+    // only be used once. Returns OK if the response could be posted; otherwise,
+    // an error.
+    status_t postReply(const std::shared_ptr<AReplyToken>& replyID);
+
+    // Performs a deep-copy of "this", including the target. A pending reply
+    // token is not copied, and the copy uses the default memory resource.
+    // ATypedMessage overrides it to copy its payload too.
+    virtual std::shared_ptr<AMessage> dup() const;
+
+    // removes all items
+    void clear();
+
+    // Serializes what and the items, e.g. for AShmClient to send them to
+    // another process on the same host. The target, a reply token and the
+    // delivery settings are not included. Returns the number of bytes
+    // written, or only the number needed if |data| is null. Fails with
+    // BAD_TYPE for pointer items and typed payloads, which mean nothing in
+    // another process, and with NO_MEMORY if |size| is too small.
+    ssize_t flatten(uint8_t* data, size_t size) const;
+
+    // a message with what and the items of flatten()'s output, without a
+    // target; nullptr if |data| is malformed
+    static std::shared_ptr<AMessage> unflatten(const uint8_t* data, size_t size);
+
+    void setInt32(const char* name, int32_t value);
+    void setInt64(const char* name, int64_t value);
+    void setSize(const char* name, size_t value);
+    void setFloat(const char* name, float value);
+    void setDouble(const char* name, double value);
+    void setPointer(const char* name, void* value);
+    void setString(const char* name, const char* s, ssize_t len = -1);
+    void setString(const char* name, const std::string& s);
+
+    bool contains(const char* name) const;
+
+    bool findInt32(const char* name, int32_t* value) const;
+    bool findInt64(const char* name, int64_t* value) const;
+    bool findSize(const char* name, size_t* value) const;
+    bool findFloat(const char* name, float* value) const;
+    bool findDouble(const char* name, double* value) const;
+    bool findPointer(const char* name, void** value) const;
+    bool findString(const char* name, std::string& value) const;
+
+    // finds signed integer types cast to int64_t
+    bool findAsInt64(const char* name, int64_t* value) const;
+
+    // finds any numeric type cast to a float
+    bool findAsFloat(const char* name, float* value) const;
+
+    bool findRect(
+        const char* name,
+        int32_t* left, int32_t* top, int32_t* right, int32_t* bottom) const;
+
+    virtual ~AMessage();
+
+protected:
+    // copies what dup() copies (everything but the payload) into |msg|
+    void dupInto(AMessage* msg) const;
+
+private:
+    friend struct ALooper; // deliver()
+    friend struct ALooperPool; // deliver(), mTarget
+    friend struct AShmClient;  // mTarget, mToken
+    friend struct AShmServer;  // postRequest()
+    friend struct ASocketClient;  // mToken
+    friend struct ASocketServer;  // postRequest()
+    template <typename T> friend struct ATypedMessage; // mPayloadType
+
+    uint32_t mWhat;
+
+    // used for debugging, and by ALooperPool to serialize delivery per handler
+    ALooper::handler_id mTarget;
+
+    std::weak_ptr<AHandler> mHandler;
+    // resolved through gLooperRoster on post, so that producers don't all
+    // write to the looper's shared_ptr control block
+    ALooper::looper_id mLooperID = 0;
+
+    int64_t mTimerSlackUs = -1;
+
+    int64_t mTimeToLiveUs = 0;
+    // when the pending post expires, 0 if never. Set when posted.
+    int64_t mExpiresUs = 0;
+    std::shared_ptr<AMessage> mExpiryNotify;
+
+    bool mAsynchronous = false;
+
+    // identifies the payload type of an ATypedMessage, nullptr for a plain
+    // key/value message
+    const void* mPayloadType = nullptr;
+
+    // postRepeating() state. mRepeatPeriodUs is 0 for a one-shot message;
+    // mRepeatDueUs is the scheduled time of the current tick.
+    int64_t mRepeatPeriodUs = 0;
+    int64_t mRepeatDueUs = 0;
+    RepeatMode mRepeatMode = kRepeatFixedRate;
+    CatchUpPolicy mRepeatCatchUp = kCatchUpSkip;
+    // written on the looper thread, read by repeatOverruns() on any
+    std::atomic<uint64_t> mRepeatOverruns{0};
+    std::atomic<bool> mRepeatCancelled{false};
+
+    // computes the next tick of a repeating message and posts it again
+    void postNextRepeat();
+
+    struct Item {
+        union {
+            int32_t int32Value;
+            int64_t int64Value;
+            size_t sizeValue;
+            float floatValue;
+            double doubleValue;
+            void* ptrValue;
+            std::pmr::string* stringValue;
+            Rect rectValue;
+        } u;
+        const char* mName;
+        size_t      mNameLength;
+        Type mType;
+        void setName(const char* name, size_t len, std::pmr::memory_resource* resource);
+        Item() : mName(nullptr), mNameLength(0), mType(kTypeInt32) { }
+        Item(const char* name, size_t length, std::pmr::memory_resource* resource);
+    };
+
+    enum {
+        kMaxNumItems = 256
+    };
+    // where mItems, item names and string values are allocated
+    std::pmr::memory_resource* mResource;
+    std::pmr::vector<Item> mItems;
+
+    /**
+        * Allocates an item with the given key |name|. If the key already exists, the corresponding
+        * item value is freed. Otherwise a new item is added.
+        *
+        * This method currently asserts if the number of elements would exceed the max number of
+        * elements allowed (kMaxNumItems). This is a security precaution to avoid arbitrarily large
+        * AMessage structures.
+        *
+        * @todo(b/192153245) Either revisit this security precaution, or change the behavior to
+        *      silently ignore keys added after the max number of elements are reached.
+        *
+        * @note All previously returned Item* pointers are deemed invalid after this call. (E.g. from
+        *       allocateItem or findItem)
+        *
+        * @param name the key for the requested item.
+        *
+        * @return Item* a pointer to the item.
+        */
+    Item* allocateItem(const char* name);
+
+    std::pmr::string* newString(const char* s, size_t len);
+
+    /** Frees the value for the item. */
+    void freeItemValue(Item* item);
+
+    /** Finds an item with given key |name| and |type|. Returns nullptr if item is not found. */
+    const Item* findItem(const char* name, Type type) const;
+
+    size_t findItemIndex(const char* name, size_t len) const;
+
+    std::shared_ptr<AReplyToken> mToken = nullptr;
+
+    void setReplyToken(const std::shared_ptr<AReplyToken>& token);
+
+    // posts the message with a new reply token whose reply goes to |onReply|
+    // instead of awaitResponse()
+    status_t postRequest(AReplyToken::ReplyCallback onReply);
+
+    // posts the message with a new reply token, returning the token and the
+    // looper it was posted to if the pointers are not null
+    status_t postWithReplyToken(
+        AReplyToken::ReplyCallback onReply,
+        std::shared_ptr<ALooper>* looper, std::shared_ptr<AReplyToken>* token);
+
+    // |self| is the looper's reference to this message, passed in to spare a
+    // shared_from_this() per delivery
+    void deliver(const std::shared_ptr<AMessage>& self);
+
+    // sets mExpiresUs for a post due |dueUs| from now
+    void stampExpiry(int64_t dueUs) {
+        mExpiresUs = mTimeToLiveUs > 0 ? ALooper::GetNowUs() + (dueUs > 0 ? dueUs : 0) + mTimeToLiveUs : 0;
+    }
+
+    bool expired(int64_t nowUs) const {
+        return mExpiresUs != 0 && nowUs > mExpiresUs;
+    }
+
+    // called by the looper instead of deliver() once the message expired
+    void expire();
+
+    // completes a pending reply token with |err|, for a message that will
+    // not be delivered
+    void failReply(status_t err);
+
+    DISALLOW_EVIL_CONSTRUCTORS(AMessage);
+};
+}
+
+
@@ -0,0 +1,109 @@
+#pragma once
+#include <stddef.h>
+
+#include <memory_resource>
+
+#include "AMessage.h"
+
+namespace android {
+
+    // A monotonic arena for a burst of messages, e.g. the requests of one
+    // batch and the responses to them. A message made by obtain(), its items
+    // and its shared_ptr control block are carved out of a few large blocks.
+    // Freeing them is a no-op; the blocks go back to the heap together once
+    // the arena and every message obtained from it are gone, whichever thread
+    // drops the last one.
+    //
+    //     std::shared_ptr<AMessageArena> arena = std::make_shared<AMessageArena>();
+    //     for (const std::string& path : paths) {
+    //         std::shared_ptr<AMessage> msg = arena->obtain(kWhatOpen, handler);
+    //         msg->setString("path", path);
+    //         msg->post();
+    //     }
+    //
+    // Nothing is reclaimed before then, so use one arena per batch rather
+    // than one that lives as long as the process. Can be used from any thread.
+    struct AMessageArena : public std::enable_shared_from_this<AMessageArena> {
+        enum {
+            kDefaultInitialSize = 4096,
+        };
+
+        // |initialSize| is the size of the first block; later ones grow
+        explicit AMessageArena(size_t initialSize = kDefaultInitialSize)
+            : mResource(initialSize) {}
+
+        // a message allocated in this arena that keeps it alive
+        std::shared_ptr<AMessage> obtain(uint32_t what, const std::shared_ptr<AHandler>& handler) {
+            return std::allocate_shared<AMessage>(
+                Allocator<AMessage>(shared_from_this()), what, handler, &mResource);
+        }
+
+        // For other objects that share the arena's lifetime. Only valid while
+        // a reference to the arena is held.
+        std::pmr::memory_resource* resource() {
+            return &mResource;
+        }
+
+    private:
+        // monotonic_buffer_resource is not thread safe, and the items of a
+        // message may be set on another thread than the one that obtained it
+        struct LockedResource : public std::pmr::memory_resource {
+            explicit LockedResource(size_t initialSize) : mArena(initialSize) {}
+
+        protected:
+            virtual void* do_allocate(size_t bytes, size_t alignment) {
+                MutexAutoLock autoLock(mLock);
+                return mArena.allocate(bytes, alignment);
+            }
+
+            virtual void do_deallocate(void* /* p */, size_t /* bytes */, size_t /* alignment */) {
+                // released with the arena
+            }
+
+            virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+                return this == &other;
+            }
+
+        private:
+            Mutex mLock;
+            std::pmr::monotonic_buffer_resource mArena;
+        };
+
+        // for allocate_shared(): the copy kept in the control block holds a
+        // reference to the arena until the block itself is freed
+        template <typename T>
+        struct Allocator {
+            typedef T value_type;
+
+            explicit Allocator(const std::shared_ptr<AMessageArena>& arena) : mArena(arena) {}
+
+            template <typename U>
+            Allocator(const Allocator<U>& other) : mArena(other.mArena) {}
+
+            T* allocate(size_t n) {
+                return static_cast<T*>(mArena->mResource.allocate(n * sizeof(T), alignof(T)));
+            }
+
+            void deallocate(T* p, size_t n) {
+                mArena->mResource.deallocate(p, n * sizeof(T), alignof(T));
+            }
+
+            template <typename U>
+            bool operator==(const Allocator<U>& other) const {
+                return mArena == other.mArena;
+            }
+
+            template <typename U>
+            bool operator!=(const Allocator<U>& other) const {
+                return mArena != other.mArena;
+            }
+
+            std::shared_ptr<AMessageArena> mArena;
+        };
+
+        LockedResource mResource;
+
+        DISALLOW_EVIL_CONSTRUCTORS(AMessageArena);
+    };
+
+}  // namespace android
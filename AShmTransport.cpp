@@ -0,0 +1,824 @@
+#include "AShmTransport.h"
+#include "Logger.h"
+#include "Thread.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <new>
+
+namespace android {
+
+#ifdef __linux__
+
+namespace {
+
+enum {
+    kSegmentMagic = 0x414d5348,  // "AMSH"
+    kMinRingSize = 4096,
+    // records start at multiples of this
+    kRecordAlign = 8,
+    // a record length that sends the reader back to the start of the ring
+    kWrapMarker = 0xffffffff,
+    // how often a blocked reader or writer checks that its peer is still there
+    kPeerCheckIntervalMs = 100,
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+    "atomics shared between processes must be lock free");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be 32 bits");
+
+// Indices count bytes since the segment was created and never wrap; a
+// record's offset in the ring is its index modulo the ring size.
+struct RingHeader {
+    alignas(64) std::atomic<uint64_t> mHead;    // advanced by the writer
+    alignas(64) std::atomic<uint64_t> mTail;    // advanced by the reader
+    // futex words, bumped before a wakeup. A side only makes the syscall if
+    // the other has set its waiting flag.
+    alignas(64) std::atomic<uint32_t> mDataSeq;
+    std::atomic<uint32_t> mReaderWaiting;
+    std::atomic<uint32_t> mSpaceSeq;
+    std::atomic<uint32_t> mWriterWaiting;
+};
+
+struct SegmentHeader {
+    std::atomic<uint32_t> mMagic;   // set once the rest is initialized
+    uint32_t mRingSize;
+    std::atomic<int32_t> mServerPid;  // 0 once the server stopped
+    std::atomic<int32_t> mClientPid;  // 0 if no client is connected
+    RingHeader mRequests;
+    RingHeader mReplies;
+};
+
+// followed by the flattened message, if any
+struct RecordHeader {
+    uint32_t mLength;           // header included, or kWrapMarker
+    int32_t mPortOrStatus;      // requests: target port; replies: status
+    uint64_t mRequestID;        // 0 if the sender does not wait for a reply
+    int64_t mDelayUs;           // requests only
+};
+
+size_t alignRecord(size_t length) {
+    return (length + kRecordAlign - 1) & ~(size_t)(kRecordAlign - 1);
+}
+
+size_t ringDataOffset() {
+    return (sizeof(SegmentHeader) + 63) & ~(size_t)63;
+}
+
+// returns when woken up, when |*word| is no longer |value|, or after
+// |timeoutMs|; callers check their condition again in any case
+void futexWait(std::atomic<uint32_t>* word, uint32_t value, int64_t timeoutMs) {
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000;
+    // not FUTEX_PRIVATE_FLAG: the word is shared with the other process
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+void futexWake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+bool processAlive(int32_t pid) {
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+}  // namespace
+
+// One direction of the segment. There is one writing and one reading process;
+// threads of the writing process must serialize their writes.
+struct AShmRing {
+    AShmRing()
+        : mHeader(nullptr), mData(nullptr), mSize(0),
+        mReaderPid(nullptr), mClosed(nullptr), mReservedHead(0) {}
+
+    RingHeader* mHeader;
+    uint8_t* mData;
+    uint64_t mSize;
+    // for a writer blocked on a full ring to notice that the reader is gone
+    std::atomic<int32_t>* mReaderPid;
+    const std::atomic<bool>* mClosed;
+
+    // Writes a record for |msg|, which may be null. Waits for room while
+    // the reader is alive. The caller serializes writes.
+    status_t write(RecordHeader header, const AMessage* msg) {
+        ssize_t size = 0;
+        if (msg != nullptr) {
+            size = msg->flatten(nullptr, 0);
+            if (size < 0) {
+                return (status_t)size;
+            }
+        }
+        size_t length = sizeof(RecordHeader) + size;
+        if (length > UINT32_MAX) {
+            return NO_MEMORY;
+        }
+
+        uint8_t* record;
+        status_t err = beginWrite(length, &record);
+        if (err != OK) {
+            return err;
+        }
+        header.mLength = (uint32_t)length;
+        memcpy(record, &header, sizeof(header));
+        if (msg != nullptr) {
+            msg->flatten(record + sizeof(header), size);
+        }
+        endWrite(length);
+        return OK;
+    }
+
+    // the next record, or WOULD_BLOCK after waiting a while for one
+    status_t beginRead(const uint8_t** record, size_t* length) {
+        uint64_t tail = mHeader->mTail.load(std::memory_order_relaxed);
+        for (;;) {
+            uint64_t head = mHeader->mHead.load(std::memory_order_acquire);
+            if (head != tail) {
+                uint64_t offset = tail & (mSize - 1);
+                uint32_t recordLength;
+                memcpy(&recordLength, mData + offset, sizeof(recordLength));
+                if (recordLength == kWrapMarker) {
+                    tail += mSize - offset;
+                    mHeader->mTail.store(tail);
+                    continue;
+                }
+                if (recordLength < sizeof(RecordHeader) || alignRecord(recordLength) > head - tail
+                        || recordLength > mSize - offset) {
+                    return BAD_VALUE;
+                }
+                *record = mData + offset;
+                *length = recordLength;
+                return OK;
+            }
+
+            // Dekker style with the writer: it stores mHead, then loads
+            // mReaderWaiting, all sequentially consistent
+            mHeader->mReaderWaiting.store(1);
+            uint32_t seq = mHeader->mDataSeq.load();
+            if (mHeader->mHead.load() != tail || mClosed->load()) {
+                mHeader->mReaderWaiting.store(0);
+                if (mClosed->load()) {
+                    return WOULD_BLOCK;
+                }
+                continue;
+            }
+            futexWait(&mHeader->mDataSeq, seq, kPeerCheckIntervalMs);
+            mHeader->mReaderWaiting.store(0);
+            return WOULD_BLOCK;
+        }
+    }
+
+    void endRead(size_t length) {
+        uint64_t tail = mHeader->mTail.load(std::memory_order_relaxed) + alignRecord(length);
+        mHeader->mTail.store(tail);
+        if (mHeader->mWriterWaiting.load()) {
+            mHeader->mSpaceSeq.fetch_add(1);
+            futexWake(&mHeader->mSpaceSeq);
+        }
+    }
+
+    // the reader's records up to now are dropped
+    void discard() {
+        mHeader->mTail.store(mHeader->mHead.load());
+    }
+
+    // wakes a reader or writer of this process blocked on the ring
+    void wake() {
+        mHeader->mDataSeq.fetch_add(1);
+        futexWake(&mHeader->mDataSeq);
+        mHeader->mSpaceSeq.fetch_add(1);
+        futexWake(&mHeader->mSpaceSeq);
+    }
+
+private:
+    uint64_t mReservedHead;
+
+    // reserves |length| contiguous bytes, skipping the end of the ring if needed
+    status_t beginWrite(size_t length, uint8_t** record) {
+        uint64_t need = alignRecord(length);
+        if (need > mSize / 2) {
+            LOGE("a {} byte message does not fit into a {} byte ring", length, mSize);
+            return NO_MEMORY;
+        }
+
+        uint64_t head = mHeader->mHead.load(std::memory_order_relaxed);
+        uint64_t offset = head & (mSize - 1);
+        uint64_t contiguous = mSize - offset;
+        uint64_t total = contiguous < need ? contiguous + need : need;
+        for (;;) {
+            if (mClosed->load()) {
+                return DEAD_OBJECT;
+            }
+            if (mSize - (head - mHeader->mTail.load(std::memory_order_acquire)) >= total) {
+                break;
+            }
+
+            mHeader->mWriterWaiting.store(1);
+            uint32_t seq = mHeader->mSpaceSeq.load();
+            if (mSize - (head - mHeader->mTail.load()) >= total) {
+                mHeader->mWriterWaiting.store(0);
+                break;
+            }
+            futexWait(&mHeader->mSpaceSeq, seq, kPeerCheckIntervalMs);
+            mHeader->mWriterWaiting.store(0);
+            if (!processAlive(mReaderPid->load())) {
+                return DEAD_OBJECT;
+            }
+        }
+
+        if (contiguous < need) {
+            // published along with the record
+            uint32_t marker = kWrapMarker;
+            memcpy(mData + offset, &marker, sizeof(marker));
+            head += contiguous;
+            offset = 0;
+        }
+        mReservedHead = head;
+        *record = mData + offset;
+        return OK;
+    }
+
+    void endWrite(size_t length) {
+        mHeader->mHead.store(mReservedHead + alignRecord(length));
+        if (mHeader->mReaderWaiting.load()) {
+            mHeader->mDataSeq.fetch_add(1);
+            futexWake(&mHeader->mDataSeq);
+        }
+    }
+};
+
+// the mapping of a segment in this process
+struct AShmSegment {
+    AShmSegment() : mHeader(nullptr), mMapSize(0), mClosed(false) {}
+
+    ~AShmSegment() {
+        if (mHeader != nullptr) {
+            munmap(mHeader, mMapSize);
+        }
+    }
+
+    SegmentHeader* mHeader;
+    size_t mMapSize;
+    AShmRing mRequests;
+    AShmRing mReplies;
+    // set when this process stops using the segment
+    std::atomic<bool> mClosed;
+    // serializes writers of this process on the reply ring
+    Mutex mRepliesLock;
+
+    status_t create(const char* name, size_t ringSize) {
+        size_t size = kMinRingSize;
+        while (size < ringSize) {
+            size *= 2;
+        }
+        if (size > UINT32_MAX / 2) {
+            return BAD_VALUE;
+        }
+
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            // left behind by a server that crashed?
+            AShmSegment stale;
+            if (stale.open(name) == OK && processAlive(stale.mHeader->mServerPid.load())) {
+                LOGE("shared memory segment {} is in use", name);
+                return ALREADY_EXISTS;
+            }
+            shm_unlink(name);
+            fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        }
+        if (fd < 0) {
+            LOGE("could not create shared memory segment {}: {}", name, strerror(errno));
+            return -errno;
+        }
+
+        size_t mapSize = ringDataOffset() + 2 * size;
+        status_t err = OK;
+        if (ftruncate(fd, mapSize) != 0 || map(fd, mapSize) != OK) {
+            err = -errno;
+            LOGE("could not map shared memory segment {}: {}", name, strerror(errno));
+        }
+        ::close(fd);
+        if (err != OK) {
+            shm_unlink(name);
+            return err;
+        }
+
+        mHeader = new (mHeader) SegmentHeader();
+        mHeader->mRingSize = (uint32_t)size;
+        mHeader->mServerPid.store(getpid());
+        mHeader->mMagic.store(kSegmentMagic, std::memory_order_release);
+        initRings();
+        return OK;
+    }
+
+    status_t open(const char* name) {
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0) {
+            return -errno;
+        }
+
+        struct stat st;
+        status_t err = OK;
+        if (fstat(fd, &st) != 0) {
+            err = -errno;
+        }
+        else if ((size_t)st.st_size < ringDataOffset()) {
+            // not initialized yet
+            err = NO_INIT;
+        }
+        else if (map(fd, st.st_size) != OK) {
+            err = -errno;
+        }
+        ::close(fd);
+        if (err != OK) {
+            return err;
+        }
+
+        if (mHeader->mMagic.load(std::memory_order_acquire) != kSegmentMagic
+                || ringDataOffset() + 2 * (size_t)mHeader->mRingSize != mMapSize) {
+            return NO_INIT;
+        }
+        initRings();
+        return OK;
+    }
+
+    // makes blocked readers and writers of this process give up
+    void close() {
+        mClosed = true;
+        mRequests.wake();
+        mReplies.wake();
+    }
+
+    status_t sendReply(uint64_t requestID, status_t err, const std::shared_ptr<AMessage>& reply) {
+        RecordHeader header = {};
+        header.mPortOrStatus = err;
+        header.mRequestID = requestID;
+
+        MutexAutoLock autoLock(mRepliesLock);
+        status_t result = mReplies.write(header, err == OK ? reply.get() : nullptr);
+        if (result != OK && result != DEAD_OBJECT && err == OK) {
+            // e.g. too large: the sender still learns that the call failed
+            header.mPortOrStatus = result;
+            mReplies.write(header, nullptr);
+        }
+        return result;
+    }
+
+private:
+    status_t map(int fd, size_t size) {
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            return -errno;
+        }
+        mHeader = static_cast<SegmentHeader*>(addr);
+        mMapSize = size;
+        return OK;
+    }
+
+    void initRings() {
+        uint8_t* data = reinterpret_cast<uint8_t*>(mHeader) + ringDataOffset();
+
+        mRequests.mHeader = &mHeader->mRequests;
+        mRequests.mData = data;
+        mRequests.mSize = mHeader->mRingSize;
+        mRequests.mReaderPid = &mHeader->mServerPid;
+        mRequests.mClosed = &mClosed;
+
+        mReplies.mHeader = &mHeader->mReplies;
+        mReplies.mData = data + mHeader->mRingSize;
+        mReplies.mSize = mHeader->mRingSize;
+        mReplies.mReaderPid = &mHeader->mClientPid;
+        mReplies.mClosed = &mClosed;
+    }
+
+    DISALLOW_EVIL_CONSTRUCTORS(AShmSegment);
+};
+
+struct AShmServer::Reader : public Thread {
+    explicit Reader(AShmServer* server) : Thread(false), mServer(server) {}
+
+    virtual bool threadLoop() {
+        return mServer->readRequest();
+    }
+
+private:
+    AShmServer* const mServer;
+
+    DISALLOW_EVIL_CONSTRUCTORS(Reader);
+};
+
+struct AShmClient::Reader : public Thread {
+    explicit Reader(AShmClient* client) : Thread(false), mClient(client) {}
+
+    virtual bool threadLoop() {
+        return mClient->readReply();
+    }
+
+private:
+    AShmClient* const mClient;
+
+    DISALLOW_EVIL_CONSTRUCTORS(Reader);
+};
+
+#else  // !__linux__
+
+struct AShmSegment {};
+
+#endif  // __linux__
+
+struct AShmClient::Proxy : public AHandler {
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        // messages posted to a proxy are sent to the server, not delivered
+        LOGE("proxy received message what={}", msg->what());
+    }
+};
+
+AShmServer::AShmServer() {
+}
+
+AShmServer::~AShmServer() {
+    stop();
+}
+
+void AShmServer::exportHandler(uint32_t port, const std::shared_ptr<AHandler>& handler) {
+    MutexAutoLock autoLock(mLock);
+    mExports[port] = handler;
+}
+
+void AShmServer::unexportHandler(uint32_t port) {
+    MutexAutoLock autoLock(mLock);
+    mExports.erase(port);
+}
+
+status_t AShmServer::start(const char* name, size_t ringSize) {
+#ifdef __linux__
+    MutexAutoLock autoLock(mLock);
+    if (mSegment != nullptr) {
+        return INVALID_OPERATION;
+    }
+
+    std::shared_ptr<AShmSegment> segment = std::make_shared<AShmSegment>();
+    status_t err = segment->create(name, ringSize);
+    if (err != OK) {
+        return err;
+    }
+    mSegment = segment;
+    mName = name;
+
+    mReader = std::make_shared<Reader>(this);
+    err = mReader->run("AShmServer");
+    if (err != OK) {
+        shm_unlink(name);
+        mReader.reset();
+        mSegment.reset();
+    }
+    return err;
+#else
+    (void)name;
+    (void)ringSize;
+    return INVALID_OPERATION;
+#endif
+}
+
+status_t AShmServer::stop() {
+#ifdef __linux__
+    std::shared_ptr<AShmSegment> segment;
+    std::shared_ptr<Reader> reader;
+    {
+        MutexAutoLock autoLock(mLock);
+        segment = mSegment;
+        reader = mReader;
+    }
+    if (segment == nullptr) {
+        return INVALID_OPERATION;
+    }
+
+    // tells the client to give up on pending requests
+    segment->mHeader->mServerPid.store(0);
+    segment->close();
+    reader->requestExitAndWait();
+    shm_unlink(mName.c_str());
+
+    MutexAutoLock autoLock(mLock);
+    mReader.reset();
+    // replies still in flight keep the mapping until they are dropped
+    mSegment.reset();
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif
+}
+
+#ifdef __linux__
+
+bool AShmServer::readRequest() {
+    AShmRing& ring = mSegment->mRequests;
+    const uint8_t* record;
+    size_t length;
+    status_t err = ring.beginRead(&record, &length);
+    if (err == WOULD_BLOCK) {
+        return !mSegment->mClosed;
+    }
+    if (err != OK) {
+        LOGE("request ring of {} is corrupt", mName);
+        return false;
+    }
+
+    handleRequest(record, length);
+    ring.endRead(length);
+    return true;
+}
+
+void AShmServer::handleRequest(const uint8_t* record, size_t length) {
+    RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+
+    std::shared_ptr<AMessage> msg = AMessage::unflatten(record + sizeof(header), length - sizeof(header));
+    std::shared_ptr<AHandler> handler;
+    {
+        MutexAutoLock autoLock(mLock);
+        auto it = mExports.find((uint32_t)header.mPortOrStatus);
+        if (it != mExports.end()) {
+            handler = it->second.lock();
+        }
+    }
+
+    status_t err = OK;
+    if (msg == nullptr) {
+        LOGE("malformed message for port {}", (uint32_t)header.mPortOrStatus);
+        err = BAD_VALUE;
+    }
+    else if (handler == nullptr) {
+        LOGW("no handler exported as port {}", (uint32_t)header.mPortOrStatus);
+        err = NAME_NOT_FOUND;
+    }
+    else {
+        msg->setTarget(handler);
+        if (header.mRequestID == 0) {
+            msg->post(header.mDelayUs);
+            return;
+        }
+        std::shared_ptr<AShmSegment> segment = mSegment;
+        uint64_t requestID = header.mRequestID;
+        // runs when the handler replies or drops the reply token
+        err = msg->postRequest(
+            [segment, requestID](status_t err, const std::shared_ptr<AMessage>& reply) {
+                segment->sendReply(requestID, err, reply);
+            });
+    }
+
+    if (err != OK && header.mRequestID != 0) {
+        mSegment->sendReply(header.mRequestID, err, nullptr);
+    }
+}
+
+#endif  // __linux__
+
+AShmClient::AShmClient()
+    : mConnected(false),
+    mNextRequestID(0) {
+}
+
+AShmClient::~AShmClient() {
+    retire();
+    stop();
+}
+
+status_t AShmClient::connect(const char* name) {
+#ifdef __linux__
+    MutexAutoLock autoLock(mWriteLock);
+    if (mSegment != nullptr) {
+        return INVALID_OPERATION;
+    }
+
+    std::shared_ptr<AShmSegment> segment = std::make_shared<AShmSegment>();
+    status_t err = segment->open(name);
+    if (err != OK) {
+        LOGE("could not open shared memory segment {}: {}", name, statusToString(err));
+        return err;
+    }
+
+    int32_t pid = getpid();
+    int32_t current = segment->mHeader->mClientPid.load();
+    do {
+        if (current != 0 && processAlive(current)) {
+            LOGE("shared memory segment {} already has a client", name);
+            return INVALID_OPERATION;
+        }
+    } while (!segment->mHeader->mClientPid.compare_exchange_weak(current, pid));
+
+    if (mName.empty()) {
+        mName = name;
+    }
+    // replies to an earlier client are not ours
+    segment->mReplies.discard();
+    mNextRequestID = (uint64_t)(uint32_t)pid << 32;
+    mSegment = segment;
+    mConnected = true;
+
+    mReader = std::make_shared<Reader>(this);
+    err = mReader->run(mName.empty() ? "AShmClient" : mName.c_str());
+    if (err != OK) {
+        mConnected = false;
+        segment->mHeader->mClientPid.store(0);
+        mReader.reset();
+        mSegment.reset();
+    }
+    return err;
+#else
+    (void)name;
+    return INVALID_OPERATION;
+#endif
+}
+
+status_t AShmClient::stop() {
+#ifdef __linux__
+    // connect() and stop() are not called concurrently; writers only read
+    // mSegment, under mWriteLock
+    std::shared_ptr<AShmSegment> segment = std::atomic_load(&mSegment);
+    if (segment == nullptr) {
+        return INVALID_OPERATION;
+    }
+
+    mConnected = false;
+    // a writer blocked on a full ring gives up and releases mWriteLock
+    segment->close();
+    mReader->requestExitAndWait();
+
+    {
+        MutexAutoLock autoLock(mWriteLock);
+        int32_t pid = getpid();
+        segment->mHeader->mClientPid.compare_exchange_strong(pid, 0);
+        mSegment.reset();
+        mReader.reset();
+    }
+
+    failPending(DEAD_OBJECT);
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif
+}
+
+std::shared_ptr<AHandler> AShmClient::proxy(uint32_t port) {
+    std::shared_ptr<Proxy> proxy = std::make_shared<Proxy>();
+    handler_id id = registerHandler(proxy);
+
+    MutexAutoLock autoLock(mWriteLock);
+    mPorts[id] = port;
+    return proxy;
+}
+
+bool AShmClient::isLooping() {
+    return mConnected;
+}
+
+bool AShmClient::canMigrateHandlers() const {
+    return false;
+}
+
+status_t AShmClient::enqueue(Event&& event, int64_t delayUs) {
+#ifdef __linux__
+    AMessage* msg = event.mMessage.get();
+    if (msg == nullptr) {
+        LOGE("callables cannot be sent to another process");
+        return INVALID_OPERATION;
+    }
+
+    RecordHeader header = {};
+    header.mDelayUs = delayUs > 0 ? delayUs : 0;
+    // the reply is matched by request id; the remote handler gets its own token
+    std::shared_ptr<AReplyToken> token = std::move(msg->mToken);
+    msg->mToken = nullptr;
+
+    MutexAutoLock autoLock(mWriteLock);
+    if (mSegment == nullptr || !mConnected) {
+        return DEAD_OBJECT;
+    }
+    auto it = mPorts.find(msg->mTarget);
+    if (it == mPorts.end()) {
+        return NAME_NOT_FOUND;
+    }
+    header.mPortOrStatus = (int32_t)it->second;
+
+    if (token != nullptr) {
+        header.mRequestID = ++mNextRequestID;
+        MutexAutoLock pendingLock(mPendingLock);
+        mPending[header.mRequestID] = token;
+    }
+
+    status_t err = mSegment->mRequests.write(header, msg);
+    if (err != OK && token != nullptr) {
+        MutexAutoLock pendingLock(mPendingLock);
+        mPending.erase(header.mRequestID);
+    }
+    return err;
+#else
+    (void)event;
+    (void)delayUs;
+    return INVALID_OPERATION;
+#endif
+}
+
+status_t AShmClient::enqueueBatch(std::vector<Event>& batch, int64_t nowUs) {
+    // one record per message; returns the first failure
+    status_t result = OK;
+    for (Event& event : batch) {
+        int64_t delayUs = event.mWhenUs - nowUs;
+        status_t err = enqueue(std::move(event), delayUs);
+        if (result == OK) {
+            result = err;
+        }
+    }
+    return result;
+}
+
+#ifdef __linux__
+
+bool AShmClient::readReply() {
+    AShmRing& ring = mSegment->mReplies;
+    const uint8_t* record;
+    size_t length;
+    status_t err = ring.beginRead(&record, &length);
+    if (err == WOULD_BLOCK) {
+        if (mSegment->mClosed) {
+            return false;
+        }
+        if (processAlive(mSegment->mHeader->mServerPid.load())) {
+            return true;
+        }
+        LOGW("server of {} is gone", mName);
+    }
+    else if (err != OK) {
+        LOGE("reply ring of {} is corrupt", mName);
+    }
+    else {
+        handleReply(record, length);
+        ring.endRead(length);
+        return true;
+    }
+
+    // new posts fail; stop() cleans up
+    mConnected = false;
+    failPending(DEAD_OBJECT);
+    return false;
+}
+
+void AShmClient::handleReply(const uint8_t* record, size_t length) {
+    RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+
+    std::shared_ptr<AReplyToken> token;
+    {
+        MutexAutoLock autoLock(mPendingLock);
+        auto it = mPending.find(header.mRequestID);
+        if (it == mPending.end()) {
+            // e.g. failed by stop() already
+            return;
+        }
+        token = std::move(it->second);
+        mPending.erase(it);
+    }
+
+    status_t err = header.mPortOrStatus;
+    std::shared_ptr<AMessage> reply;
+    if (err == OK) {
+        reply = AMessage::unflatten(record + sizeof(header), length - sizeof(header));
+        if (reply == nullptr) {
+            LOGE("malformed reply to request {}", header.mRequestID);
+            err = BAD_VALUE;
+        }
+    }
+    completeReply(token, err, reply);
+}
+
+#endif  // __linux__
+
+void AShmClient::failPending(status_t err) {
+    std::unordered_map<uint64_t, std::shared_ptr<AReplyToken> > pending;
+    {
+        MutexAutoLock autoLock(mPendingLock);
+        pending.swap(mPending);
+    }
+    for (auto& entry : pending) {
+        completeReply(entry.second, err, nullptr);
+    }
+    // awaitResponse() also gives up once isLooping() is false
+    MutexAutoLock autoLock(mRepliesLock);
+    mRepliesCondition.notify_all();
+}
+
+}  // namespace android
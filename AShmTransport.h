@@ -0,0 +1,138 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+#include "ALooper.h"
+#include "AHandler.h"
+#include "AMessage.h"
+
+// Posts AMessages to handlers in another process on the same host, through a
+// POSIX shared memory segment with two rings: requests from the client and
+// replies from the server. Each record carries a message flattened with
+// AMessage::flatten(), so pointer items and typed payloads cannot be sent.
+// A reader that has drained its ring sleeps on a futex in the segment, and a
+// writer only makes the wake-up syscall if the reader is asleep: while the
+// peer keeps up, sending costs no syscall. Linux only; elsewhere start() and
+// connect() fail with INVALID_OPERATION.
+//
+// In the server process:
+//
+//     std::shared_ptr<AShmServer> server = std::make_shared<AShmServer>();
+//     server->exportHandler(kCodecPort, codec);    // registered on a looper
+//     server->start("/media-codec");
+//
+// In the client process, messages posted to the proxy go to |codec|:
+//
+//     std::shared_ptr<AShmClient> client = std::make_shared<AShmClient>();
+//     client->connect("/media-codec");
+//     std::shared_ptr<AHandler> proxy = client->proxy(kCodecPort);
+//     std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(kWhatConfigure, proxy);
+//     msg->setInt32("width", 1920);
+//     msg->postAndAwaitResponse(&response);
+//
+// The remote handler replies as usual with senderAwaitsResponse() and
+// postReply(); request() works from a coroutine too. If it drops the reply
+// token, or either process exits, the sender gets an error instead.
+
+namespace android {
+
+    struct AShmSegment;
+
+    struct AShmServer {
+        enum {
+            kDefaultRingSize = 1 << 20,
+        };
+
+        AShmServer();
+        ~AShmServer();
+
+        // Messages the client sends to |port| are posted to |handler|, which
+        // must be registered on a looper. Exporting a port again replaces it.
+        void exportHandler(uint32_t port, const std::shared_ptr<AHandler>& handler);
+        void unexportHandler(uint32_t port);
+
+        // Creates the shared memory segment |name| (see shm_open()) with two
+        // rings of |ringSize| bytes, rounded up to a power of two, and starts
+        // the thread that posts incoming messages. A message may take up to
+        // half a ring. One client can be connected at a time.
+        status_t start(const char* name, size_t ringSize = kDefaultRingSize);
+
+        // stops reading requests and unlinks the segment
+        status_t stop();
+
+    private:
+        struct Reader;
+
+        Mutex mLock;
+        std::unordered_map<uint32_t, std::weak_ptr<AHandler> > mExports;
+        std::shared_ptr<AShmSegment> mSegment;
+        std::shared_ptr<Reader> mReader;
+        std::string mName;
+
+        // takes one request off the ring, or waits for one
+        bool readRequest();
+        void handleRequest(const uint8_t* record, size_t length);
+
+        DISALLOW_EVIL_CONSTRUCTORS(AShmServer);
+    };
+
+    // An ALooper whose handlers are stand-ins for handlers exported by an
+    // AShmServer. Nothing runs on it: a message posted to a proxy is written
+    // to the request ring by the posting thread, delay included, and its
+    // reply completes the sender's reply token on the client's reader thread.
+    // Callables cannot be posted to it.
+    struct AShmClient : public ALooper {
+        AShmClient();
+        virtual ~AShmClient();
+
+        // Connects to the segment created by AShmServer::start(). Fails with
+        // INVALID_OPERATION if another live process is connected to it.
+        status_t connect(const char* name);
+
+        // Disconnects. Pending requests complete with DEAD_OBJECT, as they do
+        // when the server process goes away.
+        virtual status_t stop();
+
+        // a handler registered on this looper that forwards to |port|
+        std::shared_ptr<AHandler> proxy(uint32_t port);
+
+        // proxies are bound to the client
+        virtual bool canMigrateHandlers() const;
+
+    protected:
+        virtual status_t enqueue(Event&& event, int64_t delayUs);
+        virtual status_t enqueueBatch(std::vector<Event>& batch, int64_t nowUs);
+
+        virtual bool isLooping();
+
+    private:
+        struct Reader;
+        struct Proxy;
+
+        // guards mSegment, mPorts and the request ring's write side
+        Mutex mWriteLock;
+        std::shared_ptr<AShmSegment> mSegment;
+        std::unordered_map<handler_id, uint32_t> mPorts;
+        std::shared_ptr<Reader> mReader;
+        std::atomic<bool> mConnected;
+
+        // requests awaiting a reply, by request id. The upper half of an id
+        // is the client's pid, so that replies meant for an earlier client of
+        // the segment are never mistaken for ours.
+        Mutex mPendingLock;
+        std::unordered_map<uint64_t, std::shared_ptr<AReplyToken> > mPending;
+        uint64_t mNextRequestID;
+
+        // takes one reply off the ring, or waits for one
+        bool readReply();
+        void handleReply(const uint8_t* record, size_t length);
+        // completes every pending request with |err|
+        void failPending(status_t err);
+
+        DISALLOW_EVIL_CONSTRUCTORS(AShmClient);
+    };
+
+}  // namespace android
@@ -0,0 +1,786 @@
+#include "ASocketTransport.h"
+#include "Logger.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+namespace android {
+
+#ifdef __linux__
+
+namespace {
+
+enum {
+    // a recv() reads up to this much
+    kReceiveSize = 64 * 1024,
+    // senders wait while this much is queued for the socket
+    kMaxBufferedBytes = 1024 * 1024,
+    kMaxFrameSize = 16 * 1024 * 1024,
+};
+
+// followed by the flattened message, if any
+struct FrameHeader {
+    uint32_t mLength;           // header included
+    int32_t mPortOrStatus;      // requests: target port; replies: status
+    uint64_t mRequestID;        // 0 if the sender does not wait for a reply
+    int64_t mDelayUs;           // requests only
+};
+
+status_t toAddress(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        LOGE("socket path {} is too long", path);
+        return BAD_VALUE;
+    }
+    strcpy(addr->sun_path, path);
+    return OK;
+}
+
+}  // namespace
+
+// One end of a connection, serviced by |looper|: incoming frames are read and
+// outgoing ones written on the looper thread, other threads only queue frames.
+struct ASocketConnection : public std::enable_shared_from_this<ASocketConnection> {
+    // called on the looper thread for each frame received
+    typedef std::function<void(
+        const std::shared_ptr<ASocketConnection>& connection, const FrameHeader& header,
+        const uint8_t* data, size_t size)> FrameCallback;
+    // called once, when either end closes the connection
+    typedef std::function<void(status_t err)> ClosedCallback;
+
+    ASocketConnection(
+        int fd, const std::shared_ptr<ALooper>& looper,
+        const FrameCallback& onFrame, const ClosedCallback& onClosed)
+        : mFd(fd), mLooper(looper), mOnFrame(onFrame), mOnClosed(onClosed),
+        mClosed(false), mFlushPending(false), mOutgoingFrames(0),
+        mFramesSent(0), mSendCalls(0), mFramesReceived(0), mReceiveCalls(0),
+        mSendOffset(0), mInputSize(0), mWatchingOutput(false) {}
+
+    ~ASocketConnection() {
+        ::close(mFd);
+    }
+
+    status_t start() {
+        std::shared_ptr<ALooper> looper = mLooper.lock();
+        if (looper == nullptr) {
+            return NO_INIT;
+        }
+        std::shared_ptr<ASocketConnection> self = shared_from_this();
+        return looper->addFd(mFd, ALooper::EVENT_INPUT, [self](int, int events) {
+            return self->onEvents(events);
+        });
+    }
+
+    // Queues a frame for |msg|, which may be null. If |mayWait|, waits while
+    // too much is queued already.
+    status_t send(FrameHeader header, const AMessage* msg, bool mayWait) {
+        ssize_t size = 0;
+        if (msg != nullptr) {
+            size = msg->flatten(nullptr, 0);
+            if (size < 0) {
+                return (status_t)size;
+            }
+        }
+        size_t length = sizeof(FrameHeader) + size;
+        if (length > kMaxFrameSize) {
+            LOGE("a {} byte message is too large to send", length);
+            return NO_MEMORY;
+        }
+        header.mLength = (uint32_t)length;
+
+        bool schedule;
+        {
+            MutexAutoLock autoLock(mLock);
+            while (mayWait && !mClosed && mOutgoing.size() >= kMaxBufferedBytes) {
+                mSpaceCondition.wait(autoLock);
+            }
+            if (mClosed) {
+                return DEAD_OBJECT;
+            }
+            size_t offset = mOutgoing.size();
+            mOutgoing.resize(offset + length);
+            memcpy(&mOutgoing[offset], &header, sizeof(header));
+            if (msg != nullptr) {
+                msg->flatten(&mOutgoing[offset + sizeof(header)], size);
+            }
+            mOutgoingFrames++;
+            // frames queued until the flush runs go out together
+            schedule = !mFlushPending;
+            mFlushPending = true;
+        }
+
+        std::shared_ptr<ALooper> looper = mLooper.lock();
+        if (schedule && looper != nullptr) {
+            std::shared_ptr<ASocketConnection> self = shared_from_this();
+            looper->post([self]() {
+                self->flush();
+            });
+        }
+        return OK;
+    }
+
+    // any thread; fails queued and later sends
+    void close(status_t err) {
+        {
+            MutexAutoLock autoLock(mLock);
+            if (mClosed) {
+                return;
+            }
+            mClosed = true;
+            mSpaceCondition.notify_all();
+        }
+        // the peer sees the end of the stream right away
+        shutdown(mFd, SHUT_RDWR);
+        std::shared_ptr<ALooper> looper = mLooper.lock();
+        if (looper != nullptr) {
+            looper->removeFd(mFd);
+        }
+        mOnClosed(err);
+    }
+
+    void getStats(ASocketStats* stats) const {
+        stats->mFramesSent = mFramesSent;
+        stats->mSendCalls = mSendCalls;
+        stats->mFramesReceived = mFramesReceived;
+        stats->mReceiveCalls = mReceiveCalls;
+    }
+
+private:
+    const int mFd;
+    const std::weak_ptr<ALooper> mLooper;
+    const FrameCallback mOnFrame;
+    const ClosedCallback mOnClosed;
+
+    // guards the send side
+    Mutex mLock;
+    Condition mSpaceCondition;
+    bool mClosed;
+    // a flush() has been posted and has not taken mOutgoing yet
+    bool mFlushPending;
+    std::vector<uint8_t> mOutgoing;
+    uint64_t mOutgoingFrames;
+
+    std::atomic<uint64_t> mFramesSent;
+    std::atomic<uint64_t> mSendCalls;
+    std::atomic<uint64_t> mFramesReceived;
+    std::atomic<uint64_t> mReceiveCalls;
+
+    // only accessed on the looper thread. mSending is being written to the
+    // socket; when that is done, it swaps places with mOutgoing.
+    std::vector<uint8_t> mSending;
+    size_t mSendOffset;
+    std::vector<uint8_t> mInput;
+    size_t mInputSize;
+    bool mWatchingOutput;
+
+    bool onEvents(int events) {
+        if (events & ALooper::EVENT_OUTPUT) {
+            flush();
+        }
+        if (events & (ALooper::EVENT_INPUT | ALooper::EVENT_HANGUP | ALooper::EVENT_ERROR)) {
+            return receive();
+        }
+        return true;
+    }
+
+    // reads whatever has arrived and hands out the complete frames
+    bool receive() {
+        if (mInput.size() - mInputSize < kReceiveSize) {
+            mInput.resize(mInputSize + kReceiveSize);
+        }
+        ssize_t n = recv(mFd, &mInput[mInputSize], mInput.size() - mInputSize, MSG_DONTWAIT);
+        mReceiveCalls++;
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return true;
+        }
+        if (n <= 0) {
+            close(n < 0 ? -errno : DEAD_OBJECT);
+            return false;
+        }
+        mInputSize += n;
+
+        std::shared_ptr<ASocketConnection> self = shared_from_this();
+        size_t offset = 0;
+        while (mInputSize - offset >= sizeof(FrameHeader)) {
+            FrameHeader header;
+            memcpy(&header, &mInput[offset], sizeof(header));
+            if (header.mLength < sizeof(FrameHeader) || header.mLength > kMaxFrameSize) {
+                LOGE("received a malformed frame");
+                close(BAD_VALUE);
+                return false;
+            }
+            if (mInputSize - offset < header.mLength) {
+                break;
+            }
+            mFramesReceived++;
+            mOnFrame(self, header, &mInput[offset + sizeof(header)], header.mLength - sizeof(header));
+            offset += header.mLength;
+        }
+        if (offset > 0) {
+            memmove(&mInput[0], &mInput[offset], mInputSize - offset);
+            mInputSize -= offset;
+        }
+        return true;
+    }
+
+    // writes the frames queued so far, or as much as the socket takes
+    void flush() {
+        for (;;) {
+            bool leftover = mSendOffset < mSending.size();
+            if (!leftover) {
+                MutexAutoLock autoLock(mLock);
+                mSending.clear();
+                mSending.swap(mOutgoing);
+                mSendOffset = 0;
+                mFlushPending = false;
+                mFramesSent += mOutgoingFrames;
+                mOutgoingFrames = 0;
+                mSpaceCondition.notify_all();
+            }
+
+            while (mSendOffset < mSending.size()) {
+                ssize_t n = ::send(mFd, &mSending[mSendOffset], mSending.size() - mSendOffset,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+                mSendCalls++;
+                if (n >= 0) {
+                    mSendOffset += n;
+                }
+                else if (errno == EAGAIN) {
+                    // the rest goes out when the socket has room again
+                    watchOutput(true);
+                    return;
+                }
+                else if (errno != EINTR) {
+                    close(-errno);
+                    return;
+                }
+            }
+            // frames queued while a leftover was sent have no flush() of their own
+            if (!leftover) {
+                break;
+            }
+        }
+        watchOutput(false);
+    }
+
+    void watchOutput(bool watch) {
+        std::shared_ptr<ALooper> looper = mLooper.lock();
+        if (watch == mWatchingOutput || looper == nullptr) {
+            return;
+        }
+        {
+            MutexAutoLock autoLock(mLock);
+            if (mClosed) {
+                return;
+            }
+        }
+        mWatchingOutput = watch;
+        std::shared_ptr<ASocketConnection> self = shared_from_this();
+        looper->addFd(mFd, ALooper::EVENT_INPUT | (watch ? ALooper::EVENT_OUTPUT : 0),
+            [self](int, int events) {
+                return self->onEvents(events);
+            });
+    }
+
+    DISALLOW_EVIL_CONSTRUCTORS(ASocketConnection);
+};
+
+#else  // !__linux__
+
+struct ASocketConnection {};
+
+#endif  // __linux__
+
+struct ASocketClient::Proxy : public AHandler {
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        // messages posted to a proxy are sent to the server, not delivered
+        LOGE("proxy received message what={}", msg->what());
+    }
+};
+
+ASocketServer::ASocketServer()
+    : mListenFd(-1),
+    mNextClientID(0) {
+}
+
+ASocketServer::~ASocketServer() {
+    stop();
+}
+
+void ASocketServer::exportHandler(uint32_t port, const std::shared_ptr<AHandler>& handler) {
+    MutexAutoLock autoLock(mLock);
+    mExports[port] = handler;
+}
+
+void ASocketServer::unexportHandler(uint32_t port) {
+    MutexAutoLock autoLock(mLock);
+    mExports.erase(port);
+}
+
+status_t ASocketServer::start(const char* path) {
+#ifdef __linux__
+    MutexAutoLock autoLock(mLock);
+    if (mLooper != nullptr) {
+        return INVALID_OPERATION;
+    }
+
+    struct sockaddr_un addr;
+    status_t err = toAddress(path, &addr);
+    if (err != OK) {
+        return err;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    int result = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (result != 0 && errno == EADDRINUSE) {
+        // left behind by a server that exited?
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool inUse = probe >= 0 && ::connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) {
+            ::close(probe);
+        }
+        if (inUse) {
+            LOGE("socket {} is in use", path);
+            ::close(fd);
+            return ALREADY_EXISTS;
+        }
+        unlink(path);
+        result = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    }
+    if (result != 0 || listen(fd, SOMAXCONN) != 0) {
+        err = -errno;
+        LOGE("could not listen on socket {}: {}", path, strerror(errno));
+        ::close(fd);
+        return err;
+    }
+
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+    looper->setName("ASocketServer");
+    looper->setBackend(ALooper::kBackendEpoll);
+    err = looper->start();
+    if (err == OK) {
+        err = looper->addFd(fd, ALooper::EVENT_INPUT, [this](int, int) {
+            acceptClient();
+            return true;
+        });
+    }
+    if (err != OK) {
+        looper->stop();
+        ::close(fd);
+        unlink(path);
+        return err;
+    }
+    mLooper = looper;
+    mListenFd = fd;
+    mPath = path;
+    return OK;
+#else
+    (void)path;
+    return INVALID_OPERATION;
+#endif
+}
+
+status_t ASocketServer::stop() {
+#ifdef __linux__
+    std::shared_ptr<ALooper> looper;
+    std::unordered_map<uint64_t, Client> clients;
+    {
+        MutexAutoLock autoLock(mLock);
+        looper.swap(mLooper);
+    }
+    if (looper == nullptr) {
+        return INVALID_OPERATION;
+    }
+
+    // no more clients come and go
+    looper->stop();
+    {
+        MutexAutoLock autoLock(mLock);
+        clients.swap(mClients);
+    }
+    for (auto& entry : clients) {
+        entry.second.mConnection->close(DEAD_OBJECT);
+        entry.second.mLooper->stop();
+    }
+
+    ::close(mListenFd);
+    mListenFd = -1;
+    unlink(mPath.c_str());
+    return OK;
+#else
+    return INVALID_OPERATION;
+#endif
+}
+
+void ASocketServer::getSocketStats(ASocketStats* stats) {
+    *stats = ASocketStats();
+#ifdef __linux__
+    MutexAutoLock autoLock(mLock);
+    for (auto& entry : mClients) {
+        ASocketStats client;
+        entry.second.mConnection->getStats(&client);
+        stats->mFramesSent += client.mFramesSent;
+        stats->mSendCalls += client.mSendCalls;
+        stats->mFramesReceived += client.mFramesReceived;
+        stats->mReceiveCalls += client.mReceiveCalls;
+    }
+#endif
+}
+
+#ifdef __linux__
+
+void ASocketServer::acceptClient() {
+    int fd = accept4(mListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            LOGW("could not accept a client on {}: {}", mPath, strerror(errno));
+        }
+        return;
+    }
+
+    Client client;
+    client.mLooper = std::make_shared<ALooper>();
+    client.mLooper->setName("ASocketServer");
+    client.mLooper->setBackend(ALooper::kBackendEpoll);
+
+    uint64_t clientID;
+    {
+        MutexAutoLock autoLock(mLock);
+        clientID = ++mNextClientID;
+    }
+    // runs on this looper, which is stopped before the server goes away
+    std::shared_ptr<ALooper> looper = mLooper;
+    client.mConnection = std::make_shared<ASocketConnection>(fd, client.mLooper,
+        [this](const std::shared_ptr<ASocketConnection>& connection, const FrameHeader& header,
+                const uint8_t* data, size_t size) {
+            handleRequest(connection, (uint32_t)header.mPortOrStatus, header.mRequestID,
+                header.mDelayUs, data, size);
+        },
+        [this, looper, clientID](status_t) {
+            looper->post([this, clientID]() {
+                removeClient(clientID);
+            });
+        });
+
+    {
+        MutexAutoLock autoLock(mLock);
+        mClients[clientID] = client;
+    }
+    status_t err = client.mLooper->start();
+    if (err == OK) {
+        err = client.mConnection->start();
+    }
+    if (err != OK) {
+        LOGE("could not service a client on {}: {}", mPath, statusToString(err));
+        removeClient(clientID);
+    }
+}
+
+void ASocketServer::removeClient(uint64_t clientID) {
+    Client client;
+    {
+        MutexAutoLock autoLock(mLock);
+        auto it = mClients.find(clientID);
+        if (it == mClients.end()) {
+            return;
+        }
+        client = it->second;
+        mClients.erase(it);
+    }
+    client.mConnection->close(DEAD_OBJECT);
+    client.mLooper->stop();
+}
+
+void ASocketServer::handleRequest(
+        const std::shared_ptr<ASocketConnection>& connection, uint32_t port,
+        uint64_t requestID, int64_t delayUs, const uint8_t* data, size_t size) {
+    std::shared_ptr<AMessage> msg = AMessage::unflatten(data, size);
+    std::shared_ptr<AHandler> handler;
+    {
+        MutexAutoLock autoLock(mLock);
+        auto it = mExports.find(port);
+        if (it != mExports.end()) {
+            handler = it->second.lock();
+        }
+    }
+
+    status_t err = OK;
+    if (msg == nullptr) {
+        LOGE("malformed message for port {}", port);
+        err = BAD_VALUE;
+    }
+    else if (handler == nullptr) {
+        LOGW("no handler exported as port {}", port);
+        err = NAME_NOT_FOUND;
+    }
+    else {
+        msg->setTarget(handler);
+        if (requestID == 0) {
+            msg->post(delayUs);
+            return;
+        }
+        // runs when the handler replies or drops the reply token
+        err = msg->postRequest(
+            [connection, requestID](status_t err, const std::shared_ptr<AMessage>& reply) {
+                FrameHeader header = {};
+                header.mPortOrStatus = err;
+                header.mRequestID = requestID;
+                status_t result = connection->send(header, err == OK ? reply.get() : nullptr, true);
+                if (result != OK && result != DEAD_OBJECT && err == OK) {
+                    // e.g. too large: the sender still learns that the call failed
+                    header.mPortOrStatus = result;
+                    connection->send(header, nullptr, true);
+                }
+            });
+    }
+
+    if (err != OK && requestID != 0) {
+        FrameHeader header = {};
+        header.mPortOrStatus = err;
+        header.mRequestID = requestID;
+        // the looper thread must not wait for itself to flush
+        connection->send(header, nullptr, false);
+    }
+}
+
+#endif  // __linux__
+
+ASocketClient::ASocketClient()
+    : mNextRequestID(0) {
+}
+
+ASocketClient::~ASocketClient() {
+    retire();
+    stop();
+}
+
+status_t ASocketClient::connect(const char* path) {
+#ifdef __linux__
+    MutexAutoLock autoLock(mConnectionLock);
+    if (mConnection != nullptr) {
+        return INVALID_OPERATION;
+    }
+    status_t err = setBackend(kBackendEpoll);
+    if (err != OK) {
+        // e.g. the looper was started already
+        return err;
+    }
+
+    struct sockaddr_un addr;
+    err = toAddress(path, &addr);
+    if (err != OK) {
+        return err;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        err = -errno;
+        LOGE("could not connect to socket {}: {}", path, strerror(errno));
+        ::close(fd);
+        return err;
+    }
+
+    // the callbacks run on this looper or in stop()
+    std::shared_ptr<ASocketConnection> connection = std::make_shared<ASocketConnection>(
+        fd, shared_from_this(),
+        [this](const std::shared_ptr<ASocketConnection>&, const FrameHeader& header,
+                const uint8_t* data, size_t size) {
+            handleReply(header.mRequestID, header.mPortOrStatus, data, size);
+        },
+        [this](status_t) {
+            failPending(DEAD_OBJECT);
+        });
+
+    err = start();
+    if (err == OK) {
+        err = connection->start();
+        if (err != OK) {
+            ALooper::stop();
+        }
+    }
+    if (err != OK) {
+        return err;
+    }
+    mConnection = connection;
+    return OK;
+#else
+    (void)path;
+    return INVALID_OPERATION;
+#endif
+}
+
+status_t ASocketClient::stop() {
+    std::shared_ptr<ASocketConnection> connection;
+    {
+        MutexAutoLock autoLock(mConnectionLock);
+        connection.swap(mConnection);
+    }
+#ifdef __linux__
+    if (connection != nullptr) {
+        connection->close(DEAD_OBJECT);
+    }
+#endif
+    status_t err = ALooper::stop();
+    failPending(DEAD_OBJECT);
+    return connection != nullptr ? OK : err;
+}
+
+std::shared_ptr<AHandler> ASocketClient::proxy(uint32_t port) {
+    std::shared_ptr<Proxy> proxy = std::make_shared<Proxy>();
+    handler_id id = registerHandler(proxy);
+
+    MutexAutoLock autoLock(mConnectionLock);
+    mPorts[id] = port;
+    return proxy;
+}
+
+void ASocketClient::getSocketStats(ASocketStats* stats) {
+    *stats = ASocketStats();
+#ifdef __linux__
+    MutexAutoLock autoLock(mConnectionLock);
+    if (mConnection != nullptr) {
+        mConnection->getStats(stats);
+    }
+#endif
+}
+
+bool ASocketClient::canMigrateHandlers() const {
+    return false;
+}
+
+status_t ASocketClient::enqueue(Event&& event, int64_t delayUs) {
+    status_t err;
+    if (sendEvent(event, delayUs, &err)) {
+        return err;
+    }
+    return ALooper::enqueue(std::move(event), delayUs);
+}
+
+status_t ASocketClient::enqueueBatch(std::vector<Event>& batch, int64_t nowUs) {
+    // events for other handlers are queued here as usual
+    std::vector<Event> local;
+    status_t result = OK;
+    for (Event& event : batch) {
+        status_t err;
+        if (!sendEvent(event, event.mWhenUs - nowUs, &err)) {
+            local.push_back(std::move(event));
+        }
+        else if (result == OK) {
+            result = err;
+        }
+    }
+    if (!local.empty()) {
+        status_t err = ALooper::enqueueBatch(local, nowUs);
+        if (result == OK) {
+            result = err;
+        }
+    }
+    return result;
+}
+
+bool ASocketClient::sendEvent(Event& event, int64_t delayUs, status_t* err) {
+    handler_id target = event.target();
+    if (target == 0) {
+        return false;
+    }
+
+    std::shared_ptr<ASocketConnection> connection;
+    uint32_t port;
+    {
+        MutexAutoLock autoLock(mConnectionLock);
+        auto it = mPorts.find(target);
+        if (it == mPorts.end()) {
+            return false;
+        }
+        port = it->second;
+        connection = mConnection;
+    }
+
+#ifdef __linux__
+    AMessage* msg = event.mMessage.get();
+    if (msg == nullptr) {
+        LOGE("callables cannot be sent to another process");
+        *err = INVALID_OPERATION;
+        return true;
+    }
+    if (connection == nullptr) {
+        *err = DEAD_OBJECT;
+        return true;
+    }
+
+    FrameHeader header = {};
+    header.mPortOrStatus = (int32_t)port;
+    header.mDelayUs = delayUs > 0 ? delayUs : 0;
+    // the reply is matched by request id; the remote handler gets its own token
+    std::shared_ptr<AReplyToken> token = std::move(msg->mToken);
+    msg->mToken = nullptr;
+    if (token != nullptr) {
+        MutexAutoLock autoLock(mPendingLock);
+        header.mRequestID = ++mNextRequestID;
+        mPending[header.mRequestID] = token;
+    }
+
+    // this looper's thread must not wait for itself to flush
+    *err = connection->send(header, msg, sCurrentLooper != this);
+    if (*err != OK && token != nullptr) {
+        MutexAutoLock autoLock(mPendingLock);
+        mPending.erase(header.mRequestID);
+    }
+#else
+    (void)delayUs;
+    (void)port;
+    *err = INVALID_OPERATION;
+#endif
+    return true;
+}
+
+void ASocketClient::handleReply(uint64_t requestID, status_t err, const uint8_t* data, size_t size) {
+    std::shared_ptr<AReplyToken> token;
+    {
+        MutexAutoLock autoLock(mPendingLock);
+        auto it = mPending.find(requestID);
+        if (it == mPending.end()) {
+            // e.g. failed by stop() already
+            return;
+        }
+        token = std::move(it->second);
+        mPending.erase(it);
+    }
+
+    std::shared_ptr<AMessage> reply;
+    if (err == OK) {
+        reply = AMessage::unflatten(data, size);
+        if (reply == nullptr) {
+            LOGE("malformed reply to request {}", requestID);
+            err = BAD_VALUE;
+        }
+    }
+    completeReply(token, err, reply);
+}
+
+void ASocketClient::failPending(status_t err) {
+    std::unordered_map<uint64_t, std::shared_ptr<AReplyToken> > pending;
+    {
+        MutexAutoLock autoLock(mPendingLock);
+        pending.swap(mPending);
+    }
+    for (auto& entry : pending) {
+        completeReply(entry.second, err, nullptr);
+    }
+}
+
+}  // namespace android
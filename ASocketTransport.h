@@ -0,0 +1,152 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+#include "ALooper.h"
+#include "AHandler.h"
+#include "AMessage.h"
+
+// Posts AMessages to handlers in another process over an AF_UNIX stream
+// socket, for when the processes cannot share memory (see AShmTransport.h
+// otherwise). Messages are flattened with AMessage::flatten(), so pointer
+// items and typed payloads cannot be sent.
+//
+// Each end of a connection is serviced by a looper with the epoll backend.
+// Frames posted while the looper is busy are appended to one buffer and go
+// out in a single send(), and one recv() picks up every frame that has
+// arrived, so under load many messages share a syscall. Replies are matched
+// to requests by id, so any number of requests can be in flight. Linux only;
+// elsewhere start() and connect() fail with INVALID_OPERATION.
+//
+// In the server process:
+//
+//     std::shared_ptr<ASocketServer> server = std::make_shared<ASocketServer>();
+//     server->exportHandler(kCodecPort, codec);    // registered on a looper
+//     server->start("/run/media-codec.sock");
+//
+// In the client process, messages posted to the proxy go to |codec|:
+//
+//     std::shared_ptr<ASocketClient> client = std::make_shared<ASocketClient>();
+//     client->connect("/run/media-codec.sock");
+//     std::shared_ptr<AHandler> proxy = client->proxy(kCodecPort);
+//     std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(kWhatConfigure, proxy);
+//     msg->setInt32("width", 1920);
+//     msg->postAndAwaitResponse(&response);
+//
+// As with AShmTransport, the remote handler replies with postReply(), and a
+// dropped reply token or a lost connection completes the request with an
+// error.
+
+namespace android {
+
+    struct ASocketConnection;
+
+    // frames and syscalls of one connection, to see how well they are batched
+    struct ASocketStats {
+        uint64_t mFramesSent;
+        uint64_t mSendCalls;
+        uint64_t mFramesReceived;
+        uint64_t mReceiveCalls;
+    };
+
+    struct ASocketServer {
+        ASocketServer();
+        ~ASocketServer();
+
+        // Messages clients send to |port| are posted to |handler|, which
+        // must be registered on a looper. Exporting a port again replaces it.
+        void exportHandler(uint32_t port, const std::shared_ptr<AHandler>& handler);
+        void unexportHandler(uint32_t port);
+
+        // Listens on the socket file |path|, replacing one left behind by a
+        // server that exited. Each client that connects gets a looper of its
+        // own, which reads its requests and writes back the replies.
+        status_t start(const char* path);
+
+        // closes every connection and removes the socket file
+        status_t stop();
+
+        // sums the counters of the open connections
+        void getSocketStats(ASocketStats* stats);
+
+    private:
+        struct Client {
+            std::shared_ptr<ALooper> mLooper;
+            std::shared_ptr<ASocketConnection> mConnection;
+        };
+
+        Mutex mLock;
+        std::unordered_map<uint32_t, std::weak_ptr<AHandler> > mExports;
+        // accepts connections
+        std::shared_ptr<ALooper> mLooper;
+        int mListenFd;
+        std::string mPath;
+        std::unordered_map<uint64_t, Client> mClients;
+        uint64_t mNextClientID;
+
+        void acceptClient();
+        // stops the looper of a client that went away
+        void removeClient(uint64_t clientID);
+        void handleRequest(
+            const std::shared_ptr<ASocketConnection>& connection, uint32_t port,
+            uint64_t requestID, int64_t delayUs, const uint8_t* data, size_t size);
+
+        DISALLOW_EVIL_CONSTRUCTORS(ASocketServer);
+    };
+
+    // An ALooper that services a connection to an ASocketServer. Its
+    // proxies stand in for handlers exported by the server: a message posted
+    // to one is queued for the socket, delay included, and its reply
+    // completes the sender's reply token on this looper's thread. Callables
+    // cannot be posted to a proxy; other handlers registered on the looper
+    // work as usual.
+    struct ASocketClient : public ALooper {
+        ASocketClient();
+        virtual ~ASocketClient();
+
+        // Connects to the socket file |path| of an ASocketServer and starts
+        // the looper.
+        status_t connect(const char* path);
+
+        // Disconnects and stops the looper. Pending requests complete with
+        // DEAD_OBJECT, as they do when the server closes the connection.
+        virtual status_t stop();
+
+        // a handler registered on this looper that forwards to |port|
+        std::shared_ptr<AHandler> proxy(uint32_t port);
+
+        void getSocketStats(ASocketStats* stats);
+
+        // proxies are bound to the client
+        virtual bool canMigrateHandlers() const;
+
+    protected:
+        virtual status_t enqueue(Event&& event, int64_t delayUs);
+        virtual status_t enqueueBatch(std::vector<Event>& batch, int64_t nowUs);
+
+    private:
+        struct Proxy;
+
+        // guards mConnection and mPorts
+        Mutex mConnectionLock;
+        std::shared_ptr<ASocketConnection> mConnection;
+        std::unordered_map<handler_id, uint32_t> mPorts;
+
+        // requests awaiting a reply, by request id
+        Mutex mPendingLock;
+        std::unordered_map<uint64_t, std::shared_ptr<AReplyToken> > mPending;
+        uint64_t mNextRequestID;
+
+        // sends |event| if it is for a proxy; returns false otherwise
+        bool sendEvent(Event& event, int64_t delayUs, status_t* err);
+        void handleReply(uint64_t requestID, status_t err, const uint8_t* data, size_t size);
+        // completes every pending request with |err|
+        void failPending(status_t err);
+
+        DISALLOW_EVIL_CONSTRUCTORS(ASocketClient);
+    };
+
+}  // namespace android
@@ -0,0 +1,278 @@
+#include "ATrace.h"
+#include "Logger.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#include <processthreadsapi.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace android {
+
+struct ATrace::Buffer {
+    Buffer() : mTid(0), mHead(0), mFloor(0), mInUse(true) {}
+
+    int64_t mTid;
+    std::string mThreadName;
+
+    // index of the next record to write. Only the owning thread writes it.
+    std::atomic<uint64_t> mHead;
+    // records before this index were dropped by clear()
+    std::atomic<uint64_t> mFloor;
+    std::atomic<bool> mInUse;
+
+    Record mRecords[kRecordsPerThread];
+};
+
+struct ATrace::BufferHolder {
+    BufferHolder() : mBuffer(nullptr) {}
+
+    ~BufferHolder() {
+        if (mBuffer != nullptr) {
+            mBuffer->mInUse.store(false, std::memory_order_release);
+        }
+    }
+
+    Buffer* mBuffer;
+};
+
+// static
+std::atomic<bool> ATrace::sEnabled(false);
+// static
+thread_local ATrace::BufferHolder ATrace::sBuffer;
+// static
+std::mutex ATrace::sBuffersLock;
+// static
+std::vector<ATrace::Buffer*> ATrace::sBuffers;
+
+static int64_t currentTid() {
+#ifdef _WIN32
+    return GetCurrentThreadId();
+#elif defined(__linux__)
+    return syscall(SYS_gettid);
+#else
+    return (int64_t)(uintptr_t)pthread_self();
+#endif
+}
+
+static std::string currentThreadName() {
+#if defined(__linux__)
+    char name[16];
+    if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) {
+        return name;
+    }
+#endif
+    return std::string();
+}
+
+// |str| as the contents of a JSON string: a thread may be given any name
+static std::string jsonEscape(const std::string& str) {
+    std::string out;
+    out.reserve(str.size());
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)(unsigned char)c);
+            out += escaped;
+        }
+        else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// static
+void ATrace::setEnabled(bool enabled) {
+    sEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+// static
+ATrace::Buffer* ATrace::currentBuffer() {
+    Buffer* buffer = sBuffer.mBuffer;
+    if (buffer != nullptr) {
+        return buffer;
+    }
+
+    MutexAutoLock autoLock(sBuffersLock);
+    for (Buffer* candidate : sBuffers) {
+        bool inUse = false;
+        if (candidate->mInUse.compare_exchange_strong(inUse, true)) {
+            // the previous owner's records would be attributed to this thread
+            candidate->mFloor.store(candidate->mHead.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            buffer = candidate;
+            break;
+        }
+    }
+    if (buffer == nullptr) {
+        buffer = new Buffer;
+        sBuffers.push_back(buffer);
+    }
+    buffer->mTid = currentTid();
+    buffer->mThreadName = currentThreadName();
+
+    sBuffer.mBuffer = buffer;
+    return buffer;
+}
+
+// static
+void ATrace::record(Event event, const void* msg, uint32_t what, int32_t handlerID) {
+    Buffer* buffer = currentBuffer();
+
+    uint64_t head = buffer->mHead.load(std::memory_order_relaxed);
+    Record& record = buffer->mRecords[head % kRecordsPerThread];
+    record.mTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    record.mMessage = (uint64_t)(uintptr_t)msg;
+    record.mWhat = what;
+    record.mHandlerID = handlerID;
+    record.mEvent = event;
+
+    buffer->mHead.store(head + 1, std::memory_order_release);
+}
+
+// static
+void ATrace::clear() {
+    MutexAutoLock autoLock(sBuffersLock);
+    for (Buffer* buffer : sBuffers) {
+        buffer->mFloor.store(buffer->mHead.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
+
+// static
+status_t ATrace::dumpChromeTrace(int fd) {
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+
+    std::string out = "{\"traceEvents\":[\n";
+    bool first = true;
+    char line[256];
+    auto append = [&out, &first](const char* event) {
+        if (!first) {
+            out += ",\n";
+        }
+        out += event;
+        first = false;
+    };
+
+    MutexAutoLock autoLock(sBuffersLock);
+    std::vector<Record> records;
+    for (Buffer* buffer : sBuffers) {
+        uint64_t head = buffer->mHead.load(std::memory_order_acquire);
+        uint64_t start = buffer->mFloor.load(std::memory_order_relaxed);
+        if (head - start > kRecordsPerThread) {
+            start = head - kRecordsPerThread;
+        }
+
+        records.clear();
+        for (uint64_t i = start; i < head; i++) {
+            records.push_back(buffer->mRecords[i % kRecordsPerThread]);
+        }
+
+        // the owner kept writing while we copied; drop what it overwrote
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t newHead = buffer->mHead.load(std::memory_order_relaxed);
+        size_t skip = 0;
+        if (newHead - start > kRecordsPerThread) {
+            skip = (size_t)std::min<uint64_t>(newHead - start - kRecordsPerThread, records.size());
+        }
+
+        snprintf(line, sizeof(line),
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%" PRId64 ",\"args\":{\"name\":\"%s\"}}",
+            pid, buffer->mTid, jsonEscape(buffer->mThreadName).c_str());
+        append(line);
+
+        for (size_t i = skip; i < records.size(); i++) {
+            const Record& record = records[i];
+            double tsUs = record.mTimeNs / 1000.0;
+            switch (record.mEvent) {
+                case kEventPost:
+                case kEventEnqueue:
+                case kEventDequeue:
+                case kEventReply:
+                {
+                    static const char* const kNames[] = { "post", "enqueue", "dequeue", "", "", "reply" };
+                    snprintf(line, sizeof(line),
+                        "{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                        "\"pid\":%d,\"tid\":%" PRId64 ",\"args\":{\"msg\":\"0x%" PRIx64 "\",\"what\":%u,\"handler\":%d}}",
+                        jsonEscape(kNames[record.mEvent]).c_str(), tsUs, pid, buffer->mTid,
+                        record.mMessage, record.mWhat, record.mHandlerID);
+                    append(line);
+                    if (record.mEvent == kEventPost) {
+                        // flow arrow from the post to the delivery
+                        snprintf(line, sizeof(line),
+                            "{\"name\":\"message\",\"cat\":\"message\",\"ph\":\"s\",\"id\":\"0x%" PRIx64 "\","
+                            "\"ts\":%.3f,\"pid\":%d,\"tid\":%" PRId64 "}",
+                            record.mMessage, tsUs, pid, buffer->mTid);
+                        append(line);
+                    }
+                    break;
+                }
+
+                case kEventDeliverBegin:
+                    snprintf(line, sizeof(line),
+                        "{\"name\":\"deliver what=%u\",\"cat\":\"message\",\"ph\":\"B\",\"ts\":%.3f,"
+                        "\"pid\":%d,\"tid\":%" PRId64 ",\"args\":{\"msg\":\"0x%" PRIx64 "\",\"handler\":%d}}",
+                        record.mWhat, tsUs, pid, buffer->mTid, record.mMessage, record.mHandlerID);
+                    append(line);
+                    snprintf(line, sizeof(line),
+                        "{\"name\":\"message\",\"cat\":\"message\",\"ph\":\"f\",\"bp\":\"e\",\"id\":\"0x%" PRIx64 "\","
+                        "\"ts\":%.3f,\"pid\":%d,\"tid\":%" PRId64 "}",
+                        record.mMessage, tsUs, pid, buffer->mTid);
+                    append(line);
+                    break;
+
+                case kEventDeliverEnd:
+                    snprintf(line, sizeof(line),
+                        "{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%" PRId64 "}",
+                        tsUs, pid, buffer->mTid);
+                    append(line);
+                    break;
+            }
+        }
+    }
+    autoLock.unlock();
+
+    out += "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+    const char* data = out.data();
+    size_t remaining = out.size();
+    while (remaining > 0) {
+#ifdef _WIN32
+        int written = _write(fd, data, (unsigned int)remaining);
+#else
+        ssize_t written = ::write(fd, data, remaining);
+#endif
+        if (written < 0) {
+            LOGE("failed to write trace: {}", strerror(errno));
+            return -errno;
+        }
+        data += written;
+        remaining -= written;
+    }
+    return OK;
+}
+
+}  // namespace android
@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+
+#include "Base.h"
+#include "Errors.h"
+
+// Message flow tracing. Each thread appends fixed-size binary records to its
+// own ring buffer, so recording takes no lock and shares no cache line with
+// other threads. The buffers are turned into a Chrome trace (JSON, also opened
+// by ui.perfetto.dev) on demand.
+//
+// Tracing is compiled in only when HANDLER_TRACE is defined; otherwise the
+// ATRACE_ macros expand to nothing. When compiled in, it still has to be
+// switched on with ATrace::setEnabled().
+
+namespace android {
+
+    struct ATrace {
+        enum Event : uint8_t {
+            // AMessage::post() was called
+            kEventPost,
+            // the message was queued on its looper
+            kEventEnqueue,
+            // the looper took the message off its queue
+            kEventDequeue,
+            // the handler's onMessageReceived() is entered and left
+            kEventDeliverBegin,
+            kEventDeliverEnd,
+            // a reply was posted for the message
+            kEventReply,
+        };
+
+        struct Record {
+            // CLOCK_MONOTONIC
+            int64_t mTimeNs;
+            // address of the AMessage, identifies it across threads
+            uint64_t mMessage;
+            uint32_t mWhat;
+            int32_t mHandlerID;
+            Event mEvent;
+        };
+
+        enum {
+            // records kept per thread; older ones are overwritten
+            kRecordsPerThread = 16384,
+        };
+
+        static void setEnabled(bool enabled);
+
+        static bool isEnabled() {
+            return sEnabled.load(std::memory_order_relaxed);
+        }
+
+        static void record(Event event, const void* msg, uint32_t what, int32_t handlerID);
+
+        // Writes every thread's records as Chrome trace JSON to |fd|. Can be
+        // called while other threads are tracing; records overwritten during
+        // the dump are left out.
+        static status_t dumpChromeTrace(int fd);
+
+        // drops all recorded events
+        static void clear();
+
+    private:
+        struct Buffer;
+        struct BufferHolder;
+
+        static std::atomic<bool> sEnabled;
+        static thread_local BufferHolder sBuffer;
+
+        // buffers of all threads that have recorded anything. The buffer of an
+        // exited thread keeps its records until a new thread takes it over.
+        static std::mutex sBuffersLock;
+        static std::vector<Buffer*> sBuffers;
+
+        static Buffer* currentBuffer();
+    };
+
+}  // namespace android
+
+#ifdef HANDLER_TRACE
+#define ATRACE_MESSAGE(event, msg, what, handlerID)                                 \
+    do {                                                                            \
+        if (android::ATrace::isEnabled()) {                                         \
+            android::ATrace::record(android::ATrace::event, msg, what, handlerID);  \
+        }                                                                           \
+    } while (0)
+#else
+#define ATRACE_MESSAGE(event, msg, what, handlerID) do {} while (0)
+#endif // HANDLER_TRACE
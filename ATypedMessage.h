@@ -0,0 +1,85 @@
+#pragma once
+#include <utility>
+
+#include "AMessage.h"
+
+namespace android {
+
+    // An AMessage that carries a fixed-schema payload |T| inline, for hot
+    // message types where the key/value items cost a name lookup, a type
+    // check and possibly an allocation per field. The payload lives in the
+    // same allocation as the message and is accessed as a plain struct.
+    //
+    // T must declare its what value:
+    //
+    //     struct SetVolume {
+    //         static constexpr uint32_t kWhat = 100;
+    //         float mVolume;
+    //     };
+    //
+    // It is posted and delivered like any other AMessage, so handlers keep
+    // switching on msg->what() in onMessageReceived():
+    //
+    //     auto msg = std::make_shared<ATypedMessage<SetVolume>>(handler, 0.5f);
+    //     msg->post();
+    //     ...
+    //     case SetVolume::kWhat:
+    //         setVolume(ATypedMessage<SetVolume>::payloadOf(msg).mVolume);
+    //
+    // Key/value items can still be set on a typed message as well.
+    template <typename T>
+    struct ATypedMessage : public AMessage {
+        static constexpr uint32_t kWhat = T::kWhat;
+
+        // constructs the payload in place from |args|
+        template <typename... Args>
+        explicit ATypedMessage(const std::shared_ptr<AHandler>& handler, Args&&... args)
+            : AMessage(kWhat, handler),
+            mPayload{std::forward<Args>(args)...} {
+            mPayloadType = &sPayloadType;
+        }
+
+        T& payload() {
+            return mPayload;
+        }
+
+        const T& payload() const {
+            return mPayload;
+        }
+
+        // The payload of |msg|, which must be an ATypedMessage<T>; dispatching
+        // on what() == T::kWhat is what guarantees that. Only debug builds
+        // check it.
+        static T& payloadOf(const std::shared_ptr<AMessage>& msg) {
+#ifndef NDEBUG
+            if (msg->mPayloadType != &sPayloadType) {
+                LOGE("message what={} does not carry the requested payload", msg->what());
+                abort();
+            }
+#endif
+            return static_cast<ATypedMessage*>(msg.get())->mPayload;
+        }
+
+        // Like payloadOf(), but returns nullptr instead of aborting if |msg|
+        // does not carry a T. Costs one pointer compare.
+        static T* findPayload(const std::shared_ptr<AMessage>& msg) {
+            if (msg == nullptr || msg->mPayloadType != &sPayloadType) {
+                return nullptr;
+            }
+            return &static_cast<ATypedMessage*>(msg.get())->mPayload;
+        }
+
+        virtual std::shared_ptr<AMessage> dup() const {
+            std::shared_ptr<ATypedMessage> msg = std::make_shared<ATypedMessage>(nullptr, mPayload);
+            dupInto(msg.get());
+            return msg;
+        }
+
+    private:
+        // only its address is used, to tell payload types apart
+        static inline const char sPayloadType = 0;
+
+        T mPayload;
+    };
+
+}  // namespace android
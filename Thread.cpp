@@ -1,211 +1,378 @@
-#include "Thread.h"
-#include "Logger.h"
-
-#ifdef _WIN32
-#include <processthreadsapi.h>
-#else
-#include <pthread.h>
-#endif
-
-namespace android{
-
-thread_id_t getThreadId(bool valid)
-{
-    if (valid)
-    {
-#ifdef _WIN32
-        return GetCurrentThreadId();
-#else
-        return pthread_self();
-#endif // _WIN32
-    }
-    else
-    {
-        return -1;
-    }
-}
-Thread::Thread(bool canCallJava)
-    : mCanCallJava(canCallJava),
-    mThread(getThreadId(false)),
-    mLock(),
-    mStatus(OK),
-    mExitPending(false),
-    mRunning(false)
-{
-}
-
-Thread::~Thread()
-{
-}
-
-status_t Thread::readyToRun()
-{
-    return OK;
-}
-
-status_t Thread::run(const char* name, int32_t priority, size_t stack)
-{
-    //LOG_ALWAYS_FATAL_IF(name == nullptr, "thread name not provided to Thread::run");
-    if (name == nullptr) {
-        LOGE("thread name not provided to Thread::run");
-    }
-
-    MutexAutoLock _l(mLock);
-
-    if (mRunning) {
-        // thread already started
-        return INVALID_OPERATION;
-    }
-
-    // reset status and exitPending to their default value, so we can
-    // try again after an error happened (either below, or in readyToRun())
-    mStatus = OK;
-    mExitPending = false;
-    mThread = getThreadId(false);
-
-    // hold a strong reference on ourself
-    mHoldSelf = shared_from_this();
-
-    mRunning = true;
-
-    std::thread* thread = new std::thread(&Thread::_threadLoop, this);
-    bool res = thread != nullptr;
-    if (res == false) {
-        mStatus = UNKNOWN_ERROR;   // something happened!
-        mRunning = false;
-        mThread = getThreadId(false);
-        mHoldSelf.reset();  // "this" may have gone away after this.
-
-        return UNKNOWN_ERROR;
-    }
-
-    // Do not refer to mStatus here: The thread is already running (may, in fact
-    // already have exited with a valid mStatus result). The OK indication
-    // here merely indicates successfully starting the thread and does not
-    // imply successful termination/execution.
-    return OK;
-
-    // Exiting scope of mLock is a memory barrier and allows new thread to run
-}
-
-int Thread::_threadLoop(void* user)
-{
-    Thread* const self = static_cast<Thread*>(user);
-
-    std::shared_ptr<Thread> strong(self->mHoldSelf);
-    std::weak_ptr<Thread> weak(strong);
-    self->mHoldSelf.reset();
-
-    bool first = true;
-
-    do {
-        bool result;
-        if (first) {
-            first = false;
-            self->mStatus = self->readyToRun();
-            result = (self->mStatus == OK);
-
-            if (result && !self->exitPending()) {
-                // Binder threads (and maybe others) rely on threadLoop
-                // running at least once after a successful ::readyToRun()
-                // (unless, of course, the thread has already been asked to exit
-                // at that point).
-                // This is because threads are essentially used like this:
-                //   (new ThreadSubclass())->run();
-                // The caller therefore does not retain a strong reference to
-                // the thread and the thread would simply disappear after the
-                // successful ::readyToRun() call instead of entering the
-                // threadLoop at least once.
-                result = self->threadLoop();
-            }
-        }
-        else {
-            result = self->threadLoop();
-        }
-
-        // establish a scope for mLock
-        {
-            MutexAutoLock _l(self->mLock);
-            if (result == false || self->mExitPending) {
-                self->mExitPending = true;
-                self->mRunning = false;
-                // clear thread ID so that requestExitAndWait() does not exit if
-                // called by a new thread using the same thread ID as this one.
-                self->mThread = getThreadId(false);
-                // note that interested observers blocked in requestExitAndWait are
-                // awoken by broadcast, but blocked on mLock until break exits scope
-                self->mThreadExitedCondition.notify_all();
-                break;
-            }
-        }
-
-        // Release our strong reference, to let a chance to the thread
-        // to die a peaceful death.
-        strong.reset();
-        // And immediately, re-acquire a strong reference for the next loop
-        strong = weak.lock();
-    } while (strong != nullptr);
-
-    return 0;
-}
-
-void Thread::requestExit()
-{
-    MutexAutoLock _l(mLock);
-    mExitPending = true;
-}
-
-status_t Thread::requestExitAndWait()
-{
-    MutexAutoLock _l(mLock);
-    if (mThread == getThreadId()) {
-        //ALOGW(
-        //    "Thread (this=%p): don't call waitForExit() from this "
-        //    "Thread object's thread. It's a guaranteed deadlock!",
-        //    this);
-        LOGE("Thread (this={}): don't call waitForExit() from this "
-            "Thread object's thread. It's a guaranteed deadlock!",
-            fmt::ptr(this));
-        return WOULD_BLOCK;
-    }
-
-    mExitPending = true;
-
-    while (mRunning == true) {
-        mThreadExitedCondition.wait(_l);
-    }
-    // This next line is probably not needed any more, but is being left for
-    // historical reference. Note that each interested party will clear flag.
-    mExitPending = false;
-
-    return mStatus;
-}
-
-status_t Thread::join()
-{
-    MutexAutoLock _l(mLock);
-    if (mThread == getThreadId()) {
-        LOGW("Thread (this={}): don't call join() from this Thread object's thread. It's a guaranteed deadlock!",
-            fmt::ptr(this));
-        return WOULD_BLOCK;
-    }
-
-    while (mRunning == true) {
-        mThreadExitedCondition.wait(_l);
-    }
-
-    return mStatus;
-}
-
-bool Thread::isRunning() const {
-    MutexAutoLock _l(mLock);
-    return mRunning;
-}
-
-bool Thread::exitPending() const
-{
-    MutexAutoLock _l(mLock);
-    return mExitPending;
-}
-
+#include "Thread.h"
+#include "Logger.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <processthreadsapi.h>
+#include <thread>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace android{
+
+thread_id_t getThreadId(bool valid)
+{
+    if (valid)
+    {
+#ifdef _WIN32
+        return GetCurrentThreadId();
+#else
+        return pthread_self();
+#endif // _WIN32
+    }
+    else
+    {
+        return -1;
+    }
+}
+Thread::Thread(bool canCallJava)
+    : mCanCallJava(canCallJava),
+    mThread(getThreadId(false)),
+    mLock(),
+    mStatus(OK),
+    mExitPending(false),
+    mRunning(false),
+#ifndef _WIN32
+    mJoinable(false),
+#endif
+    mPriority(PRIORITY_DEFAULT),
+    mSchedPolicy(kSchedNormal),
+    mRtPriority(0),
+    mCpuAffinity(0)
+{
+}
+
+Thread::~Thread()
+{
+    // the last reference may be dropped by the thread itself on its way out,
+    // it cannot join itself
+#ifdef _WIN32
+    if (mNativeThread.joinable()) {
+        if (mNativeThread.get_id() == std::this_thread::get_id()) {
+            mNativeThread.detach();
+        }
+        else {
+            mNativeThread.join();
+        }
+    }
+#else
+    if (mJoinable) {
+        if (pthread_equal(mNativeThread, pthread_self())) {
+            pthread_detach(mNativeThread);
+        }
+        else {
+            pthread_join(mNativeThread, nullptr);
+        }
+    }
+#endif
+}
+
+status_t Thread::readyToRun()
+{
+    return OK;
+}
+
+void Thread::setSchedPolicy(SchedPolicy policy, int32_t rtPriority)
+{
+    MutexAutoLock _l(mLock);
+    mSchedPolicy = policy;
+    mRtPriority = rtPriority;
+}
+
+void Thread::setCpuAffinity(uint64_t cpuMask)
+{
+    MutexAutoLock _l(mLock);
+    mCpuAffinity = cpuMask;
+}
+
+status_t Thread::run(const char* name, int32_t priority, size_t stack)
+{
+    //LOG_ALWAYS_FATAL_IF(name == nullptr, "thread name not provided to Thread::run");
+    if (name == nullptr) {
+        LOGE("thread name not provided to Thread::run");
+    }
+
+    MutexAutoLock _l(mLock);
+
+    if (mRunning) {
+        // thread already started
+        return INVALID_OPERATION;
+    }
+    // the previous thread has left _threadLoop() but may not have exited yet
+    joinThread_l(_l);
+
+    // reset status and exitPending to their default value, so we can
+    // try again after an error happened (either below, or in readyToRun())
+    mStatus = OK;
+    mExitPending = false;
+    mThread = getThreadId(false);
+    mName = name != nullptr ? name : "";
+    mPriority = priority;
+
+    // hold a strong reference on ourself
+    mHoldSelf = shared_from_this();
+
+    mRunning = true;
+
+    // The thread keeps this object alive through mHoldSelf until it has left
+    // _threadLoop(), and is joined by whoever waits for it or by the destructor.
+#ifdef _WIN32
+    (void)stack;
+    bool res = true;
+    try {
+        mNativeThread = std::thread(&Thread::_threadEntry, this);
+    }
+    catch (const std::system_error& e) {
+        LOGE("failed to create thread {}: {}", mName, e.what());
+        res = false;
+    }
+#else
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (stack > 0) {
+        pthread_attr_setstacksize(&attr, stack);
+    }
+    int result = pthread_create(&mNativeThread, &attr, &Thread::_threadEntry, this);
+    pthread_attr_destroy(&attr);
+    bool res = result == 0;
+    mJoinable = res;
+    if (res == false) {
+        LOGE("failed to create thread {}: {}", mName, strerror(result));
+    }
+#endif
+    if (res == false) {
+        mStatus = UNKNOWN_ERROR;   // something happened!
+        mRunning = false;
+        mThread = getThreadId(false);
+        mHoldSelf.reset();  // "this" may have gone away after this.
+
+        return UNKNOWN_ERROR;
+    }
+
+    // Do not refer to mStatus here: The thread is already running (may, in fact
+    // already have exited with a valid mStatus result). The OK indication
+    // here merely indicates successfully starting the thread and does not
+    // imply successful termination/execution.
+    return OK;
+
+    // Exiting scope of mLock is a memory barrier and allows new thread to run
+}
+
+void* Thread::_threadEntry(void* user)
+{
+    Thread* const self = static_cast<Thread*>(user);
+
+    {
+        MutexAutoLock _l(self->mLock);
+        self->mThread = getThreadId();
+        self->applyThreadAttributes();
+    }
+
+    _threadLoop(user);
+    return nullptr;
+}
+
+void Thread::joinThread_l(MutexAutoLock& _l)
+{
+    // taken out under mLock so that only one caller joins it
+#ifdef _WIN32
+    std::thread thread(std::move(mNativeThread));
+    if (!thread.joinable()) {
+        return;
+    }
+    _l.unlock();
+    thread.join();
+#else
+    if (!mJoinable) {
+        return;
+    }
+    pthread_t thread = mNativeThread;
+    mJoinable = false;
+    _l.unlock();
+    pthread_join(thread, nullptr);
+#endif
+    _l.lock();
+}
+
+// called on the new thread with mLock held
+void Thread::applyThreadAttributes()
+{
+#ifndef _WIN32
+    if (!mName.empty()) {
+        // the kernel limits thread names to 15 characters
+        std::string name = mName.substr(0, 15);
+#ifdef __APPLE__
+        pthread_setname_np(name.c_str());
+#else
+        pthread_setname_np(pthread_self(), name.c_str());
+#endif
+    }
+
+    if (mSchedPolicy != kSchedNormal) {
+        struct sched_param param;
+        param.sched_priority = mRtPriority;
+        int policy = mSchedPolicy == kSchedFifo ? SCHED_FIFO : SCHED_RR;
+        int err = pthread_setschedparam(pthread_self(), policy, &param);
+        if (err != 0) {
+            LOGW("failed to set real-time policy {} priority {} on thread {}: {}",
+                (int)mSchedPolicy, mRtPriority, mName, strerror(err));
+        }
+    }
+    else if (mPriority != PRIORITY_DEFAULT) {
+#ifdef __linux__
+        // on Linux the nice value is per thread
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), mPriority) != 0) {
+            LOGW("failed to set priority {} on thread {}: {}", mPriority, mName, strerror(errno));
+        }
+#endif
+    }
+
+#ifdef __linux__
+    if (mCpuAffinity != 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if (mCpuAffinity & (1ULL << cpu)) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err != 0) {
+            LOGW("failed to set cpu affinity {:#x} on thread {}: {}", mCpuAffinity, mName, strerror(err));
+        }
+    }
+#endif
+#endif // !_WIN32
+}
+
+int Thread::_threadLoop(void* user)
+{
+    Thread* const self = static_cast<Thread*>(user);
+
+    std::shared_ptr<Thread> strong(self->mHoldSelf);
+    std::weak_ptr<Thread> weak(strong);
+    self->mHoldSelf.reset();
+
+    bool first = true;
+
+    do {
+        bool result;
+        if (first) {
+            first = false;
+            self->mStatus = self->readyToRun();
+            result = (self->mStatus == OK);
+
+            if (result && !self->exitPending()) {
+                // Binder threads (and maybe others) rely on threadLoop
+                // running at least once after a successful ::readyToRun()
+                // (unless, of course, the thread has already been asked to exit
+                // at that point).
+                // This is because threads are essentially used like this:
+                //   (new ThreadSubclass())->run();
+                // The caller therefore does not retain a strong reference to
+                // the thread and the thread would simply disappear after the
+                // successful ::readyToRun() call instead of entering the
+                // threadLoop at least once.
+                result = self->threadLoop();
+            }
+        }
+        else {
+            result = self->threadLoop();
+        }
+
+        // establish a scope for mLock
+        {
+            MutexAutoLock _l(self->mLock);
+            if (result == false || self->mExitPending) {
+                self->mExitPending = true;
+                self->mRunning = false;
+                // clear thread ID so that requestExitAndWait() does not exit if
+                // called by a new thread using the same thread ID as this one.
+                self->mThread = getThreadId(false);
+                // note that interested observers blocked in requestExitAndWait are
+                // awoken by broadcast, but blocked on mLock until break exits scope
+                self->mThreadExitedCondition.notify_all();
+                break;
+            }
+        }
+
+        // Release our strong reference, to let a chance to the thread
+        // to die a peaceful death.
+        strong.reset();
+        // And immediately, re-acquire a strong reference for the next loop
+        strong = weak.lock();
+    } while (strong != nullptr);
+
+    return 0;
+}
+
+void Thread::requestExit()
+{
+    MutexAutoLock _l(mLock);
+    mExitPending = true;
+}
+
+status_t Thread::requestExitAndWait()
+{
+    MutexAutoLock _l(mLock);
+    if (mThread == getThreadId()) {
+        //ALOGW(
+        //    "Thread (this=%p): don't call waitForExit() from this "
+        //    "Thread object's thread. It's a guaranteed deadlock!",
+        //    this);
+        LOGE("Thread (this={}): don't call waitForExit() from this "
+            "Thread object's thread. It's a guaranteed deadlock!",
+            fmt::ptr(this));
+        return WOULD_BLOCK;
+    }
+
+    mExitPending = true;
+
+    while (mRunning == true) {
+        mThreadExitedCondition.wait(_l);
+    }
+    joinThread_l(_l);
+    // This next line is probably not needed any more, but is being left for
+    // historical reference. Note that each interested party will clear flag.
+    mExitPending = false;
+
+    return mStatus;
+}
+
+status_t Thread::join()
+{
+    MutexAutoLock _l(mLock);
+    if (mThread == getThreadId()) {
+        LOGW("Thread (this={}): don't call join() from this Thread object's thread. It's a guaranteed deadlock!",
+            fmt::ptr(this));
+        return WOULD_BLOCK;
+    }
+
+    while (mRunning == true) {
+        mThreadExitedCondition.wait(_l);
+    }
+    joinThread_l(_l);
+
+    return mStatus;
+}
+
+bool Thread::isRunning() const {
+    MutexAutoLock _l(mLock);
+    return mRunning;
+}
+
+bool Thread::exitPending() const
+{
+    MutexAutoLock _l(mLock);
+    return mExitPending;
+}
+
 };  // namespace android
\ No newline at end of file
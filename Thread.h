@@ -1,69 +1,132 @@
-#pragma once
-#include "Base.h"
-
-namespace android {
-    thread_id_t getThreadId(bool valid = true);
-    class Thread : public std::enable_shared_from_this<Thread>
-    {
-    public:
-        // Create a Thread object, but doesn't create or start the associated
-        // thread. See the run() method.
-        explicit            Thread(bool canCallJava = true);
-        virtual             ~Thread();
-
-        // Start the thread in threadLoop() which needs to be implemented.
-        // NOLINTNEXTLINE(google-default-arguments)
-        virtual status_t    run(const char* name,
-            int32_t priority = PRIORITY_DEFAULT,
-            size_t stack = 0);
-
-        // Ask this object's thread to exit. This function is asynchronous, when the
-        // function returns the thread might still be running. Of course, this
-        // function can be called from a different thread.
-        virtual void        requestExit();
-
-        // Good place to do one-time initializations
-        virtual status_t    readyToRun();
-
-        // Call requestExit() and wait until this object's thread exits.
-        // BE VERY CAREFUL of deadlocks. In particular, it would be silly to call
-        // this function from this object's thread. Will return WOULD_BLOCK in
-        // that case.
-        status_t    requestExitAndWait();
-
-        // Wait until this object's thread exits. Returns immediately if not yet running.
-        // Do not call from this object's thread; will return WOULD_BLOCK in that case.
-        status_t    join();
-
-        // Indicates whether this thread is running or not.
-        bool        isRunning() const;
-
-    protected:
-        // exitPending() returns true if requestExit() has been called.
-        bool        exitPending() const;
-
-    private:
-        // Derived class must implement threadLoop(). The thread starts its life
-        // here. There are two ways of using the Thread object:
-        // 1) loop: if threadLoop() returns true, it will be called again if
-        //          requestExit() wasn't called.
-        // 2) once: if threadLoop() returns false, the thread will exit upon return.
-        virtual bool        threadLoop() = 0;
-
-    private:
-        Thread& operator=(const Thread&) = delete;
-        static  int             _threadLoop(void* user);
-        const   bool            mCanCallJava;
-        // always hold mLock when reading or writing
-        thread_id_t     mThread;
-        mutable Mutex           mLock;
-        Condition       mThreadExitedCondition;
-        status_t        mStatus;
-        // note that all accesses of mExitPending and mRunning need to hold mLock
-        volatile bool           mExitPending;
-        volatile bool           mRunning;
-        std::shared_ptr<Thread>      mHoldSelf;
-    };
-
-
-}
+#pragma once
+#include "Base.h"
+
+#ifdef _WIN32
+#include <thread>
+#else
+#include <pthread.h>
+#endif
+
+namespace android {
+    thread_id_t getThreadId(bool valid = true);
+
+    // nice values accepted as |priority| by Thread::run(), as in Android's ThreadDefs.h
+    enum {
+        PRIORITY_LOWEST         =  19,
+        PRIORITY_BACKGROUND     =  10,
+        PRIORITY_NORMAL         =   0,
+        PRIORITY_FOREGROUND     =  -2,
+        PRIORITY_DISPLAY        =  -4,
+        PRIORITY_URGENT_DISPLAY =  -8,
+        PRIORITY_AUDIO          = -16,
+        PRIORITY_URGENT_AUDIO   = -19,
+        PRIORITY_HIGHEST        = -20,
+    };
+
+    class Thread : public std::enable_shared_from_this<Thread>
+    {
+    public:
+        enum SchedPolicy {
+            kSchedNormal,       // time-sharing, ordered by the nice priority given to run()
+            kSchedFifo,         // SCHED_FIFO
+            kSchedRoundRobin,   // SCHED_RR
+        };
+
+        // Create a Thread object, but doesn't create or start the associated
+        // thread. See the run() method.
+        explicit            Thread(bool canCallJava = true);
+        virtual             ~Thread();
+
+        // Start the thread in threadLoop() which needs to be implemented.
+        // |name| is visible to debuggers and profilers (truncated to 15
+        // characters), |priority| is the thread's nice value and a non-zero
+        // |stack| sets its stack size in bytes.
+        // NOLINTNEXTLINE(google-default-arguments)
+        virtual status_t    run(const char* name,
+            int32_t priority = PRIORITY_DEFAULT,
+            size_t stack = 0);
+
+        // Takes effect in a subsequent call to run(). For kSchedFifo and
+        // kSchedRoundRobin, |rtPriority| is the real-time priority (1..99) and
+        // run()'s nice priority is ignored. Switching to a real-time policy
+        // needs CAP_SYS_NICE; if that fails the thread keeps running with the
+        // normal policy.
+        void        setSchedPolicy(SchedPolicy policy, int32_t rtPriority = 0);
+
+        // Takes effect in a subsequent call to run(). Restricts the thread to
+        // the CPUs whose bits are set in |cpuMask| (bit n is CPU n). 0, the
+        // default, leaves the affinity inherited from the creating thread.
+        void        setCpuAffinity(uint64_t cpuMask);
+
+        // Ask this object's thread to exit. This function is asynchronous, when the
+        // function returns the thread might still be running. Of course, this
+        // function can be called from a different thread.
+        virtual void        requestExit();
+
+        // Good place to do one-time initializations
+        virtual status_t    readyToRun();
+
+        // Call requestExit() and wait until this object's thread exits.
+        // BE VERY CAREFUL of deadlocks. In particular, it would be silly to call
+        // this function from this object's thread. Will return WOULD_BLOCK in
+        // that case.
+        status_t    requestExitAndWait();
+
+        // Wait until this object's thread exits and join it. Returns immediately if
+        // not yet running.
+        // Do not call from this object's thread; will return WOULD_BLOCK in that case.
+        status_t    join();
+
+        // Indicates whether this thread is running or not.
+        bool        isRunning() const;
+
+    protected:
+        // exitPending() returns true if requestExit() has been called.
+        bool        exitPending() const;
+
+    private:
+        // Derived class must implement threadLoop(). The thread starts its life
+        // here. There are two ways of using the Thread object:
+        // 1) loop: if threadLoop() returns true, it will be called again if
+        //          requestExit() wasn't called.
+        // 2) once: if threadLoop() returns false, the thread will exit upon return.
+        virtual bool        threadLoop() = 0;
+
+    private:
+        Thread& operator=(const Thread&) = delete;
+        // entry point of the new thread: applies the name, priority, policy and
+        // affinity requested for it, then runs _threadLoop()
+        static  void*           _threadEntry(void* user);
+        static  int             _threadLoop(void* user);
+        void                    applyThreadAttributes();
+        // joins the thread of the last run() once it has left _threadLoop();
+        // drops and retakes |_l|
+        void                    joinThread_l(MutexAutoLock& _l);
+        const   bool            mCanCallJava;
+        // always hold mLock when reading or writing
+        thread_id_t     mThread;
+        mutable Mutex           mLock;
+        Condition       mThreadExitedCondition;
+        status_t        mStatus;
+        // note that all accesses of mExitPending and mRunning need to hold mLock
+        volatile bool           mExitPending;
+        volatile bool           mRunning;
+        std::shared_ptr<Thread>      mHoldSelf;
+        // the thread created by run(), joinable until requestExitAndWait(),
+        // join(), the next run() or the destructor joins it
+#ifdef _WIN32
+        std::thread     mNativeThread;
+#else
+        pthread_t       mNativeThread;
+        bool            mJoinable;
+#endif
+        // attributes applied by the thread itself when it starts
+        std::string     mName;
+        int32_t         mPriority;
+        SchedPolicy     mSchedPolicy;
+        int32_t         mRtPriority;
+        uint64_t        mCpuAffinity;
+    };
+
+
+}
@@ -0,0 +1,288 @@
+// Coroutine benchmark and checker. Needs C++20, see ACoroutine.h.
+//
+//   coroutine_chain   coroutines started by a handler co_await a request to
+//                     a handler on another looper, a delay() and a schedule()
+//                     hop to a third looper. Reports coroutines per second,
+//                     request and delay latencies, and coroutines that resumed
+//                     on the wrong thread or never finished (must be 0).
+//   coroutine_reject  schedule() onto a looper whose queue is full, and
+//                     delay() on a handler whose queue is full, for each
+//                     overflow policy that fails or drops the post. Reports
+//                     what they evaluated to, and whether the coroutine went
+//                     on on its own thread (must be 1).
+//   coroutine_pool    coroutines schedule() onto an ALooperPool and spin;
+//                     reports how many ran at once. Pools run them on one
+//                     strand, so this is 1.
+//
+// Results are key=value lines, like the other benchmarks.
+//
+// usage: coroutine_bench [coroutines] [delayUs]
+
+#include "ACoroutine.h"
+#include "ALooperPool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace android;
+
+namespace {
+
+enum {
+    kWhatEcho = 1,
+    kWhatStart = 2,
+    kWhatFill = 3,
+};
+
+struct EchoHandler : public AHandler {
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        std::shared_ptr<AReplyToken> replyID;
+        if (msg->senderAwaitsResponse(&replyID)) {
+            std::shared_ptr<AMessage> response = std::make_shared<AMessage>();
+            response->postReply(replyID);
+        }
+    }
+};
+
+long long percentile(std::vector<int64_t>& values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return (long long)values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+// runs |count| request / delay / schedule() chains
+struct ChainHandler : public AHandler {
+    ChainHandler() : mDone(0), mWrongThread(0), mFailed(0), mAlive(0) {}
+
+    std::shared_ptr<AHandler> mEcho;
+    std::shared_ptr<ALooper> mHop;
+    int64_t mDelayUs = 0;
+
+    std::atomic<int64_t> mDone;
+    std::atomic<int64_t> mWrongThread;
+    std::atomic<int64_t> mFailed;
+    // frames not yet destroyed
+    std::atomic<int64_t> mAlive;
+    // touched on this handler's looper only
+    std::vector<int64_t> mRequestUs;
+    std::vector<int64_t> mDelayLateUs;
+
+    ATask chain() {
+        struct Alive {
+            explicit Alive(std::atomic<int64_t>* count) : mCount(count) { (*mCount)++; }
+            ~Alive() { (*mCount)--; }
+            std::atomic<int64_t>* mCount;
+        } alive(&mAlive);
+        std::thread::id home = std::this_thread::get_id();
+
+        int64_t startUs = ALooper::GetNowUs();
+        std::shared_ptr<AMessage> response;
+        if (co_await std::make_shared<AMessage>(kWhatEcho, mEcho)->request(&response) != OK) {
+            mFailed++;
+            co_return;
+        }
+        mRequestUs.push_back(ALooper::GetNowUs() - startUs);
+        if (std::this_thread::get_id() != home) {
+            mWrongThread++;
+        }
+
+        startUs = ALooper::GetNowUs();
+        if (co_await delay(mDelayUs) != OK) {
+            mFailed++;
+            co_return;
+        }
+        mDelayLateUs.push_back(ALooper::GetNowUs() - startUs - mDelayUs);
+        if (std::this_thread::get_id() != home) {
+            mWrongThread++;
+        }
+
+        if (co_await mHop->schedule() != OK) {
+            mFailed++;
+            co_return;
+        }
+        if (std::this_thread::get_id() == home) {
+            mWrongThread++;
+        }
+        mDone++;
+    }
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        if (msg->what() == kWhatStart) {
+            chain();
+        }
+    }
+};
+
+void benchChain(int64_t count, int64_t delayUs) {
+    std::shared_ptr<ALooper> home = std::make_shared<ALooper>();
+    std::shared_ptr<ALooper> echoLooper = std::make_shared<ALooper>();
+    std::shared_ptr<ALooper> hop = std::make_shared<ALooper>();
+    home->start();
+    echoLooper->start();
+    hop->start();
+
+    std::shared_ptr<EchoHandler> echo = std::make_shared<EchoHandler>();
+    echoLooper->registerHandler(echo);
+    std::shared_ptr<ChainHandler> handler = std::make_shared<ChainHandler>();
+    handler->mEcho = echo;
+    handler->mHop = hop;
+    handler->mDelayUs = delayUs;
+    home->registerHandler(handler);
+
+    int64_t startUs = ALooper::GetNowUs();
+    for (int64_t i = 0; i < count; i++) {
+        std::make_shared<AMessage>(kWhatStart, handler)->post();
+    }
+    int64_t deadlineUs = startUs + 30000000;
+    while (handler->mDone + handler->mFailed < count && ALooper::GetNowUs() < deadlineUs) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    int64_t elapsedUs = ALooper::GetNowUs() - startUs;
+
+    home->stop();
+    echoLooper->stop();
+    hop->stop();
+
+    printf("bench=coroutine_chain coroutines=%lld delay_us=%lld per_s=%.0f "
+        "request_p50_us=%lld request_p99_us=%lld delay_late_p50_us=%lld delay_late_p99_us=%lld "
+        "wrong_thread=%lld failed=%lld unfinished=%lld alive=%lld\n",
+        (long long)count, (long long)delayUs, count * 1e6 / std::max<int64_t>(1, elapsedUs),
+        percentile(handler->mRequestUs, 0.5), percentile(handler->mRequestUs, 0.99),
+        percentile(handler->mDelayLateUs, 0.5), percentile(handler->mDelayLateUs, 0.99),
+        (long long)handler->mWrongThread.load(), (long long)handler->mFailed.load(),
+        (long long)(count - handler->mDone - handler->mFailed), (long long)handler->mAlive.load());
+}
+
+// co_awaits schedule() onto a full looper, and delay() with its own queue full
+struct RejectHandler : public AHandler {
+    std::shared_ptr<ALooper> mFull;
+    std::atomic<bool> mFinished{false};
+    status_t mScheduleErr = OK;
+    status_t mDelayErr = OK;
+    bool mStayed = false;
+
+    ATask run() {
+        std::thread::id home = std::this_thread::get_id();
+        mScheduleErr = co_await mFull->schedule();
+        bool stayed = std::this_thread::get_id() == home;
+
+        // takes the only slot of this handler's queue
+        std::make_shared<AMessage>(kWhatFill, shared_from_this())->post(1000000);
+        mDelayErr = co_await delay(1000);
+        mStayed = stayed && std::this_thread::get_id() == home;
+        mFinished = true;
+    }
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        if (msg->what() == kWhatStart) {
+            run();
+        }
+    }
+};
+
+void benchReject(ALooper::OverflowPolicy policy, const char* name) {
+    std::shared_ptr<ALooper> full = std::make_shared<ALooper>();
+    full->start();
+    full->setCapacity(1, policy);
+    // keeps the looper busy while a second callable takes the only slot
+    std::atomic<bool> release(false);
+    std::atomic<bool> busy(false);
+    full->post([&release, &busy]() {
+        busy = true;
+        while (!release) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    while (!busy) {
+        std::this_thread::yield();
+    }
+    full->post([]() {});
+
+    std::shared_ptr<ALooper> home = std::make_shared<ALooper>();
+    home->start();
+    std::shared_ptr<RejectHandler> handler = std::make_shared<RejectHandler>();
+    handler->mFull = full;
+    home->registerHandler(handler);
+    home->setHandlerCapacity(handler->id(), 1, policy);
+    std::make_shared<AMessage>(kWhatStart, handler)->post();
+
+    int64_t deadlineUs = ALooper::GetNowUs() + 5000000;
+    while (!handler->mFinished && ALooper::GetNowUs() < deadlineUs) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    release = true;
+
+    printf("bench=coroutine_reject policy=%s finished=%d schedule_err=%d delay_err=%d stayed=%d\n",
+        name, handler->mFinished ? 1 : 0, handler->mScheduleErr, handler->mDelayErr,
+        handler->mStayed ? 1 : 0);
+
+    home->stop();
+    full->stop();
+}
+
+std::atomic<int32_t> gRunning(0);
+std::atomic<int32_t> gMaxRunning(0);
+std::atomic<int64_t> gPoolDone(0);
+
+ATask spinOn(std::shared_ptr<ALooper> looper, int64_t spinUs) {
+    if (co_await looper->schedule() != OK) {
+        gPoolDone++;
+        co_return;
+    }
+    int32_t running = ++gRunning;
+    int32_t max = gMaxRunning;
+    while (running > max && !gMaxRunning.compare_exchange_weak(max, running)) {
+    }
+    int64_t endUs = ALooper::GetNowUs() + spinUs;
+    while (ALooper::GetNowUs() < endUs) {
+    }
+    gRunning--;
+    gPoolDone++;
+}
+
+void benchPool(size_t workers, int64_t count) {
+    std::shared_ptr<ALooperPool> pool = std::make_shared<ALooperPool>();
+    pool->setName("coroutine");
+    pool->start(workers);
+
+    int64_t startUs = ALooper::GetNowUs();
+    for (int64_t i = 0; i < count; i++) {
+        spinOn(pool, 1000);
+    }
+    while (gPoolDone < count) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    int64_t elapsedUs = ALooper::GetNowUs() - startUs;
+
+    printf("bench=coroutine_pool workers=%zu coroutines=%lld max_running=%d elapsed_ms=%lld\n",
+        workers, (long long)count, gMaxRunning.load(), (long long)(elapsedUs / 1000));
+
+    pool->stop();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    // rejected posts are expected
+    spdlog::set_level(spdlog::level::err);
+
+    int64_t coroutines = argc > 1 ? strtoll(argv[1], nullptr, 0) : 20000;
+    int64_t delayUs = argc > 2 ? strtoll(argv[2], nullptr, 0) : 500;
+
+    benchChain(coroutines, delayUs);
+    benchReject(ALooper::kOverflowFail, "fail");
+    benchReject(ALooper::kOverflowDropNewest, "drop_newest");
+    benchPool(4, 16);
+    return 0;
+}
@@ -0,0 +1,317 @@
+// Microbenchmarks for the core ALooper / AHandler / AMessage paths.
+//
+// Every result is printed as one line of space separated key=value pairs,
+// starting with bench=<name>, so that runs can be diffed or collected by a
+// script to track regressions.
+//
+// usage: handler_bench [scale]
+//   scale multiplies the default iteration counts (default 1.0)
+
+#include "ALooper.h"
+#include "AHandler.h"
+#include "AMessage.h"
+#include "AMessageArena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace android;
+
+namespace {
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Percentiles {
+    explicit Percentiles(std::vector<int64_t>& samples) {
+        std::sort(samples.begin(), samples.end());
+        auto at = [&samples](double p) {
+            return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+        };
+        p50 = at(0.5);
+        p99 = at(0.99);
+        p999 = at(0.999);
+        max = samples.back();
+    }
+
+    int64_t p50, p99, p999, max;
+};
+
+struct CountingHandler : public AHandler {
+    std::atomic<int64_t> mReceived{0};
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& /* msg */) {
+        mReceived.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+struct EchoHandler : public AHandler {
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        std::shared_ptr<AReplyToken> replyID;
+        if (msg->senderAwaitsResponse(&replyID)) {
+            std::shared_ptr<AMessage> response = std::make_shared<AMessage>();
+            response->setWhat(msg->what());
+            response->postReply(replyID);
+        }
+    }
+};
+
+// post() from |producers| threads into one looper, until all are delivered
+void benchPostThroughput(size_t producers, int64_t messages) {
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+    looper->setName("bench");
+    looper->start();
+    std::shared_ptr<CountingHandler> handler = std::make_shared<CountingHandler>();
+    looper->registerHandler(handler);
+
+    int64_t perProducer = messages / producers;
+    int64_t total = perProducer * producers;
+
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; p++) {
+        threads.emplace_back([&]() {
+            while (!go) {
+                std::this_thread::yield();
+            }
+            for (int64_t i = 0; i < perProducer; i++) {
+                std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(1, handler);
+                msg->post();
+            }
+        });
+    }
+
+    int64_t startNs = nowNs();
+    go = true;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    int64_t postedNs = nowNs();
+    while (handler->mReceived < total) {
+        std::this_thread::yield();
+    }
+    int64_t endNs = nowNs();
+
+    printf("bench=post_throughput producers=%zu msgs=%lld msgs_per_s=%.0f post_ns=%.1f\n",
+        producers, (long long)total, total * 1e9 / (endNs - startNs),
+        (double)(postedNs - startNs) * producers / total);
+
+    looper->unregisterHandler(handler->id());
+    looper->stop();
+}
+
+// |messages| immediate posts from one producer, |batch| at a time through
+// postBatch(), or one by one through post() if |batch| is 1
+void benchPostBatch(size_t batch, int64_t messages) {
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+    looper->setName("bench");
+    looper->start();
+    std::shared_ptr<CountingHandler> handler = std::make_shared<CountingHandler>();
+    looper->registerHandler(handler);
+
+    int64_t total = messages / batch * batch;
+    std::vector<ALooper::BatchEntry> entries(batch);
+
+    int64_t startNs = nowNs();
+    for (int64_t i = 0; i < total; i += batch) {
+        if (batch == 1) {
+            std::make_shared<AMessage>(1, handler)->post();
+            continue;
+        }
+        for (ALooper::BatchEntry& entry : entries) {
+            entry.mMessage = std::make_shared<AMessage>(1, handler);
+            entry.mDelayUs = 0;
+        }
+        looper->postBatch(entries);
+    }
+    int64_t postedNs = nowNs();
+    while (handler->mReceived < total) {
+        std::this_thread::yield();
+    }
+    int64_t endNs = nowNs();
+
+    printf("bench=post_batch batch=%zu msgs=%lld msgs_per_s=%.0f post_ns=%.1f\n",
+        batch, (long long)total, total * 1e9 / (endNs - startNs),
+        (double)(postedNs - startNs) / total);
+
+    looper->unregisterHandler(handler->id());
+    looper->stop();
+}
+
+// cost of inserting a delayed message into a queue already holding |depth|
+void benchDelayedInsert(size_t depth, int64_t inserts) {
+    // not started: nothing is ever dequeued, so the depth stays put
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+    std::shared_ptr<CountingHandler> handler = std::make_shared<CountingHandler>();
+    looper->registerHandler(handler);
+
+    const int64_t kHourUs = 3600LL * 1000000;
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int64_t> delayUs(kHourUs, 2 * kHourUs);
+
+    for (size_t i = 0; i < depth; i++) {
+        std::make_shared<AMessage>(1, handler)->post(delayUs(rng));
+    }
+
+    std::vector<std::shared_ptr<AMessage> > msgs;
+    for (int64_t i = 0; i < inserts; i++) {
+        msgs.push_back(std::make_shared<AMessage>(1, handler));
+    }
+
+    int64_t startNs = nowNs();
+    for (const std::shared_ptr<AMessage>& msg : msgs) {
+        msg->post(delayUs(rng));
+    }
+    int64_t endNs = nowNs();
+
+    printf("bench=delayed_insert depth=%zu inserts=%lld insert_ns=%.1f\n",
+        depth, (long long)inserts, (double)(endNs - startNs) / inserts);
+
+    looper->unregisterHandler(handler->id());
+}
+
+void benchRoundTrip(int64_t iterations) {
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+    looper->setName("bench");
+    looper->start();
+    std::shared_ptr<EchoHandler> handler = std::make_shared<EchoHandler>();
+    looper->registerHandler(handler);
+
+    std::vector<int64_t> latenciesNs;
+    latenciesNs.reserve(iterations);
+    for (int64_t i = 0; i < iterations; i++) {
+        std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(1, handler);
+        std::shared_ptr<AMessage> response;
+        int64_t startNs = nowNs();
+        if (msg->postAndAwaitResponse(&response) != OK) {
+            fprintf(stderr, "postAndAwaitResponse failed\n");
+            break;
+        }
+        latenciesNs.push_back(nowNs() - startNs);
+    }
+
+    Percentiles p(latenciesNs);
+    printf("bench=round_trip iterations=%lld p50_ns=%lld p99_ns=%lld p999_ns=%lld max_ns=%lld\n",
+        (long long)iterations, (long long)p.p50, (long long)p.p99, (long long)p.p999, (long long)p.max);
+
+    looper->unregisterHandler(handler->id());
+    looper->stop();
+}
+
+// Creates a message and setInt32()s |items| entries into it, then findInt32()s
+// each. With |arena|, messages come from an AMessageArena shared by 64 of them.
+void benchMessageItems(size_t items, int64_t iterations, bool arena) {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < items; i++) {
+        names.push_back("key" + std::to_string(i));
+    }
+
+    int64_t setNs = 0;
+    int64_t findNs = 0;
+    int64_t sum = 0;
+    std::shared_ptr<AMessageArena> messageArena;
+    for (int64_t it = 0; it < iterations; it++) {
+        int64_t startNs = nowNs();
+        std::shared_ptr<AMessage> msg;
+        if (arena) {
+            if (it % 64 == 0) {
+                messageArena = std::make_shared<AMessageArena>();
+            }
+            msg = messageArena->obtain(0, nullptr);
+        }
+        else {
+            msg = std::make_shared<AMessage>();
+        }
+
+        for (size_t i = 0; i < items; i++) {
+            msg->setInt32(names[i].c_str(), (int32_t)i);
+        }
+        int64_t midNs = nowNs();
+        for (size_t i = 0; i < items; i++) {
+            int32_t value = 0;
+            msg->findInt32(names[i].c_str(), &value);
+            sum += value;
+        }
+        int64_t endNs = nowNs();
+
+        setNs += midNs - startNs;
+        findNs += endNs - midNs;
+    }
+
+    int64_t ops = iterations * (int64_t)items;
+    printf("bench=message_items items=%zu arena=%d set_ns=%.1f find_ns=%.1f checksum=%lld\n",
+        items, arena ? 1 : 0, (double)setNs / ops, (double)findNs / ops, (long long)sum);
+}
+
+// registerHandler() / unregisterHandler() from |threads| threads at once
+void benchRegistrationChurn(size_t threads, int64_t cycles) {
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+
+    std::atomic<bool> go(false);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            while (!go) {
+                std::this_thread::yield();
+            }
+            for (int64_t i = 0; i < cycles; i++) {
+                std::shared_ptr<CountingHandler> handler = std::make_shared<CountingHandler>();
+                looper->registerHandler(handler);
+                looper->unregisterHandler(handler->id());
+            }
+        });
+    }
+
+    int64_t startNs = nowNs();
+    go = true;
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    int64_t endNs = nowNs();
+
+    int64_t total = cycles * (int64_t)threads;
+    printf("bench=registration_churn threads=%zu cycles=%lld cycles_per_s=%.0f\n",
+        threads, (long long)total, total * 1e9 / (endNs - startNs));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    spdlog::set_level(spdlog::level::warn);
+
+    double scale = argc > 1 ? strtod(argv[1], nullptr) : 1.0;
+    auto scaled = [scale](int64_t n) {
+        return std::max<int64_t>(1, (int64_t)(n * scale));
+    };
+
+    for (size_t producers : { 1, 4, 16 }) {
+        benchPostThroughput(producers, scaled(100000));
+    }
+    for (size_t batch : { 1, 16, 256 }) {
+        benchPostBatch(batch, scaled(100000));
+    }
+    for (size_t depth : { 10, 100, 1000, 10000, 100000 }) {
+        benchDelayedInsert(depth, scaled(depth >= 10000 ? 1000 : 20000));
+    }
+    benchRoundTrip(scaled(20000));
+    for (size_t items : { 1, 4, 16, 64, 256 }) {
+        benchMessageItems(items, scaled(200000 / items), false);
+        benchMessageItems(items, scaled(200000 / items), true);
+    }
+    for (size_t threads : { 1, 4, 16 }) {
+        benchRegistrationChurn(threads, scaled(100000 / threads));
+    }
+    return 0;
+}
@@ -0,0 +1,705 @@
+// Soak and scaling stress test for loopers, handlers and reply tokens.
+//
+// soak: worker threads mix immediate, delayed and postAndAwaitResponse()
+// traffic over a set of loopers while handlers and whole loopers are created
+// and destroyed underneath them. Every interval it reports throughput,
+// post-to-delivery latency percentiles, RSS, thread count and the number of
+// objects still alive; at the end everything is torn down and whatever
+// survived is reported as leaked.
+//
+// scaling: N producers each feed their own looper for a fixed time, for N
+// doubling from 1 up to the given maximum, to show how throughput scales
+// with the number of loopers and cores.
+//
+// drops: threads make postAndAwaitResponse() calls to a looper with a small
+// queue kept full by a flood of posts, once for each overflow policy. Every
+// call must return, with a reply or with the error of its dropped or
+// rejected message; a call still waiting at the deadline is reported as hung
+// and fails the run.
+//
+// checks: posts behind a sync barrier, lets a message outlive its time to
+// live and adds idle handlers, and checks that the barrier holds back sync
+// messages only until it is removed, that the expired message's caller gets
+// TIMED_OUT and that an idle handler returning false is removed. A failed
+// check fails the run.
+//
+// Results are key=value lines, like the other benchmarks.
+//
+// usage: handler_stress soak [seconds] [threads] [loopers] [intervalSeconds]
+//        handler_stress scaling [maxLoopers] [secondsPerStep]
+//        handler_stress drops [callsPerThread] [threads]
+//        handler_stress checks
+
+#include "ALooper.h"
+#include "ALooperRoster.h"
+#include "AHandler.h"
+#include "AMessage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+    extern ALooperRoster gLooperRoster;
+}
+
+using namespace android;
+
+namespace {
+
+enum {
+    kWhatPing = 1,
+    kWhatEcho = 2,
+    kWhatSync = 3,
+    kWhatAsync = 4,
+};
+
+std::atomic<int64_t> gLiveHandlers(0);
+std::atomic<int64_t> gLiveMessages(0);
+
+// post-to-delivery latency in power-of-two microsecond buckets, so that the
+// looper threads only do a relaxed increment per message
+struct LatencyHistogram {
+    enum { kBuckets = 40 };
+
+    std::atomic<uint64_t> mCounts[kBuckets];
+
+    LatencyHistogram() {
+        reset();
+    }
+
+    void reset() {
+        for (std::atomic<uint64_t>& count : mCounts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void add(int64_t us) {
+        size_t bucket = 0;
+        while (bucket + 1 < kBuckets && us >= (1LL << bucket)) {
+            bucket++;
+        }
+        mCounts[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (const std::atomic<uint64_t>& count : mCounts) {
+            sum += count.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    // upper bound of the bucket holding percentile |p|
+    int64_t percentileUs(double p) const {
+        uint64_t target = (uint64_t)(p * total());
+        uint64_t sum = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            sum += mCounts[i].load(std::memory_order_relaxed);
+            if (sum > target) {
+                return 1LL << i;
+            }
+        }
+        return 1LL << (kBuckets - 1);
+    }
+};
+
+LatencyHistogram gLatency;
+std::atomic<int64_t> gDelivered(0);
+
+struct CountedMessage : public AMessage {
+    CountedMessage(uint32_t what, const std::shared_ptr<AHandler>& handler)
+        : AMessage(what, handler) {
+        gLiveMessages++;
+    }
+
+    virtual ~CountedMessage() {
+        gLiveMessages--;
+    }
+};
+
+struct StressHandler : public AHandler {
+    StressHandler() {
+        gLiveHandlers++;
+    }
+
+    virtual ~StressHandler() {
+        gLiveHandlers--;
+    }
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        int64_t postUs;
+        if (msg->findInt64("postUs", &postUs)) {
+            gLatency.add(ALooper::GetNowUs() - postUs);
+        }
+        gDelivered.fetch_add(1, std::memory_order_relaxed);
+
+        std::shared_ptr<AReplyToken> replyID;
+        if (msg->what() == kWhatEcho && msg->senderAwaitsResponse(&replyID)) {
+            std::shared_ptr<AMessage> response = std::make_shared<AMessage>();
+            response->setWhat(kWhatEcho);
+            response->postReply(replyID);
+        }
+    }
+};
+
+int64_t residentKb() {
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    long size = 0;
+    long resident = 0;
+    if (fscanf(file, "%ld %ld", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+    return 0;
+#endif
+}
+
+int64_t threadCount() {
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    char line[256];
+    long threads = 0;
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        if (sscanf(line, "Threads: %ld", &threads) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return threads;
+#else
+    return 0;
+#endif
+}
+
+// A looper with its handlers. The echo handler only goes away with its
+// looper, so that a postAndAwaitResponse() caller always gets a reply or an
+// error from the looper stopping; a request to a handler unregistered under
+// it would otherwise wait until the looper stops.
+struct Slot {
+    std::shared_ptr<ALooper> mLooper;
+    std::shared_ptr<StressHandler> mEcho;
+    std::vector<std::shared_ptr<StressHandler> > mHandlers;
+};
+
+struct Soak {
+    enum { kHandlersPerLooper = 8 };
+
+    std::mutex mLock;
+    std::vector<Slot> mSlots;
+    // loopers that have been replaced; all of them should be destroyed soon
+    std::vector<std::weak_ptr<ALooper> > mRetired;
+
+    std::atomic<int64_t> mPosted{0};
+    std::atomic<int64_t> mRequests{0};
+    std::atomic<int64_t> mRequestsFailed{0};
+    std::atomic<int64_t> mHandlerChurn{0};
+    std::atomic<int64_t> mLooperChurn{0};
+
+    Slot makeSlot(size_t index) {
+        Slot slot;
+        slot.mLooper = std::make_shared<ALooper>();
+        slot.mLooper->setName(("stress-" + std::to_string(index)).c_str());
+        slot.mLooper->start();
+        slot.mEcho = std::make_shared<StressHandler>();
+        slot.mLooper->registerHandler(slot.mEcho);
+        for (size_t i = 0; i < kHandlersPerLooper; i++) {
+            std::shared_ptr<StressHandler> handler = std::make_shared<StressHandler>();
+            slot.mLooper->registerHandler(handler);
+            slot.mHandlers.push_back(handler);
+        }
+        return slot;
+    }
+
+    void run(int64_t seconds, size_t numThreads, size_t numLoopers, int64_t intervalSeconds) {
+        for (size_t i = 0; i < numLoopers; i++) {
+            mSlots.push_back(makeSlot(i));
+        }
+
+        std::atomic<bool> running(true);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < numThreads; t++) {
+            threads.emplace_back([this, &running, t]() {
+                work((uint32_t)t + 1, running);
+            });
+        }
+
+        int64_t startUs = ALooper::GetNowUs();
+        int64_t lastUs = startUs;
+        int64_t lastDelivered = 0;
+        int64_t startRssKb = residentKb();
+        while (ALooper::GetNowUs() - startUs < seconds * 1000000) {
+            std::this_thread::sleep_for(std::chrono::seconds(intervalSeconds));
+
+            int64_t nowUs = ALooper::GetNowUs();
+            int64_t delivered = gDelivered.load();
+            printf("mode=soak t_s=%lld msgs_per_s=%.0f p50_us=%lld p99_us=%lld p999_us=%lld"
+                " requests=%lld requests_failed=%lld handler_churn=%lld looper_churn=%lld"
+                " rss_kb=%lld rss_growth_kb=%lld threads=%lld live_handlers=%lld live_msgs=%lld"
+                " retired_loopers_alive=%lld roster_handlers=%zu roster_loopers=%zu\n",
+                (long long)((nowUs - startUs) / 1000000),
+                (delivered - lastDelivered) * 1e6 / (nowUs - lastUs),
+                (long long)gLatency.percentileUs(0.5), (long long)gLatency.percentileUs(0.99),
+                (long long)gLatency.percentileUs(0.999),
+                (long long)mRequests.load(), (long long)mRequestsFailed.load(),
+                (long long)mHandlerChurn.load(), (long long)mLooperChurn.load(),
+                (long long)residentKb(), (long long)(residentKb() - startRssKb),
+                (long long)threadCount(), (long long)gLiveHandlers.load(),
+                (long long)gLiveMessages.load(), (long long)retiredAlive(),
+                gLooperRoster.numHandlers(), gLooperRoster.numLoopers());
+            fflush(stdout);
+
+            gLatency.reset();
+            lastUs = nowUs;
+            lastDelivered = delivered;
+        }
+
+        running = false;
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        // tear everything down and see what is left
+        {
+            std::lock_guard<std::mutex> autoLock(mLock);
+            for (Slot& slot : mSlots) {
+                mRetired.push_back(slot.mLooper);
+                slot.mLooper->stop();
+            }
+            mSlots.clear();
+        }
+        // delayed messages die with their loopers; give detached looper
+        // threads a moment to drop their last references
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        gLooperRoster.unregisterStaleHandlers();
+
+        printf("mode=soak_end leaked_handlers=%lld leaked_msgs=%lld leaked_loopers=%lld"
+            " roster_handlers=%zu roster_loopers=%zu threads=%lld rss_kb=%lld\n",
+            (long long)gLiveHandlers.load(), (long long)gLiveMessages.load(),
+            (long long)retiredAlive(), gLooperRoster.numHandlers(), gLooperRoster.numLoopers(),
+            (long long)threadCount(), (long long)residentKb());
+    }
+
+    int64_t retiredAlive() {
+        std::lock_guard<std::mutex> autoLock(mLock);
+        int64_t alive = 0;
+        for (auto it = mRetired.begin(); it != mRetired.end();) {
+            if (it->expired()) {
+                it = mRetired.erase(it);
+            }
+            else {
+                alive++;
+                ++it;
+            }
+        }
+        return alive;
+    }
+
+    void work(uint32_t seed, std::atomic<bool>& running) {
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int> percent(0, 999);
+
+        while (running) {
+            int dice = percent(rng);
+
+            std::shared_ptr<ALooper> looper;
+            std::shared_ptr<StressHandler> handler;
+            std::shared_ptr<StressHandler> echo;
+            size_t index;
+            {
+                std::lock_guard<std::mutex> autoLock(mLock);
+                index = rng() % mSlots.size();
+                Slot& slot = mSlots[index];
+
+                if (dice < 2) {
+                    // replace the whole looper; its queued messages are dropped
+                    mRetired.push_back(slot.mLooper);
+                    looper = slot.mLooper;
+                    slot = makeSlot(index);
+                    mLooperChurn++;
+                }
+                else if (dice < 40) {
+                    // replace one handler
+                    size_t victim = rng() % slot.mHandlers.size();
+                    slot.mLooper->unregisterHandler(slot.mHandlers[victim]->id());
+                    slot.mHandlers[victim] = std::make_shared<StressHandler>();
+                    slot.mLooper->registerHandler(slot.mHandlers[victim]);
+                    mHandlerChurn++;
+                    continue;
+                }
+                else {
+                    handler = slot.mHandlers[rng() % slot.mHandlers.size()];
+                    echo = slot.mEcho;
+                }
+            }
+
+            if (looper != nullptr) {
+                // stop outside mLock: it waits for the looper thread
+                looper->stop();
+                continue;
+            }
+
+            if (dice < 140) {
+                std::shared_ptr<AMessage> msg = std::make_shared<CountedMessage>(kWhatEcho, echo);
+                msg->setInt64("postUs", ALooper::GetNowUs());
+                std::shared_ptr<AMessage> response;
+                mRequests++;
+                if (msg->postAndAwaitResponse(&response) != OK) {
+                    mRequestsFailed++;
+                }
+            }
+            else if (dice < 340) {
+                int64_t delayUs = rng() % 5000;
+                std::shared_ptr<AMessage> msg = std::make_shared<CountedMessage>(kWhatPing, handler);
+                msg->setInt64("postUs", ALooper::GetNowUs() + delayUs);
+                msg->post(delayUs);
+                mPosted++;
+            }
+            else {
+                std::shared_ptr<AMessage> msg = std::make_shared<CountedMessage>(kWhatPing, handler);
+                msg->setInt64("postUs", ALooper::GetNowUs());
+                msg->post();
+                mPosted++;
+            }
+        }
+    }
+};
+
+// |n| producers, each posting to its own looper for |seconds|
+void runScalingStep(size_t n, double seconds) {
+    std::vector<std::shared_ptr<ALooper> > loopers;
+    std::vector<std::shared_ptr<StressHandler> > handlers;
+    for (size_t i = 0; i < n; i++) {
+        std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+        looper->setName("scaling");
+        looper->start();
+        std::shared_ptr<StressHandler> handler = std::make_shared<StressHandler>();
+        looper->registerHandler(handler);
+        loopers.push_back(looper);
+        handlers.push_back(handler);
+    }
+
+    gLatency.reset();
+    int64_t startDelivered = gDelivered.load();
+    std::atomic<bool> running(true);
+    std::vector<std::thread> producers;
+    for (size_t i = 0; i < n; i++) {
+        producers.emplace_back([&handlers, &running, i]() {
+            int64_t sent = 0;
+            while (running) {
+                std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(kWhatPing, handlers[i]);
+                msg->setInt64("postUs", ALooper::GetNowUs());
+                msg->post();
+                // keep the queues short so that latency, not backlog, is measured
+                if (++sent % 64 == 0) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    int64_t startUs = ALooper::GetNowUs();
+    std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(seconds * 1e6)));
+    int64_t delivered = gDelivered.load() - startDelivered;
+    int64_t elapsedUs = ALooper::GetNowUs() - startUs;
+    running = false;
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+
+    printf("mode=scaling loopers=%zu cpus=%u msgs_per_s=%.0f msgs_per_s_per_looper=%.0f"
+        " p50_us=%lld p99_us=%lld\n",
+        n, std::thread::hardware_concurrency(), delivered * 1e6 / elapsedUs,
+        delivered * 1e6 / elapsedUs / n,
+        (long long)gLatency.percentileUs(0.5), (long long)gLatency.percentileUs(0.99));
+    fflush(stdout);
+
+    for (size_t i = 0; i < n; i++) {
+        loopers[i]->unregisterHandler(handlers[i]->id());
+        loopers[i]->stop();
+    }
+}
+
+void runDropsStep(ALooper::OverflowPolicy policy, const char* name, int64_t calls, size_t threads) {
+    enum { kCapacity = 4 };
+
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+    looper->setName("drops");
+    looper->start();
+    std::shared_ptr<StressHandler> handler = std::make_shared<StressHandler>();
+    looper->registerHandler(handler);
+    // a short timeout, so that kOverflowBlock also fails some calls
+    looper->setCapacity(kCapacity, policy, 1000);
+
+    std::atomic<bool> flooding(true);
+    std::thread flood([&handler, &flooding]() {
+        while (flooding) {
+            std::make_shared<AMessage>(kWhatPing, handler)->post();
+        }
+    });
+
+    std::atomic<int64_t> replied(0);
+    std::atomic<int64_t> wouldBlock(0);
+    std::atomic<int64_t> timedOut(0);
+    std::atomic<int64_t> otherErrors(0);
+    std::atomic<int64_t> returned(0);
+    std::vector<std::thread> callers;
+    for (size_t i = 0; i < threads; i++) {
+        callers.emplace_back([&, calls]() {
+            for (int64_t n = 0; n < calls; n++) {
+                std::shared_ptr<AMessage> response;
+                status_t err = std::make_shared<AMessage>(kWhatEcho, handler)->postAndAwaitResponse(&response);
+                if (err == OK) {
+                    replied++;
+                }
+                else if (err == WOULD_BLOCK) {
+                    wouldBlock++;
+                }
+                else if (err == TIMED_OUT) {
+                    timedOut++;
+                }
+                else {
+                    otherErrors++;
+                }
+                returned++;
+            }
+        });
+    }
+
+    int64_t expected = calls * (int64_t)threads;
+    int64_t deadlineUs = ALooper::GetNowUs() + 20000000;
+    while (returned < expected && ALooper::GetNowUs() < deadlineUs) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    flooding = false;
+    flood.join();
+
+    ALooper::Stats stats;
+    looper->getStats(&stats);
+    int64_t hung = expected - returned;
+    printf("mode=drops policy=%s calls=%lld replied=%lld would_block=%lld timed_out=%lld"
+        " other_errors=%lld hung=%lld dropped=%llu rejected=%llu\n",
+        name, (long long)expected, (long long)replied.load(), (long long)wouldBlock.load(),
+        (long long)timedOut.load(), (long long)otherErrors.load(), (long long)hung,
+        (unsigned long long)stats.mDropped, (unsigned long long)stats.mRejected);
+    fflush(stdout);
+
+    if (hung > 0) {
+        // the hung callers cannot be joined
+        _Exit(1);
+    }
+    for (std::thread& caller : callers) {
+        caller.join();
+    }
+    looper->unregisterHandler(handler->id());
+    looper->stop();
+}
+
+// counts deliveries per what, and replies to kWhatEcho
+struct CheckHandler : public AHandler {
+    std::atomic<int64_t> mSync{0};
+    std::atomic<int64_t> mAsync{0};
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        if (msg->what() == kWhatSync) {
+            mSync++;
+        }
+        else if (msg->what() == kWhatAsync) {
+            mAsync++;
+        }
+        std::shared_ptr<AReplyToken> replyID;
+        if (msg->what() == kWhatEcho && msg->senderAwaitsResponse(&replyID)) {
+            std::shared_ptr<AMessage> response = std::make_shared<AMessage>();
+            response->postReply(replyID);
+        }
+    }
+};
+
+template <typename Predicate>
+bool waitFor(Predicate done, int64_t timeoutUs) {
+    int64_t deadlineUs = ALooper::GetNowUs() + timeoutUs;
+    while (!done()) {
+        if (ALooper::GetNowUs() >= deadlineUs) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// a sync barrier holds back sync messages, lets asynchronous ones through
+// and releases the held messages when it is removed
+bool checkBarrier(const std::shared_ptr<ALooper>& looper, const std::shared_ptr<CheckHandler>& handler) {
+    ALooper::event_id token;
+    looper->postSyncBarrier(&token);
+    std::make_shared<AMessage>(kWhatSync, handler)->post();
+    std::shared_ptr<AMessage> async = std::make_shared<AMessage>(kWhatAsync, handler);
+    async->setAsynchronous(true);
+    async->post();
+
+    bool passed = waitFor([&handler]() { return handler->mAsync == 1; }, 1000000);
+    // gives a wrongly delivered sync message time to show up
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    bool blocked = handler->mSync == 0;
+    looper->removeSyncBarrier(token);
+    bool released = waitFor([&handler]() { return handler->mSync == 1; }, 1000000);
+
+    bool ok = passed && blocked && released;
+    printf("mode=checks check=barrier async_passed=%d sync_blocked=%d released=%d ok=%d\n",
+        passed ? 1 : 0, blocked ? 1 : 0, released ? 1 : 0, ok ? 1 : 0);
+    return ok;
+}
+
+// a message still queued past its time to live fails its reply with TIMED_OUT
+bool checkExpiry(const std::shared_ptr<ALooper>& looper, const std::shared_ptr<CheckHandler>& handler) {
+    ALooper::Stats before;
+    looper->getStats(&before);
+
+    // keeps the looper busy well past the message's time to live
+    std::atomic<bool> busy(false);
+    looper->post([&busy]() {
+        busy = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    });
+    waitFor([&busy]() { return busy.load(); }, 1000000);
+
+    std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(kWhatEcho, handler);
+    msg->setTimeToLive(1000);
+    std::shared_ptr<AMessage> response;
+    status_t err = msg->postAndAwaitResponse(&response);
+
+    ALooper::Stats after;
+    looper->getStats(&after);
+    uint64_t expired = after.mExpired - before.mExpired;
+    bool ok = err == TIMED_OUT && expired == 1;
+    printf("mode=checks check=expiry reply_err=%d expired=%llu ok=%d\n",
+        err, (unsigned long long)expired, ok ? 1 : 0);
+    return ok;
+}
+
+// an idle handler returning false runs once and is removed, one returning
+// true runs in every idle period
+bool checkIdle(const std::shared_ptr<ALooper>& looper, const std::shared_ptr<CheckHandler>& handler) {
+    std::atomic<int64_t> onceRuns(0);
+    std::atomic<int64_t> keptRuns(0);
+    ALooper::event_id once = looper->addIdleHandler([&onceRuns]() {
+        onceRuns++;
+        return false;
+    });
+    ALooper::event_id kept = looper->addIdleHandler([&keptRuns]() {
+        keptRuns++;
+        return true;
+    });
+    waitFor([&keptRuns]() { return keptRuns >= 1; }, 1000000);
+
+    // each delivery is followed by another idle period
+    for (int64_t i = 0; i < 3; i++) {
+        int64_t runs = keptRuns;
+        int64_t sync = handler->mSync;
+        std::make_shared<AMessage>(kWhatSync, handler)->post();
+        waitFor([&]() { return handler->mSync > sync && keptRuns > runs; }, 1000000);
+    }
+
+    bool removed = looper->removeIdleHandler(once) == NAME_NOT_FOUND;
+    looper->removeIdleHandler(kept);
+    bool ok = onceRuns == 1 && removed && keptRuns >= 4;
+    printf("mode=checks check=idle once_runs=%lld removed=%d kept_runs=%lld ok=%d\n",
+        (long long)onceRuns.load(), removed ? 1 : 0, (long long)keptRuns.load(), ok ? 1 : 0);
+    return ok;
+}
+
+bool runChecks() {
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+    looper->setName("checks");
+    looper->start();
+    std::shared_ptr<CheckHandler> handler = std::make_shared<CheckHandler>();
+    looper->registerHandler(handler);
+
+    bool ok = checkBarrier(looper, handler);
+    ok = checkExpiry(looper, handler) && ok;
+    ok = checkIdle(looper, handler) && ok;
+
+    looper->unregisterHandler(handler->id());
+    looper->stop();
+    return ok;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    // churn makes "handler is gone" warnings expected
+    spdlog::set_level(spdlog::level::err);
+
+    const char* mode = argc > 1 ? argv[1] : "soak";
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+
+    if (!strcmp(mode, "scaling")) {
+        size_t maxLoopers = argc > 2 ? strtoul(argv[2], nullptr, 0) : 64;
+        double seconds = argc > 3 ? strtod(argv[3], nullptr) : 2.0;
+        for (size_t n = 1; n <= maxLoopers; n *= 2) {
+            runScalingStep(n, seconds);
+        }
+        return 0;
+    }
+
+    if (!strcmp(mode, "drops")) {
+        int64_t calls = argc > 2 ? strtoll(argv[2], nullptr, 0) : 2000;
+        size_t threads = argc > 3 ? strtoul(argv[3], nullptr, 0) : 4;
+        const struct {
+            ALooper::OverflowPolicy mPolicy;
+            const char* mName;
+        } kPolicies[] = {
+            { ALooper::kOverflowBlock, "block" },
+            { ALooper::kOverflowFail, "fail" },
+            { ALooper::kOverflowDropOldest, "drop_oldest" },
+            { ALooper::kOverflowDropNewest, "drop_newest" },
+        };
+        for (const auto& entry : kPolicies) {
+            runDropsStep(entry.mPolicy, entry.mName, calls, threads);
+        }
+        return 0;
+    }
+
+    if (!strcmp(mode, "checks")) {
+        return runChecks() ? 0 : 1;
+    }
+
+    if (strcmp(mode, "soak")) {
+        fprintf(stderr, "usage: %s soak|scaling|drops|checks ...\n", argv[0]);
+        return 1;
+    }
+
+    int64_t seconds = argc > 2 ? strtoll(argv[2], nullptr, 0) : 60;
+    size_t threads = argc > 3 ? strtoul(argv[3], nullptr, 0) : 2 * cpus;
+    size_t loopers = argc > 4 ? strtoul(argv[4], nullptr, 0) : cpus;
+    int64_t intervalSeconds = argc > 5 ? strtoll(argv[5], nullptr, 0) : 5;
+
+    Soak soak;
+    soak.run(seconds, threads, loopers, intervalSeconds);
+
+    // a non-zero exit lets scripts treat leaks as failures
+    return (gLiveHandlers > 0 || gLiveMessages > 0) ? 1 : 0;
+}
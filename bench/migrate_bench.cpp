@@ -0,0 +1,316 @@
+// Handler migration benchmark and checker.
+//
+//   migrate_order     producer threads post sequenced messages and callables
+//                     to one handler while another thread keeps migrating it
+//                     between loopers. Some messages are dup()s of a template
+//                     that still names the handler's first looper, so they
+//                     are forwarded. Reports messages delivered out of order
+//                     or lost, deliveries that overlapped on two threads
+//                     (must all be 0), and migrateHandler() latency.
+//   migrate_balance   handlers with different amounts of work all start on
+//                     one looper; reports how their CPU time ends up spread
+//                     over the loopers without and with an ALooperBalancer.
+//
+// Results are key=value lines, like the other benchmarks.
+//
+// usage: migrate_bench [scale] [producers] [loopers]
+
+#include "ALooper.h"
+#include "ALooperBalancer.h"
+#include "AHandler.h"
+#include "AMessage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace android;
+
+namespace {
+
+enum {
+    kWhatSeq = 1,
+    kWhatWork = 2,
+    kWhatSelfMigrate = 3,
+};
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void spinNs(int64_t ns) {
+    int64_t endNs = nowNs() + ns;
+    while (nowNs() < endNs) {
+    }
+}
+
+std::vector<std::shared_ptr<ALooper> > makeLoopers(size_t count, const char* name) {
+    std::vector<std::shared_ptr<ALooper> > loopers;
+    for (size_t i = 0; i < count; i++) {
+        std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+        looper->setName((name + std::to_string(i)).c_str());
+        looper->start();
+        loopers.push_back(looper);
+    }
+    return loopers;
+}
+
+// checks that each producer's sequence arrives in order and that no two
+// deliveries overlap
+struct OrderHandler : public AHandler {
+    explicit OrderHandler(size_t producers)
+        : mLastSeq(producers, -1), mInside(0), mDelivered(0), mOutOfOrder(0), mConcurrent(0) {}
+
+    std::vector<int64_t> mLastSeq;
+    std::atomic<int32_t> mInside;
+    std::atomic<int64_t> mDelivered;
+    int64_t mOutOfOrder;
+    int64_t mConcurrent;
+    // where a kWhatSelfMigrate message tries to move the handler
+    std::shared_ptr<ALooper> mOther;
+
+    void check(int32_t producer, int64_t seq) {
+        if (mInside.fetch_add(1) != 0) {
+            mConcurrent++;
+        }
+        if (seq != mLastSeq[producer] + 1) {
+            mOutOfOrder++;
+        }
+        mLastSeq[producer] = seq;
+        // widen the window for overlapping deliveries
+        spinNs(1000);
+        mInside--;
+        mDelivered++;
+    }
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        if (msg->what() == kWhatSelfMigrate) {
+            std::shared_ptr<AReplyToken> replyID;
+            if (msg->senderAwaitsResponse(&replyID)) {
+                std::shared_ptr<AMessage> response = std::make_shared<AMessage>();
+                response->setInt32("err", mOther->migrateHandler(shared_from_this()));
+                response->postReply(replyID);
+            }
+            return;
+        }
+        int32_t producer = 0;
+        int64_t seq = 0;
+        msg->findInt32("producer", &producer);
+        msg->findInt64("seq", &seq);
+        check(producer, seq);
+    }
+};
+
+void benchOrder(int64_t perProducer, size_t producers, size_t numLoopers) {
+    std::vector<std::shared_ptr<ALooper> > loopers = makeLoopers(numLoopers, "migrate-");
+    std::shared_ptr<OrderHandler> handler = std::make_shared<OrderHandler>(producers);
+    loopers[0]->registerHandler(handler);
+
+    // a handler cannot move itself while it runs
+    handler->mOther = loopers[1];
+    std::shared_ptr<AMessage> response;
+    int32_t selfMigrateErr = 0;
+    if (std::make_shared<AMessage>(kWhatSelfMigrate, handler)->postAndAwaitResponse(&response) == OK) {
+        response->findInt32("err", &selfMigrateErr);
+    }
+
+    // names loopers[0] for good; its dup()s are forwarded once the handler moves
+    std::shared_ptr<AMessage> stale = std::make_shared<AMessage>(kWhatSeq, handler);
+
+    std::atomic<int64_t> failed(0);
+    std::atomic<size_t> running(producers);
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < producers; p++) {
+        threads.emplace_back([&, p]() {
+            for (int64_t i = 0; i < perProducer; i++) {
+                status_t err;
+                switch (i % 3) {
+                    case 0: {
+                        std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(kWhatSeq, handler);
+                        msg->setInt32("producer", (int32_t)p);
+                        msg->setInt64("seq", i);
+                        err = msg->post();
+                        break;
+                    }
+                    case 1: {
+                        std::shared_ptr<AMessage> msg = stale->dup();
+                        msg->setInt32("producer", (int32_t)p);
+                        msg->setInt64("seq", i);
+                        err = msg->post();
+                        break;
+                    }
+                    default: {
+                        OrderHandler* target = handler.get();
+                        err = handler->post([target, p, i]() {
+                            target->check((int32_t)p, i);
+                        });
+                        break;
+                    }
+                }
+                if (err != OK) {
+                    failed++;
+                }
+            }
+            running--;
+        });
+    }
+
+    // keeps moving the handler, backlog and all, until everything is delivered
+    int64_t expected = perProducer * producers;
+    int64_t deadlineNs = nowNs() + 30000000000LL;
+    std::vector<int64_t> latenciesNs;
+    int64_t migrateErrors = 0;
+    size_t next = 1;
+    while ((running > 0 || handler->mDelivered < expected) && nowNs() < deadlineNs) {
+        int64_t startNs = nowNs();
+        if (loopers[next]->migrateHandler(handler) != OK) {
+            migrateErrors++;
+        }
+        latenciesNs.push_back(nowNs() - startNs);
+        next = (next + 1) % loopers.size();
+        std::this_thread::yield();
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    // let a straggler that would exceed |expected| show up
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::sort(latenciesNs.begin(), latenciesNs.end());
+    auto at = [&latenciesNs](double p) {
+        return latenciesNs.empty() ? 0LL
+            : (long long)latenciesNs[std::min(latenciesNs.size() - 1, (size_t)(p * latenciesNs.size()))];
+    };
+    printf("bench=migrate_order producers=%zu loopers=%zu posted=%lld delivered=%lld failed=%lld "
+        "out_of_order=%lld concurrent=%lld migrations=%zu migrate_errors=%lld self_migrate_err=%d "
+        "p50_ns=%lld p99_ns=%lld max_ns=%lld\n",
+        producers, numLoopers, (long long)expected, (long long)handler->mDelivered.load(),
+        (long long)failed.load(), (long long)handler->mOutOfOrder, (long long)handler->mConcurrent,
+        latenciesNs.size(), (long long)migrateErrors, selfMigrateErr,
+        at(0.5), at(0.99), latenciesNs.empty() ? 0LL : (long long)latenciesNs.back());
+
+    for (std::shared_ptr<ALooper>& looper : loopers) {
+        looper->stop();
+    }
+}
+
+// does |mWorkUs| of work every |kPeriodUs|
+struct WorkHandler : public AHandler {
+    enum { kPeriodUs = 2000 };
+
+    explicit WorkHandler(int64_t workUs) : mWorkUs(workUs) {}
+
+    const int64_t mWorkUs;
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& /* msg */) {
+        spinNs(mWorkUs * 1000);
+    }
+};
+
+// CPU time of |handlers| over |windowMs|, summed per looper they are on at
+// the end. Returns (max - min) / total.
+double measureSpread(
+        const std::vector<std::shared_ptr<ALooper> >& loopers,
+        const std::vector<std::shared_ptr<WorkHandler> >& handlers, int64_t windowMs,
+        std::string* perLooper) {
+    std::vector<int64_t> before;
+    for (const std::shared_ptr<WorkHandler>& handler : handlers) {
+        before.push_back(handler->cpuTimeNs());
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(windowMs));
+
+    std::vector<int64_t> totalsNs(loopers.size(), 0);
+    for (size_t i = 0; i < handlers.size(); i++) {
+        std::shared_ptr<ALooper> looper = handlers[i]->looper();
+        for (size_t j = 0; j < loopers.size(); j++) {
+            if (loopers[j] == looper) {
+                totalsNs[j] += handlers[i]->cpuTimeNs() - before[i];
+            }
+        }
+    }
+
+    int64_t sumNs = 0;
+    perLooper->clear();
+    for (int64_t totalNs : totalsNs) {
+        sumNs += totalNs;
+        *perLooper += (perLooper->empty() ? "" : ",") + std::to_string(totalNs / 1000000);
+    }
+    int64_t spreadNs = *std::max_element(totalsNs.begin(), totalsNs.end())
+        - *std::min_element(totalsNs.begin(), totalsNs.end());
+    return sumNs > 0 ? (double)spreadNs / sumNs : 0.0;
+}
+
+void benchBalance(int64_t runMs, size_t numLoopers, bool balance) {
+    std::vector<std::shared_ptr<ALooper> > loopers = makeLoopers(numLoopers, "balance-");
+
+    // all on loopers[0], with uneven work
+    std::vector<std::shared_ptr<WorkHandler> > handlers;
+    std::vector<std::shared_ptr<AMessage> > ticks;
+    for (size_t i = 0; i < numLoopers * 2; i++) {
+        std::shared_ptr<WorkHandler> handler = std::make_shared<WorkHandler>(20 + 20 * (int64_t)i);
+        loopers[0]->registerHandler(handler);
+        handlers.push_back(handler);
+        std::shared_ptr<AMessage> tick = std::make_shared<AMessage>(kWhatWork, handler);
+        tick->postRepeating(WorkHandler::kPeriodUs, AMessage::kRepeatFixedRate, AMessage::kCatchUpSkip);
+        ticks.push_back(tick);
+    }
+
+    std::shared_ptr<ALooperBalancer> balancer = std::make_shared<ALooperBalancer>();
+    for (std::shared_ptr<ALooper>& looper : loopers) {
+        if (balance) {
+            balancer->addLooper(looper);
+        }
+        else {
+            looper->setCpuAccounting(true);
+        }
+    }
+    if (balance) {
+        balancer->start(runMs * 1000 / 20);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(runMs));
+    std::string perLooper;
+    double spread = measureSpread(loopers, handlers, runMs / 4, &perLooper);
+    if (balance) {
+        balancer->stop();
+    }
+
+    printf("bench=migrate_balance balancer=%d loopers=%zu handlers=%zu moves=%llu spread=%.2f cpu_ms_per_looper=%s\n",
+        balance ? 1 : 0, numLoopers, handlers.size(), (unsigned long long)balancer->numMigrations(),
+        spread, perLooper.c_str());
+
+    for (std::shared_ptr<AMessage>& tick : ticks) {
+        tick->cancelRepeating();
+    }
+    for (std::shared_ptr<ALooper>& looper : loopers) {
+        looper->stop();
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    spdlog::set_level(spdlog::level::warn);
+
+    double scale = argc > 1 ? strtod(argv[1], nullptr) : 1.0;
+    size_t producers = argc > 2 ? strtoul(argv[2], nullptr, 0) : 4;
+    size_t loopers = argc > 3 ? strtoul(argv[3], nullptr, 0) : 4;
+    auto scaled = [scale](int64_t n) {
+        return std::max<int64_t>(1, (int64_t)(n * scale));
+    };
+    loopers = std::max<size_t>(2, loopers);
+
+    benchOrder(scaled(30000), producers, loopers);
+    benchBalance(scaled(4000), loopers, false);
+    benchBalance(scaled(4000), loopers, true);
+    return 0;
+}
@@ -0,0 +1,200 @@
+// Skewed-load comparison of one-thread-per-looper against ALooperPool in its
+// shared and work-stealing scheduling modes.
+//
+// Handlers receive messages with Zipf-distributed popularity, so a few handlers
+// are hot and the ALooper that hosts them becomes the bottleneck. For each mode
+// the benchmark reports throughput, post-to-delivery latency percentiles and
+// the CPU time the workers spent per available worker. The producer threads'
+// CPU time is reported separately, not counted against the workers.
+//
+// usage: pool_bench [handlers] [workers] [messages] [workUs] [skew]
+
+#include "ALooper.h"
+#include "ALooperPool.h"
+#include "AHandler.h"
+#include "AMessage.h"
+
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <thread>
+
+using namespace android;
+
+namespace {
+
+std::atomic<int64_t> gDelivered(0);
+
+void spinUs(int64_t us) {
+    int64_t endUs = ALooper::GetNowUs() + us;
+    while (ALooper::GetNowUs() < endUs) {
+    }
+}
+
+struct BenchHandler : public AHandler {
+    explicit BenchHandler(int64_t workUs) : mWorkUs(workUs) {}
+
+    std::vector<int64_t> mLatenciesUs;
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        int64_t postUs = 0;
+        msg->findInt64("postUs", &postUs);
+        mLatenciesUs.push_back(ALooper::GetNowUs() - postUs);
+        spinUs(mWorkUs);
+        gDelivered++;
+    }
+
+private:
+    int64_t mWorkUs;
+};
+
+// CPU time of the whole process
+int64_t cpuTimeUs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// CPU time of the calling thread
+int64_t threadCpuTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct Config {
+    size_t handlers;
+    size_t workers;
+    size_t producers;
+    int64_t messages;
+    int64_t workUs;
+    double skew;
+};
+
+void runMode(const char* mode, const Config& config) {
+    std::vector<std::shared_ptr<ALooper> > loopers;
+    if (!strcmp(mode, "looper")) {
+        for (size_t i = 0; i < config.workers; i++) {
+            std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+            looper->setName("bench");
+            looper->start();
+            loopers.push_back(looper);
+        }
+    }
+    else {
+        std::shared_ptr<ALooperPool> pool = std::make_shared<ALooperPool>();
+        pool->setName("bench");
+        if (!strcmp(mode, "stealing")) {
+            pool->setSchedulingMode(ALooperPool::kSchedulingWorkStealing);
+        }
+        pool->start(config.workers);
+        loopers.push_back(pool);
+    }
+
+    std::vector<std::shared_ptr<BenchHandler> > handlers;
+    for (size_t i = 0; i < config.handlers; i++) {
+        std::shared_ptr<BenchHandler> handler = std::make_shared<BenchHandler>(config.workUs);
+        loopers[i % loopers.size()]->registerHandler(handler);
+        handler->mLatenciesUs.reserve(config.messages);
+        handlers.push_back(handler);
+    }
+
+    // handler i is picked with probability proportional to 1 / (i + 1)^skew
+    std::vector<double> cdf(config.handlers);
+    double sum = 0;
+    for (size_t i = 0; i < config.handlers; i++) {
+        sum += 1.0 / std::pow((double)(i + 1), config.skew);
+        cdf[i] = sum;
+    }
+
+    gDelivered = 0;
+    int64_t startUs = ALooper::GetNowUs();
+    int64_t startCpuUs = cpuTimeUs();
+    int64_t startMainCpuUs = threadCpuTimeUs();
+    // CPU time each producer took, so it can be taken out of the workers'
+    std::vector<int64_t> producerCpuUs(config.producers, 0);
+
+    std::vector<std::thread> producers;
+    for (size_t p = 0; p < config.producers; p++) {
+        producers.emplace_back([&, p]() {
+            std::mt19937 rng((uint32_t)p + 1);
+            std::uniform_real_distribution<double> dist(0, sum);
+            for (int64_t i = p; i < config.messages; i += config.producers) {
+                size_t index = std::lower_bound(cdf.begin(), cdf.end(), dist(rng)) - cdf.begin();
+                std::shared_ptr<AMessage> msg = handlers[std::min(index, config.handlers - 1)]->obtainMessage();
+                msg->setWhat(1);
+                msg->setInt64("postUs", ALooper::GetNowUs());
+                msg->post();
+            }
+            producerCpuUs[p] = threadCpuTimeUs();
+        });
+    }
+    for (std::thread& producer : producers) {
+        producer.join();
+    }
+
+    while (gDelivered < config.messages) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    int64_t elapsedUs = ALooper::GetNowUs() - startUs;
+    // everything else the process ran is the workers
+    int64_t producersCpuUs = 0;
+    for (int64_t us : producerCpuUs) {
+        producersCpuUs += us;
+    }
+    int64_t workersCpuUs = cpuTimeUs() - startCpuUs - producersCpuUs
+        - (threadCpuTimeUs() - startMainCpuUs);
+
+    std::vector<int64_t> latenciesUs;
+    latenciesUs.reserve(config.messages);
+    for (const std::shared_ptr<BenchHandler>& handler : handlers) {
+        latenciesUs.insert(latenciesUs.end(), handler->mLatenciesUs.begin(), handler->mLatenciesUs.end());
+    }
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+    auto percentile = [&latenciesUs](double p) {
+        return latenciesUs[std::min(latenciesUs.size() - 1, (size_t)(p * latenciesUs.size()))];
+    };
+
+    printf("mode=%s workers=%zu handlers=%zu msgs=%lld msgs_per_s=%.0f"
+        " p50_us=%lld p99_us=%lld p999_us=%lld max_us=%lld cpu_util=%.2f producer_cpu_ms=%lld\n",
+        mode, config.workers, config.handlers, (long long)config.messages,
+        config.messages * 1e6 / elapsedUs,
+        (long long)percentile(0.5), (long long)percentile(0.99),
+        (long long)percentile(0.999), (long long)latenciesUs.back(),
+        (double)workersCpuUs / ((double)elapsedUs * config.workers),
+        (long long)(producersCpuUs / 1000));
+
+    for (size_t i = 0; i < handlers.size(); i++) {
+        loopers[i % loopers.size()]->unregisterHandler(handlers[i]->id());
+    }
+    for (const std::shared_ptr<ALooper>& looper : loopers) {
+        looper->stop();
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    spdlog::set_level(spdlog::level::warn);
+
+    Config config;
+    config.handlers = argc > 1 ? strtoul(argv[1], nullptr, 0) : 64;
+    config.workers = argc > 2 ? strtoul(argv[2], nullptr, 0) : std::max(2u, std::thread::hardware_concurrency());
+    config.messages = argc > 3 ? strtoll(argv[3], nullptr, 0) : 200000;
+    config.workUs = argc > 4 ? strtoll(argv[4], nullptr, 0) : 2;
+    config.skew = argc > 5 ? strtod(argv[5], nullptr) : 1.2;
+    config.producers = 4;
+
+    runMode("looper", config);
+    runMode("shared", config);
+    runMode("stealing", config);
+    return 0;
+}
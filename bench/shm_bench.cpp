@@ -0,0 +1,202 @@
+// Cross-process AShmTransport benchmark. Forks a server process that exports
+// an echo handler over a shared memory segment, then measures from the parent:
+//
+//   shm_post        one-way post() throughput into the server's looper
+//   shm_round_trip  postAndAwaitResponse() latency percentiles
+//
+// Each message carries a few int and string items, which the server checks
+// and echoes back. Results are printed as key=value lines like handler_bench.
+//
+// usage: shm_bench [scale]
+
+#include "ALooper.h"
+#include "AHandler.h"
+#include "AMessage.h"
+#include "AShmTransport.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace android;
+
+namespace {
+
+enum {
+    kEchoPort = 1,
+    kWhatCount = 1,
+    kWhatEcho = 2,
+};
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// counts kWhatCount messages and echoes kWhatEcho ones with the count so far
+struct EchoHandler : public AHandler {
+    int64_t mCount = 0;
+    int64_t mBad = 0;
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage>& msg) {
+        int32_t seq = 0;
+        std::string name;
+        if (!msg->findInt32("seq", &seq) || !msg->findString("name", name)
+                || name != "frame-" + std::to_string(seq)) {
+            mBad++;
+        }
+
+        if (msg->what() == kWhatCount) {
+            mCount++;
+            return;
+        }
+        std::shared_ptr<AReplyToken> replyID;
+        if (msg->senderAwaitsResponse(&replyID)) {
+            std::shared_ptr<AMessage> response = std::make_shared<AMessage>();
+            response->setInt32("seq", seq);
+            response->setInt64("count", mCount);
+            response->setInt64("bad", mBad);
+            response->postReply(replyID);
+        }
+    }
+};
+
+void runServer(const char* name, int readyFd) {
+    std::shared_ptr<ALooper> looper = std::make_shared<ALooper>();
+    looper->setName("shm_server");
+    looper->start();
+    std::shared_ptr<EchoHandler> handler = std::make_shared<EchoHandler>();
+    looper->registerHandler(handler);
+
+    std::shared_ptr<AShmServer> server = std::make_shared<AShmServer>();
+    server->exportHandler(kEchoPort, handler);
+    status_t err = server->start(name);
+    char ready = err == OK ? 1 : 0;
+    if (write(readyFd, &ready, 1) != 1 || err != OK) {
+        _exit(1);
+    }
+
+    // runs until the parent kills it
+    for (;;) {
+        pause();
+    }
+}
+
+std::shared_ptr<AMessage> makeMessage(uint32_t what, const std::shared_ptr<AHandler>& proxy, int32_t seq) {
+    std::shared_ptr<AMessage> msg = std::make_shared<AMessage>(what, proxy);
+    msg->setInt32("seq", seq);
+    msg->setInt64("ptsUs", seq * 33333LL);
+    msg->setString("name", "frame-" + std::to_string(seq));
+    return msg;
+}
+
+void benchPost(const std::shared_ptr<AHandler>& proxy, int64_t messages) {
+    int64_t startNs = nowNs();
+    int64_t failed = 0;
+    for (int64_t i = 0; i < messages; i++) {
+        if (makeMessage(kWhatCount, proxy, (int32_t)i)->post() != OK) {
+            failed++;
+        }
+    }
+    // replies in order after everything posted before it
+    std::shared_ptr<AMessage> response;
+    makeMessage(kWhatEcho, proxy, 0)->postAndAwaitResponse(&response);
+    int64_t endNs = nowNs();
+
+    int64_t count = 0;
+    int64_t bad = 0;
+    if (response != nullptr) {
+        response->findInt64("count", &count);
+        response->findInt64("bad", &bad);
+    }
+    printf("bench=shm_post messages=%lld delivered=%lld bad=%lld failed=%lld msgs_per_s=%.0f\n",
+        (long long)messages, (long long)count, (long long)bad, (long long)failed,
+        messages * 1e9 / (endNs - startNs));
+}
+
+void benchRoundTrip(const std::shared_ptr<AHandler>& proxy, int64_t iterations) {
+    std::vector<int64_t> latenciesNs;
+    latenciesNs.reserve(iterations);
+    int64_t mismatched = 0;
+    for (int64_t i = 0; i < iterations; i++) {
+        std::shared_ptr<AMessage> msg = makeMessage(kWhatEcho, proxy, (int32_t)i);
+        std::shared_ptr<AMessage> response;
+        int64_t startNs = nowNs();
+        if (msg->postAndAwaitResponse(&response) != OK) {
+            fprintf(stderr, "postAndAwaitResponse failed\n");
+            return;
+        }
+        latenciesNs.push_back(nowNs() - startNs);
+        int32_t seq = -1;
+        if (!response->findInt32("seq", &seq) || seq != (int32_t)i) {
+            mismatched++;
+        }
+    }
+
+    std::sort(latenciesNs.begin(), latenciesNs.end());
+    auto at = [&latenciesNs](double p) {
+        return (long long)latenciesNs[std::min(latenciesNs.size() - 1, (size_t)(p * latenciesNs.size()))];
+    };
+    printf("bench=shm_round_trip iterations=%lld mismatched=%lld p50_ns=%lld p99_ns=%lld max_ns=%lld\n",
+        (long long)iterations, (long long)mismatched, at(0.5), at(0.99), (long long)latenciesNs.back());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    spdlog::set_level(spdlog::level::warn);
+
+    double scale = argc > 1 ? strtod(argv[1], nullptr) : 1.0;
+    auto scaled = [scale](int64_t n) {
+        return std::max<int64_t>(1, (int64_t)(n * scale));
+    };
+
+    std::string name = "/shm_bench-" + std::to_string(getpid());
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 1;
+    }
+    pid_t server = fork();
+    if (server == 0) {
+        close(fds[0]);
+        runServer(name.c_str(), fds[1]);
+    }
+    close(fds[1]);
+    char ready = 0;
+    if (read(fds[0], &ready, 1) != 1 || !ready) {
+        fprintf(stderr, "server failed to start\n");
+        return 1;
+    }
+
+    std::shared_ptr<AShmClient> client = std::make_shared<AShmClient>();
+    if (client->connect(name.c_str()) != OK) {
+        kill(server, SIGKILL);
+        return 1;
+    }
+    std::shared_ptr<AHandler> proxy = client->proxy(kEchoPort);
+
+    benchPost(proxy, scaled(200000));
+    benchRoundTrip(proxy, scaled(20000));
+
+    // the client notices that the server is gone
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    std::shared_ptr<AMessage> response;
+    status_t err = makeMessage(kWhatEcho, proxy, 0)->postAndAwaitResponse(&response);
+    printf("bench=shm_server_gone err=%d\n", err);
+
+    client->stop();
+    shm_unlink(name.c_str());
+    return 0;
+}